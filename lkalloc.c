@@ -4,72 +4,217 @@
 #include <unistd.h>
 #include <errno.h>
 #include <assert.h>
+#include <pthread.h>
+
+#include "lklib.h"
+
+// The allocator itself calls the libc functions.
+#undef malloc
+#undef realloc
+#undef free
+#undef strdup
+#undef strndup
+
+// Allocations made by the calling thread, including reallocs.
+static __thread unsigned long nallocs = 0;
+
+#ifdef DEBUGALLOC
+// Registry of live allocations, compiled in with -DDEBUGALLOC.
+//
+// Pointers are kept in an open addressing hash table that's rebuilt when
+// half of it is used or deleted, doubling if more than a quarter is live.
+// Each pointer refers to the stats of its label, kept in a smaller table
+// of labels, for per-label leak reports.
+
+#define ALLOCITEMS_INITIAL_SIZE 1024
+#define ALLOCLABELS_INITIAL_SIZE 256
 
-#define ALLOCITEMS_SIZE 8192
 struct allocitem {
     void *p;
-    char *label;
+    size_t size;
+    LKAllocStats *stats;    // stats of the label p was allocated with
 };
-static struct allocitem allocitems[ALLOCITEMS_SIZE];
 
-void lk_alloc_init() {
-    memset(allocitems, 0, sizeof(allocitems));
+// allocitems[] slots are free (p NULL) or deleted (p DELETED_P).
+#define DELETED_P ((void *) 1)
+
+static struct allocitem *allocitems = NULL;
+static size_t allocitems_size = 0;
+static size_t allocitems_len = 0;       // slots in use, including deleted
+static size_t allocitems_live = 0;      // slots in use, not deleted
+static LKAllocStats **alloclabels = NULL;
+static size_t alloclabels_size = 0;
+static size_t alloclabels_len = 0;
+static unsigned long nuntracked = 0;    // frees of pointers not allocated by lk_malloc()
+// Guards the registry when allocating from multiple threads.
+static pthread_mutex_t allocitems_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t hash_p(void *p) {
+    // Drop the alignment bits, then mix.
+    size_t h = (size_t) p >> 4;
+    h ^= h >> 17;
+    h *= 0x9e3779b97f4a7c15UL;
+    return h ^ (h >> 29);
+}
+
+static size_t hash_label(char *label) {
+    size_t h = 2166136261u;
+    for (; *label != '\0'; label++) {
+        h = (h ^ (unsigned char) *label) * 16777619u;
+    }
+    return h;
 }
 
-// Add p to end of allocitems[].
-static void add_p(void *p, char *label) {
-    int i;
-    for (i=0; i < ALLOCITEMS_SIZE; i++) {
-        if (allocitems[i].p == NULL) {
-            allocitems[i].p = p;
-            allocitems[i].label = label;
-            break;
+static void rehash_items(size_t new_size) {
+    struct allocitem *old_items = allocitems;
+    size_t old_size = allocitems_size;
+
+    allocitems = calloc(new_size, sizeof(struct allocitem));
+    assert(allocitems != NULL);
+    allocitems_size = new_size;
+    allocitems_len = 0;
+    for (size_t i=0; i < old_size; i++) {
+        void *p = old_items[i].p;
+        if (p == NULL || p == DELETED_P) {
+            continue;
+        }
+        size_t j = hash_p(p) & (allocitems_size-1);
+        while (allocitems[j].p != NULL) {
+            j = (j+1) & (allocitems_size-1);
         }
+        allocitems[j] = old_items[i];
+        allocitems_len++;
     }
-    assert(i < ALLOCITEMS_SIZE);
+    free(old_items);
 }
 
-#if 0
-// Replace matching allocitems[] p with newp.
-static void replace_p(void *p, void *newp, char *label) {
-    int i;
-    for (i=0; i < ALLOCITEMS_SIZE; i++) {
-        if (allocitems[i].p ==  p) {
-            allocitems[i].p = newp;
-            allocitems[i].label = label;
-            break;
+// Return stats of label, adding it if not yet seen.
+static LKAllocStats *get_label_stats(char *label) {
+    if ((alloclabels_len+1) * 2 > alloclabels_size) {
+        LKAllocStats **old_labels = alloclabels;
+        size_t old_size = alloclabels_size;
+        alloclabels_size = old_size == 0 ? ALLOCLABELS_INITIAL_SIZE : old_size * 2;
+        alloclabels = calloc(alloclabels_size, sizeof(LKAllocStats *));
+        assert(alloclabels != NULL);
+        for (size_t i=0; i < old_size; i++) {
+            if (old_labels[i] == NULL) {
+                continue;
+            }
+            size_t j = hash_label(old_labels[i]->label) & (alloclabels_size-1);
+            while (alloclabels[j] != NULL) {
+                j = (j+1) & (alloclabels_size-1);
+            }
+            alloclabels[j] = old_labels[i];
+        }
+        free(old_labels);
+    }
+
+    size_t i = hash_label(label) & (alloclabels_size-1);
+    while (alloclabels[i] != NULL) {
+        if (!strcmp(alloclabels[i]->label, label)) {
+            return alloclabels[i];
         }
+        i = (i+1) & (alloclabels_size-1);
     }
-    assert(i < ALLOCITEMS_SIZE);
+    LKAllocStats *stats = calloc(1, sizeof(LKAllocStats));
+    assert(stats != NULL);
+    stats->label = label;
+    alloclabels[i] = stats;
+    alloclabels_len++;
+    return stats;
+}
+
+// Add p to allocitems[].
+static void add_p(void *p, size_t size, char *label) {
+    nallocs++;
+    if (p == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&allocitems_lock);
+    if ((allocitems_len+1) * 2 > allocitems_size) {
+        size_t new_size = allocitems_size;
+        if (new_size == 0) {
+            new_size = ALLOCITEMS_INITIAL_SIZE;
+        } else if ((allocitems_live+1) * 4 > allocitems_size) {
+            new_size *= 2;
+        }
+        rehash_items(new_size);
+    }
+    size_t i = hash_p(p) & (allocitems_size-1);
+    while (allocitems[i].p != NULL && allocitems[i].p != DELETED_P) {
+        assert(allocitems[i].p != p);
+        i = (i+1) & (allocitems_size-1);
+    }
+    if (allocitems[i].p == NULL) {
+        allocitems_len++;
+    }
+    allocitems_live++;
+    LKAllocStats *stats = get_label_stats(label);
+    allocitems[i].p = p;
+    allocitems[i].size = size;
+    allocitems[i].stats = stats;
+    stats->nallocs++;
+    stats->nlive++;
+    stats->live_bytes += size;
+    pthread_mutex_unlock(&allocitems_lock);
 }
-#endif
 
 // Clear matching allocitems[] p.
 static void clear_p(void *p) {
-    int i;
-    for (i=0; i < ALLOCITEMS_SIZE; i++) {
+    if (p == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&allocitems_lock);
+    if (allocitems_size == 0) {
+        nuntracked++;
+        pthread_mutex_unlock(&allocitems_lock);
+        return;
+    }
+    size_t i = hash_p(p) & (allocitems_size-1);
+    while (allocitems[i].p != NULL) {
         if (allocitems[i].p == p) {
-            allocitems[i].p = NULL;
-            allocitems[i].label = NULL;
-            break;
+            LKAllocStats *stats = allocitems[i].stats;
+            stats->nlive--;
+            stats->live_bytes -= allocitems[i].size;
+            allocitems[i].p = DELETED_P;
+            allocitems[i].stats = NULL;
+            allocitems_live--;
+            pthread_mutex_unlock(&allocitems_lock);
+            return;
         }
+        i = (i+1) & (allocitems_size-1);
     }
-    if (i >= ALLOCITEMS_SIZE) {
-        printf("clear_p i: %d\n", i);
+    // Not allocated by lk_malloc().
+    nuntracked++;
+    pthread_mutex_unlock(&allocitems_lock);
+}
+
+void lk_alloc_init() {
+    pthread_mutex_lock(&allocitems_lock);
+    if (allocitems_size == 0) {
+        rehash_items(ALLOCITEMS_INITIAL_SIZE);
     }
-    assert(i < ALLOCITEMS_SIZE);
+    pthread_mutex_unlock(&allocitems_lock);
 }
 
+#else
+void lk_alloc_init() {
+}
+
+#define add_p(p, size, label) (nallocs++)
+#define clear_p(p)
+#endif
+
 void *lk_malloc(size_t size, char *label) {
     void *p = malloc(size);
-    add_p(p, label);
+    add_p(p, size, label);
     return p;
 }
 
 void *lk_realloc(void *p, size_t size, char *label) {
     clear_p(p);
     void *newp = realloc(p, size);
-    add_p(newp, label);
+    add_p(newp, size, label);
     return newp;
 }
 
@@ -80,22 +225,175 @@ void lk_free(void *p) {
 
 char *lk_strdup(const char *s, char *label) {
     char *sdup = strdup(s);
-    add_p(sdup, label);
+    add_p(sdup, strlen(s)+1, label);
     return sdup;
 }
 
 char *lk_strndup(const char *s, size_t n, char *label) {
     char *sdup = strndup(s, n);
-    add_p(sdup, label);
+    add_p(sdup, sdup ? strlen(sdup)+1 : 0, label);
     return sdup;
 }
 
+// Return number of allocations made by the calling thread.
+unsigned long lk_alloc_count() {
+    return nallocs;
+}
+
+// Slab allocator for small fixed-size objects.
+//
+// Objects are rounded up to a multiple of SLAB_CLASS_SIZE bytes and
+// carved out of SLAB_CHUNK_SIZE chunks. Freed objects go on a free list
+// of their size class, to be reused by the next allocation of the same
+// class. Chunks are never returned to malloc.
+//
+// Each thread has its own free lists and chunk, so no locking is needed.
+// An object freed by another thread than the one that allocated it
+// moves to the freeing thread's free list.
+
+#define SLAB_CLASS_SIZE 16
+#define SLAB_NCLASSES (LK_SLAB_MAXSIZE / SLAB_CLASS_SIZE)
+#define SLAB_CHUNK_SIZE (64*1024)
+
+struct slabobj {
+    struct slabobj *next;   // next object in free list
+};
+
+struct slabchunk {
+    struct slabchunk *next; // chunk allocated before this one
+    char pad[SLAB_CLASS_SIZE - sizeof(struct slabchunk *)];
+};
+
+typedef struct {
+    struct slabobj *freelists[SLAB_NCLASSES];
+    struct slabchunk *chunks;
+    size_t chunk_used;      // bytes of chunks used, from start of chunk
+    LKSlabStats stats;
+} SlabCache;
+
+static __thread SlabCache slab_cache;
+
+// Return memory for an object of size bytes. Objects over
+// LK_SLAB_MAXSIZE bytes are allocated with malloc().
+void *lk_slab_alloc(size_t size) {
+    if (size == 0 || size > LK_SLAB_MAXSIZE) {
+        return malloc(size);
+    }
+    SlabCache *sc = &slab_cache;
+    int c = (size-1) / SLAB_CLASS_SIZE;
+    size_t obj_size = (c+1) * SLAB_CLASS_SIZE;
+    sc->stats.nallocs++;
+    sc->stats.live_bytes += obj_size;
+
+    struct slabobj *obj = sc->freelists[c];
+    if (obj != NULL) {
+        sc->freelists[c] = obj->next;
+        return obj;
+    }
+
+    // Carve a new object from the current chunk.
+    if (sc->chunks == NULL || sc->chunk_used + obj_size > SLAB_CHUNK_SIZE) {
+        struct slabchunk *chunk = malloc(SLAB_CHUNK_SIZE);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        chunk->next = sc->chunks;
+        sc->chunks = chunk;
+        sc->chunk_used = sizeof(struct slabchunk);
+        sc->stats.slab_bytes += SLAB_CHUNK_SIZE;
+    }
+    void *p = (char *) sc->chunks + sc->chunk_used;
+    sc->chunk_used += obj_size;
+    return p;
+}
+
+// Free object p of size bytes, allocated by lk_slab_alloc(size).
+void lk_slab_free(void *p, size_t size) {
+    if (p == NULL) {
+        return;
+    }
+    if (size == 0 || size > LK_SLAB_MAXSIZE) {
+        free(p);
+        return;
+    }
+    SlabCache *sc = &slab_cache;
+    int c = (size-1) / SLAB_CLASS_SIZE;
+    sc->stats.live_bytes -= (c+1) * SLAB_CLASS_SIZE;
+
+    struct slabobj *obj = p;
+    obj->next = sc->freelists[c];
+    sc->freelists[c] = obj;
+}
+
+// Get the calling thread's slab stats.
+void lk_slab_stats(LKSlabStats *stats) {
+    *stats = slab_cache.stats;
+}
+
+// Allocate lklib object of size bytes, from the slab allocator if built
+// with -DLK_SLAB. Free it with lk_obj_free() and the same size.
+void *lk_obj_alloc(size_t size, char *label) {
+#ifdef LK_SLAB
+    void *p = lk_slab_alloc(size);
+    add_p(p, size, label);
+    return p;
+#else
+    return lk_malloc(size, label);
+#endif
+}
+
+void lk_obj_free(void *p, size_t size) {
+#ifdef LK_SLAB
+    clear_p(p);
+    lk_slab_free(p, size);
+#else
+    lk_free(p);
+#endif
+}
+
+#ifdef DEBUGALLOC
+// Get the allocation stats of label.
+// Returns 0 on success, -1 if there were no allocations with label.
+int lk_alloc_stats(char *label, LKAllocStats *stats) {
+    int z = -1;
+    pthread_mutex_lock(&allocitems_lock);
+    if (alloclabels_size > 0) {
+        size_t i = hash_label(label) & (alloclabels_size-1);
+        while (alloclabels[i] != NULL) {
+            if (!strcmp(alloclabels[i]->label, label)) {
+                *stats = *alloclabels[i];
+                z = 0;
+                break;
+            }
+            i = (i+1) & (alloclabels_size-1);
+        }
+    }
+    pthread_mutex_unlock(&allocitems_lock);
+    return z;
+}
+
+// Print the labels of allocations not yet freed, with their number and
+// bytes.
 void lk_print_allocitems() {
+    pthread_mutex_lock(&allocitems_lock);
     printf("allocitems[] labels:\n");
-    for (int i=0; i < ALLOCITEMS_SIZE; i++) {
-        if (allocitems[i].p != NULL) {
-            printf("%s\n", allocitems[i].label);
+    for (size_t i=0; i < alloclabels_size; i++) {
+        LKAllocStats *stats = alloclabels[i];
+        if (stats == NULL || stats->nlive == 0) {
+            continue;
         }
+        printf("%s: %lu allocs, %lu bytes\n", stats->label, stats->nlive, stats->live_bytes);
+    }
+    if (nuntracked > 0) {
+        printf("(%lu frees of untracked pointers)\n", nuntracked);
     }
+    pthread_mutex_unlock(&allocitems_lock);
+}
+#else
+int lk_alloc_stats(char *label, LKAllocStats *stats) {
+    return -1;
 }
 
+void lk_print_allocitems() {
+}
+#endif
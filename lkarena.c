@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "lklib.h"
+
+// Bump allocator for objects that are all freed together.
+//
+// Allocations are carved out of blocks one after the other. When a block
+// runs out, a new one is added. Nothing is freed individually,
+// lk_arena_reset() frees everything at once, keeping the first block
+// for reuse.
+
+#define ARENA_ALIGN 16
+
+struct lkarenablock {
+    struct lkarenablock *next;  // block allocated before this one
+    size_t size;                // bytes[] capacity
+    size_t used;
+    char bytes[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+static LKArenaBlock *add_block(LKArena *arena, size_t size);
+
+LKArena *lk_arena_new(size_t block_size) {
+    if (block_size == 0) {
+        block_size = LK_BUFSIZE_XL;
+    }
+    LKArena *arena = lk_malloc(sizeof(LKArena), "lk_arena_new");
+    arena->blocks = NULL;
+    arena->block_size = block_size;
+    arena->nallocs = 0;
+    arena->nbytes = 0;
+    add_block(arena, block_size);
+    return arena;
+}
+
+void lk_arena_free(LKArena *arena) {
+    LKArenaBlock *block = arena->blocks;
+    while (block != NULL) {
+        LKArenaBlock *next = block->next;
+        lk_free(block);
+        block = next;
+    }
+    arena->blocks = NULL;
+    lk_free(arena);
+}
+
+static LKArenaBlock *add_block(LKArena *arena, size_t size) {
+    LKArenaBlock *block = lk_malloc(sizeof(LKArenaBlock) + size, "lk_arena_block");
+    block->next = arena->blocks;
+    block->size = size;
+    block->used = 0;
+    arena->blocks = block;
+    return block;
+}
+
+// Return size bytes of memory that's valid until the arena is reset.
+void *lk_arena_alloc(LKArena *arena, size_t size) {
+    size = (size + ARENA_ALIGN-1) & ~(size_t) (ARENA_ALIGN-1);
+    LKArenaBlock *block = arena->blocks;
+    if (size > block->size - block->used) {
+        // Allocations larger than a block get a block of their own.
+        block = add_block(arena, size > arena->block_size ? size : arena->block_size);
+    }
+    void *p = block->bytes + block->used;
+    block->used += size;
+    arena->nallocs++;
+    arena->nbytes += size;
+    return p;
+}
+
+char *lk_arena_strdup(LKArena *arena, char *s) {
+    size_t len = strlen(s);
+    char *sdup = lk_arena_alloc(arena, len+1);
+    memcpy(sdup, s, len+1);
+    return sdup;
+}
+
+// Free all arena allocations, keeping the first block.
+void lk_arena_reset(LKArena *arena) {
+    LKArenaBlock *block = arena->blocks;
+    while (block->next != NULL) {
+        LKArenaBlock *next = block->next;
+        lk_free(block);
+        block = next;
+    }
+    block->used = 0;
+    arena->blocks = block;
+    arena->nallocs = 0;
+    arena->nbytes = 0;
+}
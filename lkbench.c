@@ -0,0 +1,985 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <malloc.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "lklib.h"
+#include "lknet.h"
+
+void print_help();
+int bench_http(int argc, char *argv[]);
+int bench_deflate(int argc, char *argv[]);
+int bench_parse(int argc, char *argv[]);
+int bench_buffer(int argc, char *argv[]);
+int bench_alloc(int argc, char *argv[]);
+
+// lkbench http <host> <port> <path> [-c connections] [-d seconds] [-p processes] [-k] [-P depth]
+// lkbench deflate <file> [-d seconds]
+// lkbench parse [-d seconds]
+// lkbench buffer [-d seconds]
+// lkbench alloc [-d seconds]
+//
+// Benchmarks for lkws and lklib.
+//
+// http  Load generator. Keeps connections open to the server, each one
+//       repeatedly requesting path, and reports the throughput.
+//       connections = number of concurrent connections, default 50
+//       seconds     = duration of the run, default 10
+//       processes   = number of load generator processes, default 1
+//       -k          = send HTTP/1.1 keep-alive requests, reusing each
+//                     connection instead of reconnecting per request
+//       depth       = number of pipelined requests sent at a time on
+//                     each connection, implies -k
+//       Also reports the average time from connect() to the first
+//       response byte of each connection.
+//
+// deflate  Compresses file repeatedly with lk_gzip() at each level and
+//          reports the compression ratio and throughput.
+//          seconds     = duration of the run per level, default 1
+//
+// parse  Parses a typical browser request head received over a socket,
+//        line by line and in place from the receive buffer, and reports
+//        the requests parsed per second with each lk_scan()
+//        implementation the cpu supports (scalar, sse2, avx2).
+//        seconds     = duration of the run per parser, default 1
+//
+// buffer  Runs typical LKBuffer and LKString workloads, such as reading
+//         CGI output 2 KB at a time, and reports the runs per second.
+//         seconds     = duration of the run per workload, default 1
+//
+// alloc  Allocates and frees lklib sized objects with glibc malloc and
+//        with the slab allocator, and reports the allocations per second
+//        and the memory held per byte of live objects.
+//        seconds     = duration of the run per workload, default 1
+//
+// Examples:
+// lkbench http 127.0.0.1 5000 /style.css -c 100 -d 10
+// lkbench http 127.0.0.1 5000 /style.css -c 100 -k
+// lkbench http 127.0.0.1 5000 /style.css -c 100 -P 16
+// lkbench http 127.0.0.1 5000 /freerss.png -c 400 -p 4
+// lkbench deflate www/testsite/about.html
+// lkbench parse
+// lkbench buffer
+// lkbench alloc
+int main(int argc, char *argv[]) {
+    signal(SIGPIPE, SIG_IGN);
+    lk_alloc_init();
+
+    if (argc < 2) {
+        print_help();
+        exit(1);
+    }
+    if (!strcmp(argv[1], "http")) {
+        return bench_http(argc-2, argv+2);
+    }
+    if (!strcmp(argv[1], "deflate")) {
+        return bench_deflate(argc-2, argv+2);
+    }
+    if (!strcmp(argv[1], "parse")) {
+        return bench_parse(argc-2, argv+2);
+    }
+    if (!strcmp(argv[1], "buffer")) {
+        return bench_buffer(argc-2, argv+2);
+    }
+    if (!strcmp(argv[1], "alloc")) {
+        return bench_alloc(argc-2, argv+2);
+    }
+    print_help();
+    exit(1);
+}
+
+void print_help() {
+    printf(
+"Usage:\n"
+"lkbench http <host> <port> <path> [-c connections] [-d seconds] [-p processes] [-k] [-P depth]\n"
+"\n"
+"http        = load generator, reports requests per second for path\n"
+"connections = number of concurrent connections, default 50\n"
+"seconds     = duration of the run, default 10\n"
+"processes   = number of load generator processes, default 1\n"
+"-k          = reuse connections with HTTP/1.1 keep-alive\n"
+"depth       = number of pipelined requests per connection, implies -k\n"
+"\n"
+"lkbench deflate <file> [-d seconds]\n"
+"\n"
+"deflate     = compression ratio and MB/s of file at each level\n"
+"seconds     = duration of the run per level, default 1\n"
+"\n"
+"lkbench parse [-d seconds]\n"
+"\n"
+"parse       = requests per second parsing a request head, per lk_scan() implementation\n"
+"seconds     = duration of the run per parser, default 1\n"
+"\n"
+"lkbench buffer [-d seconds]\n"
+"\n"
+"buffer      = runs per second of LKBuffer and LKString workloads\n"
+"seconds     = duration of the run per workload, default 1\n"
+"\n"
+"lkbench alloc [-d seconds]\n"
+"\n"
+"alloc       = allocations per second and memory use of glibc malloc and slab allocator\n"
+"seconds     = duration of the run per workload, default 1\n"
+"\n"
+"Examples:\n"
+"lkbench http 127.0.0.1 5000 /style.css -c 100 -d 10\n"
+"lkbench http 127.0.0.1 5000 /style.css -c 100 -k\n"
+"lkbench http 127.0.0.1 5000 /style.css -c 100 -P 16\n"
+"lkbench http 127.0.0.1 5000 /freerss.png -c 400 -p 4\n"
+"lkbench deflate www/testsite/about.html\n"
+"lkbench parse\n"
+"lkbench buffer\n"
+"lkbench alloc\n"
+"\n"
+    );
+}
+
+// Return current monotonic time in seconds.
+double now_secs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*** http load generator ***/
+
+typedef enum {CONN_CONNECTING, CONN_SENDING, CONN_READING} BenchConnState;
+
+typedef struct {
+    int fd;
+    BenchConnState state;
+    size_t req_cur;         // number of request bytes sent
+    int npending;           // pipelined responses not yet received
+    char head[1024];        // response head, truncated if longer
+    size_t head_len;
+    int head_complete;
+    long body_left;         // response body bytes remaining, -1 if unknown
+    double connect_time;    // time of connect(), 0 once first byte is received
+} BenchConn;
+
+typedef struct {
+    unsigned long nresponses;   // completed 200 responses
+    unsigned long nerrors;      // failed connections or non-200 responses
+    unsigned long nbytes;       // response bytes received
+    unsigned long nconnects;    // connections that received a response
+    double first_byte_secs;     // total time from connect() to first response byte
+} BenchResult;
+
+typedef struct {
+    struct sockaddr_in sa;
+    LKString *req;
+    int nconns;
+    double duration;
+    int keepalive;
+    int pipeline;               // requests sent at a time on each connection
+} BenchHttpOpts;
+
+static int open_conn(int epfd, BenchConn *conn, int i, BenchHttpOpts *opts) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    conn->connect_time = now_secs();
+    int z = connect(fd, (struct sockaddr *) &opts->sa, sizeof(opts->sa));
+    if (z == -1 && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+
+    conn->fd = fd;
+    conn->state = CONN_CONNECTING;
+    conn->req_cur = 0;
+    conn->npending = opts->pipeline;
+    conn->head_len = 0;
+    conn->head_complete = 0;
+    conn->body_left = -1;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLOUT;
+    ev.data.u32 = i;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    return 0;
+}
+
+static void close_conn(int epfd, BenchConn *conn) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    conn->fd = -1;
+}
+
+// Start receiving the next response on conn.
+static void reset_response(BenchConn *conn) {
+    conn->head_len = 0;
+    conn->head_complete = 0;
+    conn->body_left = -1;
+}
+
+// Send the next batch of requests on an open keep-alive connection.
+static void next_request(int epfd, BenchConn *conn, int i, BenchHttpOpts *opts) {
+    conn->state = CONN_SENDING;
+    conn->req_cur = 0;
+    conn->npending = opts->pipeline;
+    reset_response(conn);
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLOUT;
+    ev.data.u32 = i;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+// Add received response bytes to conn, up to the end of the current
+// response. Sets *complete if the response is complete.
+// Returns number of bytes used.
+static size_t add_response_bytes(BenchConn *conn, char *bytes, size_t bytes_len, int *complete) {
+    size_t nused = 0;
+    *complete = 0;
+
+    if (!conn->head_complete) {
+        size_t ncopy = sizeof(conn->head)-1 - conn->head_len;
+        if (ncopy > bytes_len) {
+            ncopy = bytes_len;
+        }
+        size_t prev_len = conn->head_len;
+        memcpy(conn->head + conn->head_len, bytes, ncopy);
+        conn->head_len += ncopy;
+        conn->head[conn->head_len] = '\0';
+
+        // Head ends with a blank line.
+        char *end = strstr(conn->head, "\n\r\n");
+        int end_len = 3;
+        if (end == NULL) {
+            end = strstr(conn->head, "\n\n");
+            end_len = 2;
+        }
+        if (end == NULL) {
+            return bytes_len;
+        }
+        conn->head_complete = 1;
+        conn->head_len = end - conn->head + end_len;
+        conn->head[conn->head_len] = '\0';
+        nused = conn->head_len - prev_len;
+
+        char *cl = strcasestr(conn->head, "\nContent-Length:");
+        if (cl != NULL) {
+            conn->body_left = atol(cl + strlen("\nContent-Length:"));
+        }
+    }
+
+    // Without Content-Length, body continues until the server closes.
+    size_t navail = bytes_len - nused;
+    if (conn->body_left < 0) {
+        return bytes_len;
+    }
+    if (navail > conn->body_left) {
+        navail = conn->body_left;
+    }
+    conn->body_left -= navail;
+    nused += navail;
+    if (conn->body_left == 0) {
+        *complete = 1;
+    }
+    return nused;
+}
+
+// Count the response received on conn.
+static void count_response(BenchConn *conn, BenchResult *result) {
+    if (conn->head_len >= 12 && !strncmp(conn->head + 8, " 200", 4)) {
+        result->nresponses++;
+    } else {
+        result->nerrors++;
+    }
+}
+
+// Reconnect conn to start over with a new connection.
+static void reopen_conn(int epfd, BenchConn *conns, int i, BenchHttpOpts *opts, BenchResult *result) {
+    BenchConn *conn = &conns[i];
+    close_conn(epfd, conn);
+    if (open_conn(epfd, conn, i, opts) == -1) {
+        result->nerrors++;
+    }
+}
+
+// Read response bytes received on conn.
+static void read_responses(int epfd, BenchConn *conns, int i, BenchHttpOpts *opts, BenchResult *result, char *readbuf, size_t readbuf_size) {
+    BenchConn *conn = &conns[i];
+    while (1) {
+        int z = recv(conn->fd, readbuf, readbuf_size, 0);
+        if (z == -1 && errno == EINTR) {
+            continue;
+        }
+        if (z == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (z <= 0) {
+            // Response ends when server closes the connection.
+            if (!opts->keepalive || conn->head_complete) {
+                count_response(conn, result);
+            }
+            reopen_conn(epfd, conns, i, opts, result);
+            return;
+        }
+        result->nbytes += z;
+        if (conn->connect_time > 0) {
+            result->nconnects++;
+            result->first_byte_secs += now_secs() - conn->connect_time;
+            conn->connect_time = 0;
+        }
+
+        // Without keep-alive, each response is read until the server closes.
+        if (!opts->keepalive) {
+            if (!conn->head_complete) {
+                int complete;
+                add_response_bytes(conn, readbuf, z, &complete);
+            }
+            continue;
+        }
+
+        // One read may hold the end of one response and the start of the
+        // next pipelined response.
+        size_t cur = 0;
+        while (cur < z) {
+            int complete;
+            cur += add_response_bytes(conn, readbuf + cur, z - cur, &complete);
+            if (!complete) {
+                break;
+            }
+            count_response(conn, result);
+            if (strcasestr(conn->head, "\nConnection: close")) {
+                reopen_conn(epfd, conns, i, opts, result);
+                return;
+            }
+            conn->npending--;
+            if (conn->npending == 0) {
+                next_request(epfd, conn, i, opts);
+                return;
+            }
+            reset_response(conn);
+        }
+    }
+}
+
+static void run_http(BenchHttpOpts *opts, BenchResult *result) {
+    memset(result, 0, sizeof(BenchResult));
+
+    int epfd = epoll_create1(0);
+    if (epfd == -1) {
+        lk_exit_err("epoll_create1()");
+    }
+    BenchConn *conns = lk_malloc(sizeof(BenchConn) * opts->nconns, "run_http");
+    for (int i=0; i < opts->nconns; i++) {
+        if (open_conn(epfd, &conns[i], i, opts) == -1) {
+            lk_exit_err("connect()");
+        }
+    }
+
+    char readbuf[LK_BUFSIZE_XXL * 8];
+    struct epoll_event events[256];
+    double end_time = now_secs() + opts->duration;
+
+    while (now_secs() < end_time) {
+        int n = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]), 100);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            lk_exit_err("epoll_wait()");
+        }
+        for (int j=0; j < n; j++) {
+            int i = events[j].data.u32;
+            BenchConn *conn = &conns[i];
+
+            if (conn->state == CONN_CONNECTING) {
+                int err = 0;
+                socklen_t err_len = sizeof(err);
+                getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+                if (err != 0) {
+                    result->nerrors++;
+                    close_conn(epfd, conn);
+                    open_conn(epfd, conn, i, opts);
+                    continue;
+                }
+                conn->state = CONN_SENDING;
+            }
+            if (conn->state == CONN_SENDING) {
+                int z = send(conn->fd, opts->req->s + conn->req_cur,
+                             opts->req->s_len - conn->req_cur, MSG_NOSIGNAL);
+                if (z == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    continue;
+                }
+                if (z == -1) {
+                    result->nerrors++;
+                    close_conn(epfd, conn);
+                    open_conn(epfd, conn, i, opts);
+                    continue;
+                }
+                conn->req_cur += z;
+                if (conn->req_cur < opts->req->s_len) {
+                    continue;
+                }
+                conn->state = CONN_READING;
+                struct epoll_event ev;
+                memset(&ev, 0, sizeof(ev));
+                ev.events = EPOLLIN;
+                ev.data.u32 = i;
+                epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+                continue;
+            }
+
+            assert(conn->state == CONN_READING);
+            read_responses(epfd, conns, i, opts, result, readbuf, sizeof(readbuf));
+        }
+    }
+
+    for (int i=0; i < opts->nconns; i++) {
+        if (conns[i].fd != -1) {
+            close(conns[i].fd);
+        }
+    }
+    lk_free(conns);
+    close(epfd);
+}
+
+int bench_http(int argc, char *argv[]) {
+    if (argc < 3) {
+        print_help();
+        return 1;
+    }
+    char *host = argv[0];
+    char *port = argv[1];
+    char *path = argv[2];
+    int nprocs = 1;
+
+    BenchHttpOpts opts;
+    opts.nconns = 50;
+    opts.duration = 10;
+    opts.keepalive = 0;
+    opts.pipeline = 1;
+    for (int i=3; i < argc; i++) {
+        if (!strcmp(argv[i], "-k")) {
+            opts.keepalive = 1;
+            continue;
+        }
+        if (i == argc-1) {
+            break;
+        }
+        if (!strcmp(argv[i], "-c")) {
+            opts.nconns = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-d")) {
+            opts.duration = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-p")) {
+            nprocs = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-P")) {
+            opts.pipeline = atoi(argv[++i]);
+            opts.keepalive = 1;
+        }
+    }
+    if (opts.nconns < 1 || nprocs < 1 || opts.pipeline < 1 || opts.duration <= 0) {
+        print_help();
+        return 1;
+    }
+
+    struct addrinfo hints, *ai;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    int z = getaddrinfo(host, port, &hints, &ai);
+    if (z != 0) {
+        printf("getaddrinfo(): %s\n", gai_strerror(z));
+        return 1;
+    }
+    memcpy(&opts.sa, ai->ai_addr, sizeof(opts.sa));
+    freeaddrinfo(ai);
+
+    opts.req = lk_string_new("");
+    // HTTP/1.0 server closes the connection after each response.
+    // HTTP/1.1 keeps the connection open for the next request.
+    char *version = opts.keepalive ? "HTTP/1.1" : "HTTP/1.0";
+    lk_string_assign_sprintf(opts.req, "GET %s %s\r\nHost: %s\r\nUser-Agent: lkbench\r\n\r\n", path, version, host);
+
+    // Pipelined requests are sent back to back in one batch.
+    LKString *req = lk_string_new(opts.req->s);
+    for (int i=1; i < opts.pipeline; i++) {
+        lk_string_append(opts.req, req->s);
+    }
+    lk_string_free(req);
+
+    printf("Running %.0fs test @ http://%s:%s%s\n", opts.duration, host, port, path);
+    printf("  %d connections, %d processes%s", opts.nconns, nprocs, opts.keepalive ? ", keep-alive" : "");
+    if (opts.pipeline > 1) {
+        printf(", pipeline depth %d", opts.pipeline);
+    }
+    printf("\n");
+
+    // Each process runs its share of the connections and reports back
+    // its BenchResult through a pipe.
+    int resultfds[2];
+    if (pipe(resultfds) == -1) {
+        lk_exit_err("pipe()");
+    }
+    int total_conns = opts.nconns;
+    for (int p=0; p < nprocs; p++) {
+        BenchHttpOpts popts = opts;
+        popts.nconns = total_conns / nprocs + (p < total_conns % nprocs ? 1 : 0);
+        if (popts.nconns == 0) {
+            continue;
+        }
+        pid_t pid = fork();
+        if (pid == -1) {
+            lk_exit_err("fork()");
+        }
+        if (pid == 0) {
+            BenchResult result;
+            run_http(&popts, &result);
+            if (write(resultfds[1], &result, sizeof(result)) != sizeof(result)) {
+                exit(1);
+            }
+            exit(0);
+        }
+    }
+    close(resultfds[1]);
+
+    BenchResult total;
+    memset(&total, 0, sizeof(total));
+    BenchResult result;
+    while (read(resultfds[0], &result, sizeof(result)) == sizeof(result)) {
+        total.nresponses += result.nresponses;
+        total.nerrors += result.nerrors;
+        total.nbytes += result.nbytes;
+        total.nconnects += result.nconnects;
+        total.first_byte_secs += result.first_byte_secs;
+    }
+    close(resultfds[0]);
+    while (wait(NULL) > 0) {
+    }
+
+    printf("  %lu responses, %lu errors, %.1f MB read\n",
+        total.nresponses, total.nerrors, total.nbytes / (1024.0 * 1024.0));
+    printf("Requests/sec: %.1f\n", total.nresponses / opts.duration);
+    printf("Transfer/sec: %.2f MB\n", total.nbytes / (1024.0 * 1024.0) / opts.duration);
+    if (total.nconnects > 0) {
+        printf("Connect to first byte: %.1f us avg\n", total.first_byte_secs / total.nconnects * 1e6);
+    }
+
+    lk_string_free(opts.req);
+    return 0;
+}
+
+/*** deflate compressor ***/
+
+int bench_deflate(int argc, char *argv[]) {
+    if (argc < 1) {
+        print_help();
+        return 1;
+    }
+    char *file = argv[0];
+    double duration = 1;
+    for (int i=1; i < argc-1; i++) {
+        if (!strcmp(argv[i], "-d")) {
+            duration = atof(argv[++i]);
+        }
+    }
+    if (duration <= 0) {
+        print_help();
+        return 1;
+    }
+
+    LKBuffer *input = lk_buffer_new(0);
+    FILE *f = fopen(file, "rb");
+    if (f == NULL) {
+        lk_print_err("fopen()");
+        return 1;
+    }
+    char readbuf[LK_BUFSIZE_XXL];
+    while (1) {
+        size_t n = fread(readbuf, 1, sizeof(readbuf), f);
+        if (n == 0) {
+            break;
+        }
+        lk_buffer_append(input, readbuf, n);
+    }
+    fclose(f);
+
+    printf("Compressing %s (%ld bytes) with lk_gzip()\n", file, input->bytes_len);
+    printf("level   compressed    ratio     MB/s\n");
+    LKBuffer *out = lk_buffer_new(input->bytes_len + 64);
+    for (int level=LK_DEFLATE_FAST; level <= LK_DEFLATE_BEST; level++) {
+        unsigned long nruns = 0;
+        double start = now_secs();
+        double elapsed = 0;
+        while (elapsed < duration) {
+            out->bytes_len = 0;
+            lk_gzip(input->bytes, input->bytes_len, level, out);
+            nruns++;
+            elapsed = now_secs() - start;
+        }
+        double ratio = input->bytes_len > 0 ? (double) out->bytes_len / input->bytes_len : 0;
+        double mbs = (double) input->bytes_len * nruns / elapsed / (1024*1024);
+        printf("%5d %12ld %7.1f%% %8.1f\n", level, out->bytes_len, ratio * 100, mbs);
+    }
+
+    lk_buffer_free(out);
+    lk_buffer_free(input);
+    return 0;
+}
+
+/*** request head parser ***/
+
+// Request head as sent by a browser.
+static int bench_head_nheaders = 12;
+static char *bench_head =
+    "GET /blog/2021/little-kitten-webserver.html?ref=home&page=2 HTTP/1.1\r\n"
+    "Host: littlekitten.xyz:5000\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Referer: http://littlekitten.xyz:5000/blog/\r\n"
+    "Connection: keep-alive\r\n"
+    "Cookie: session=4f2a9c0e7b1d46e3a8c5; theme=dark; lang=en\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "If-Modified-Since: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+    "If-None-Match: \"5f3a-1c2b3d4e\"\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "\r\n";
+
+enum {PARSE_LINES, PARSE_IN_PLACE, PARSE_NEW_REQ, PARSE_SLICES};
+
+static double bench_parse_run(int mode, int fds[2], double duration, double *allocs);
+
+int bench_parse(int argc, char *argv[]) {
+    double duration = 1;
+    for (int i=0; i < argc-1; i++) {
+        if (!strcmp(argv[i], "-d")) {
+            duration = atof(argv[++i]);
+        }
+    }
+    if (duration <= 0) {
+        print_help();
+        return 1;
+    }
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+        lk_print_err("socketpair()");
+        return 1;
+    }
+    char *scan_names[] = {"", "scalar", "sse2", "avx2"};
+    char *parser_names[] = {
+        "line by line",             // lk_socketreader_readline() + parse_line()
+        "in place",                 // lk_httprequestparser_parse_head()
+        "in place, new request",    // as a new connection does
+        "in place, slices only",    // lk_httprequesthead_parse(), no socket or req
+    };
+
+    printf("Parsing %ld byte request head with %d headers\n", strlen(bench_head), bench_head_nheaders);
+    printf("parser                 scan     requests/s  allocs/request\n");
+    for (int impl=LK_SCAN_SCALAR; impl <= LK_SCAN_AVX2; impl++) {
+        if (lk_scan_select(impl) == -1) {
+            continue;
+        }
+        for (int mode=PARSE_LINES; mode <= PARSE_SLICES; mode++) {
+            double allocs;
+            double rps = bench_parse_run(mode, fds, duration, &allocs);
+            if (rps < 0) {
+                return 1;
+            }
+            printf("%-22s %-6s %12.0f %15.1f\n", parser_names[mode], scan_names[impl], rps, allocs);
+        }
+    }
+
+    close(fds[0]);
+    close(fds[1]);
+    return 0;
+}
+
+// Return requests per second parsed with mode, -1 on error.
+// *allocs is set to the allocations per request.
+static double bench_parse_run(int mode, int fds[2], double duration, double *allocs) {
+    size_t head_len = strlen(bench_head);
+    LKSocketReader *sr = lk_socketreader_new(fds[0], 0);
+    LKHttpRequestParser *parser = lk_httprequestparser_new();
+    LKHttpRequest *req = lk_httprequest_new();
+    LKString *line = lk_string_new("");
+
+    unsigned long nallocs = lk_alloc_count();
+    unsigned long nruns = 0;
+    double start = now_secs();
+    double elapsed = 0;
+    while (elapsed < duration) {
+        if (mode == PARSE_SLICES) {
+            lk_httprequesthead_parse(parser->head, bench_head, head_len);
+        } else {
+            if (send(fds[1], bench_head, head_len, 0) != head_len) {
+                lk_print_err("send()");
+                nruns = 0;
+                elapsed = -1;
+                break;
+            }
+            if (mode == PARSE_NEW_REQ) {
+                lk_httprequest_free(req);
+                req = lk_httprequest_new();
+            }
+            lk_httprequestparser_reset(parser);
+            lk_httprequest_reset(req);
+            while (!parser->head_complete) {
+                if (mode == PARSE_LINES) {
+                    lk_socketreader_readline(sr, line);
+                    lk_httprequestparser_parse_line(parser, line, req);
+                    continue;
+                }
+                lk_httprequestparser_parse_head(parser, sr->buf, req);
+                if (!parser->head_complete) {
+                    lk_socketreader_readmore(sr);
+                }
+            }
+            assert(req->headers->items_len == bench_head_nheaders);
+        }
+        nruns++;
+        elapsed = now_secs() - start;
+    }
+    *allocs = nruns > 0 ? (double) (lk_alloc_count() - nallocs) / nruns : 0;
+
+    lk_string_free(line);
+    lk_httprequest_free(req);
+    lk_httprequestparser_free(parser);
+    lk_socketreader_free(sr);
+    return elapsed > 0 ? nruns / elapsed : -1;
+}
+
+/*** LKBuffer and LKString ***/
+
+#define BENCH_BODY_SIZE (1024*1024)
+
+static char bench_chunk[LK_BUFSIZE_LARGE];
+static LKBuffer *bench_buf = NULL;
+static LKString *bench_str = NULL;
+
+// 1 MB of cgi output read 2 KB at a time, as in lk_read_all().
+static void bench_buffer_append() {
+    LKBuffer *buf = lk_buffer_new(0);
+    for (int i=0; i < BENCH_BODY_SIZE / sizeof(bench_chunk); i++) {
+        lk_buffer_append(buf, bench_chunk, sizeof(bench_chunk));
+    }
+    lk_buffer_free(buf);
+}
+
+// 1 MB request body with Content-Length known up front.
+static void bench_buffer_reserve() {
+    LKBuffer *buf = lk_buffer_new(0);
+    lk_buffer_reserve(buf, BENCH_BODY_SIZE);
+    for (int i=0; i < BENCH_BODY_SIZE / sizeof(bench_chunk); i++) {
+        lk_buffer_append(buf, bench_chunk, sizeof(bench_chunk));
+    }
+    lk_buffer_free(buf);
+}
+
+// 16 KB response written to a buffer reused across requests.
+static void bench_buffer_reuse() {
+    lk_buffer_clear(bench_buf);
+    for (int i=0; i < 32; i++) {
+        lk_buffer_append(bench_buf, bench_chunk, 512);
+    }
+}
+
+// 4 KB string built a char at a time, as in lk_string_split().
+static void bench_string_append_char() {
+    LKString *lks = lk_string_new("");
+    for (int i=0; i < 4096; i++) {
+        lk_string_append_char(lks, 'a');
+    }
+    lk_string_free(lks);
+}
+
+// Header values assigned to a string reused across requests.
+static void bench_string_assign() {
+    for (int i=0; i < 100; i++) {
+        lk_string_assign(bench_str, "text/html; charset=utf-8");
+        lk_string_append(bench_str, "; q=0.9");
+    }
+}
+
+int bench_buffer(int argc, char *argv[]) {
+    double duration = 1;
+    for (int i=0; i < argc-1; i++) {
+        if (!strcmp(argv[i], "-d")) {
+            duration = atof(argv[++i]);
+        }
+    }
+    if (duration <= 0) {
+        print_help();
+        return 1;
+    }
+
+    struct {
+        char *name;
+        void (*run)();
+    } workloads[] = {
+        {"buffer append 2 KB x 512", bench_buffer_append},
+        {"buffer reserve, append 2 KB x 512", bench_buffer_reserve},
+        {"buffer clear, append 512 B x 32", bench_buffer_reuse},
+        {"string append_char x 4096", bench_string_append_char},
+        {"string assign, append x 100", bench_string_assign},
+    };
+
+    memset(bench_chunk, 'a', sizeof(bench_chunk));
+    bench_buf = lk_buffer_new(0);
+    bench_str = lk_string_new("");
+    // Reused buffers have grown to a previous large response.
+    lk_buffer_append(bench_buf, bench_chunk, sizeof(bench_chunk));
+    lk_buffer_reserve(bench_buf, 64 * 1024);
+    lk_string_reserve(bench_str, 4096);
+
+    printf("workload                               runs/s  allocs/run\n");
+    for (int i=0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+        unsigned long nruns = 0;
+        unsigned long nallocs = lk_alloc_count();
+        double start = now_secs();
+        double elapsed = 0;
+        while (elapsed < duration) {
+            workloads[i].run();
+            nruns++;
+            elapsed = now_secs() - start;
+        }
+        nallocs = lk_alloc_count() - nallocs;
+        printf("%-34s %11.0f %11.1f\n", workloads[i].name, nruns / elapsed, (double) nallocs / nruns);
+    }
+
+    lk_string_free(bench_str);
+    lk_buffer_free(bench_buf);
+    return 0;
+}
+
+/*** slab allocator ***/
+
+// Objects allocated by lklib per connection and per request.
+static size_t bench_obj_sizes[] = {
+    sizeof(LKString), sizeof(LKBuffer), sizeof(LKStringTable), sizeof(LKRefList),
+    sizeof(LKStringList), sizeof(LKSocketReader), sizeof(LKHttpRequest), sizeof(LKHttpResponse),
+};
+#define BENCH_NOBJ_SIZES (sizeof(bench_obj_sizes) / sizeof(bench_obj_sizes[0]))
+#define BENCH_NLIVE 100000
+
+enum {ALLOC_MALLOC, ALLOC_SLAB};
+
+static void *bench_alloc_obj(int impl, size_t size) {
+    return impl == ALLOC_SLAB ? lk_slab_alloc(size) : lk_malloc(size, "bench_alloc_obj");
+}
+
+static void bench_free_obj(int impl, void *p, size_t size) {
+    if (impl == ALLOC_SLAB) {
+        lk_slab_free(p, size);
+    } else {
+        lk_free(p);
+    }
+}
+
+// Return bytes held by malloc.
+static size_t malloc_held_bytes() {
+    struct mallinfo2 mi = mallinfo2();
+    return mi.arena + mi.hblkhd;
+}
+
+// Return allocations and frees per second of one object of each size
+// at a time, as a connection is opened and closed.
+static double bench_alloc_lifo(int impl, double duration) {
+    void *objs[BENCH_NOBJ_SIZES];
+    unsigned long nruns = 0;
+    double start = now_secs();
+    double elapsed = 0;
+    while (elapsed < duration) {
+        for (int i=0; i < BENCH_NOBJ_SIZES; i++) {
+            objs[i] = bench_alloc_obj(impl, bench_obj_sizes[i]);
+        }
+        for (int i=BENCH_NOBJ_SIZES-1; i >= 0; i--) {
+            bench_free_obj(impl, objs[i], bench_obj_sizes[i]);
+        }
+        nruns++;
+        elapsed = now_secs() - start;
+    }
+    return nruns * BENCH_NOBJ_SIZES / elapsed;
+}
+
+// Return allocations and frees per second replacing random objects of
+// BENCH_NLIVE live ones, as with many connections opening and closing.
+// *held_ratio is set to the memory held per byte of live objects.
+static double bench_alloc_random(int impl, double duration, double *held_ratio) {
+    void **objs = lk_malloc(BENCH_NLIVE * sizeof(void *), "bench_alloc_random");
+    unsigned char *sizes = lk_malloc(BENCH_NLIVE, "bench_alloc_random_sizes");
+    LKSlabStats stats;
+    lk_slab_stats(&stats);
+    size_t held_start = impl == ALLOC_SLAB ? stats.slab_bytes : malloc_held_bytes();
+    size_t live_bytes = 0;
+    unsigned int seed = 1;
+
+    for (int i=0; i < BENCH_NLIVE; i++) {
+        sizes[i] = rand_r(&seed) % BENCH_NOBJ_SIZES;
+        objs[i] = bench_alloc_obj(impl, bench_obj_sizes[sizes[i]]);
+        live_bytes += bench_obj_sizes[sizes[i]];
+    }
+
+    unsigned long nruns = 0;
+    double start = now_secs();
+    double elapsed = 0;
+    while (elapsed < duration) {
+        for (int j=0; j < 1000; j++) {
+            int i = rand_r(&seed) % BENCH_NLIVE;
+            bench_free_obj(impl, objs[i], bench_obj_sizes[sizes[i]]);
+            live_bytes -= bench_obj_sizes[sizes[i]];
+            sizes[i] = rand_r(&seed) % BENCH_NOBJ_SIZES;
+            objs[i] = bench_alloc_obj(impl, bench_obj_sizes[sizes[i]]);
+            live_bytes += bench_obj_sizes[sizes[i]];
+        }
+        nruns += 1000;
+        elapsed = now_secs() - start;
+    }
+
+    lk_slab_stats(&stats);
+    size_t held_end = impl == ALLOC_SLAB ? stats.slab_bytes : malloc_held_bytes();
+    *held_ratio = (double) (held_end - held_start) / live_bytes;
+
+    for (int i=0; i < BENCH_NLIVE; i++) {
+        bench_free_obj(impl, objs[i], bench_obj_sizes[sizes[i]]);
+    }
+    lk_free(sizes);
+    lk_free(objs);
+    return nruns / elapsed;
+}
+
+int bench_alloc(int argc, char *argv[]) {
+    double duration = 1;
+    for (int i=0; i < argc-1; i++) {
+        if (!strcmp(argv[i], "-d")) {
+            duration = atof(argv[++i]);
+        }
+    }
+    if (duration <= 0) {
+        print_help();
+        return 1;
+    }
+
+    char *impl_names[] = {"glibc malloc", "slab"};
+    printf("Allocating objects of %ld sizes from %ld to %ld bytes\n", BENCH_NOBJ_SIZES, sizeof(LKString), sizeof(LKHttpResponse));
+    printf("allocator     per connection/s   %d live, random/s  held/live\n", BENCH_NLIVE);
+    for (int impl=ALLOC_MALLOC; impl <= ALLOC_SLAB; impl++) {
+        double lifo = bench_alloc_lifo(impl, duration);
+        double held_ratio;
+        double random = bench_alloc_random(impl, duration, &held_ratio);
+        printf("%-13s %16.0f %19.0f %10.2f\n", impl_names[impl], lifo, random, held_ratio);
+    }
+    return 0;
+}
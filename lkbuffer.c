@@ -8,12 +8,15 @@
 #include <assert.h>
 #include "lklib.h"
 
+// vasprintf() output is allocated by libc, so free it with libc free().
+#undef free
+
 LKBuffer *lk_buffer_new(size_t bytes_size) {
     if (bytes_size == 0) {
         bytes_size = LK_BUFSIZE_SMALL;
     }
 
-    LKBuffer *buf = lk_malloc(sizeof(LKBuffer), "lk_buffer_new");
+    LKBuffer *buf = lk_obj_alloc(sizeof(LKBuffer), "lk_buffer_new");
     buf->bytes_cur = 0;
     buf->bytes_len = 0;
     buf->bytes_size = bytes_size;
@@ -25,7 +28,7 @@ void lk_buffer_free(LKBuffer *buf) {
     assert(buf->bytes != NULL);
     lk_free(buf->bytes);
     buf->bytes = NULL;
-    lk_free(buf);
+    lk_obj_free(buf, sizeof(LKBuffer));
 }
 
 void lk_buffer_resize(LKBuffer *buf, size_t bytes_size) {
@@ -39,21 +42,45 @@ void lk_buffer_resize(LKBuffer *buf, size_t bytes_size) {
     buf->bytes = lk_realloc(buf->bytes, buf->bytes_size, "lk_buffer_resize");
 }
 
+// Empty buf, keeping its capacity.
 void lk_buffer_clear(LKBuffer *buf) {
-    memset(buf->bytes, 0, buf->bytes_len);
     buf->bytes_len = 0;
     buf->bytes_cur = 0;
 }
 
+// Grow buf capacity to at least bytes_size.
+// Returns 0 on success, -1 if out of memory.
+static int grow_bytes(LKBuffer *buf, size_t bytes_size) {
+    char *bs = lk_realloc(buf->bytes, bytes_size, "lk_buffer_grow");
+    if (bs == NULL) {
+        return -1;
+    }
+    buf->bytes = bs;
+    buf->bytes_size = bytes_size;
+    return 0;
+}
+
+// Make room for len more bytes after the current ones, such as a
+// request body of known Content-Length, in a single allocation.
+// Returns 0 on success, -1 if out of memory.
+int lk_buffer_reserve(LKBuffer *buf, size_t len) {
+    if (len <= buf->bytes_size - buf->bytes_len) {
+        return 0;
+    }
+    return grow_bytes(buf, buf->bytes_len + len);
+}
+
 int lk_buffer_append(LKBuffer *buf, char *bytes, size_t len) {
-    // If not enough capacity to append bytes, expand the bytes buffer.
+    // If not enough capacity to append bytes, at least double the
+    // capacity so repeated appends are copied a bounded number of times.
     if (len > buf->bytes_size - buf->bytes_len) {
-        char *bs = lk_realloc(buf->bytes, buf->bytes_size + len, "lk_buffer_append");
-        if (bs == NULL) {
+        size_t new_size = buf->bytes_size * 2;
+        if (new_size < buf->bytes_len + len) {
+            new_size = buf->bytes_len + len;
+        }
+        if (grow_bytes(buf, new_size) == -1) {
             return -1;
         }
-        buf->bytes = bs;
-        buf->bytes_size += len;
     }
     memcpy(buf->bytes + buf->bytes_len, bytes, len);
     buf->bytes_len += len;
@@ -101,19 +128,21 @@ void lk_buffer_append_sprintf(LKBuffer *buf, const char *fmt, ...) {
 size_t lk_buffer_readline(LKBuffer *buf, char *dst, size_t dst_len) {
     assert(dst_len > 2); // Reserve space for \n and \0.
 
+    // Copy up to and including the '\n', leaving space for null terminator.
+    char *line = buf->bytes + buf->bytes_cur;
     size_t nread = 0;
-    while (nread < dst_len-1) { // leave space for null terminator
-        if (buf->bytes_cur >= buf->bytes_len) {
-            break;
-        }
-        dst[nread] = buf->bytes[buf->bytes_cur];
-        nread++;
-        buf->bytes_cur++;
-
-        if (dst[nread-1] == '\n') {
-            break;
-        }
+    if (buf->bytes_cur < buf->bytes_len) {
+        nread = buf->bytes_len - buf->bytes_cur;
+    }
+    if (nread > dst_len-1) {
+        nread = dst_len-1;
+    }
+    char *eol = lk_scan(line, nread, "\n");
+    if (eol != NULL) {
+        nread = eol - line + 1;
     }
+    memcpy(dst, line, nread);
+    buf->bytes_cur += nread;
 
     assert(nread <= dst_len-1);
     dst[nread] = '\0';
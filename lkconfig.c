@@ -15,6 +15,17 @@ LKConfig *lk_config_new() {
     LKConfig *cfg = lk_malloc(sizeof(LKConfig), "lk_config_new");
     cfg->serverhost = lk_string_new("");
     cfg->port = lk_string_new("");
+    cfg->workers = 0;
+    cfg->threads = 0;
+    cfg->keepalive_timeout = -1;
+    cfg->keepalive_max = -1;
+    cfg->filecache_size = -1;
+    cfg->filecache_ttl = -1;
+    cfg->hotcache_size = -1;
+    cfg->compress = -1;
+    cfg->compress_minsize = -1;
+    cfg->max_body_size = -1;
+    cfg->ctxpool_size = -1;
     cfg->hostconfigs = lk_malloc(sizeof(LKHostConfig*) * HOSTCONFIGS_INITIAL_SIZE, "lk_config_new_hostconfigs");
     cfg->hostconfigs_len = 0;
     cfg->hostconfigs_size = HOSTCONFIGS_INITIAL_SIZE;
@@ -47,6 +58,17 @@ void lk_config_free(LKConfig *cfg) {
 // -------------------
 //    serverhost=127.0.0.1
 //    port=5000
+//    workers=4
+//    threads=4
+//    keepalivetimeout=5
+//    keepalivemax=100
+//    filecachesize=256
+//    filecachettl=5
+//    hotcachesize=4096
+//    compress=1
+//    compressminsize=1024
+//    maxbodysize=1024
+//    ctxpoolsize=256
 //
 //    # Matches all other hostnames
 //    hostname *
@@ -61,6 +83,7 @@ void lk_config_free(LKConfig *cfg) {
 //    hostname littlekitten.xyz
 //    homedir=/var/www/testsite
 //    cgidir=cgi-bin
+//    cachecontrol=public, max-age=3600
 //    alias latest=latest.html
 //    alias about=about.html
 //    alias guestbook=cgi-bin/guestbook.pl
@@ -121,6 +144,17 @@ int lk_config_read_configfile(LKConfig *cfg, char *configfile) {
 
             // serverhost=127.0.0.1
             // port=8000
+            // workers=4
+            // threads=4
+            // keepalivetimeout=5
+            // keepalivemax=100
+            // filecachesize=256
+            // filecachettl=5
+            // hotcachesize=4096
+            // compress=1
+            // compressminsize=1024
+            // maxbodysize=1024
+            // ctxpoolsize=256
             lk_string_split_assign(l, "=", k, v); // l:"k=v", assign k and v
             if (lk_string_sz_equal(k, "serverhost")) {
                 lk_string_assign(cfg->serverhost, v->s);
@@ -128,6 +162,39 @@ int lk_config_read_configfile(LKConfig *cfg, char *configfile) {
             } else if (lk_string_sz_equal(k, "port")) {
                 lk_string_assign(cfg->port, v->s);
                 continue;
+            } else if (lk_string_sz_equal(k, "workers")) {
+                cfg->workers = atoi(v->s);
+                continue;
+            } else if (lk_string_sz_equal(k, "threads")) {
+                cfg->threads = atoi(v->s);
+                continue;
+            } else if (lk_string_sz_equal(k, "keepalivetimeout")) {
+                cfg->keepalive_timeout = atoi(v->s);
+                continue;
+            } else if (lk_string_sz_equal(k, "keepalivemax")) {
+                cfg->keepalive_max = atoi(v->s);
+                continue;
+            } else if (lk_string_sz_equal(k, "filecachesize")) {
+                cfg->filecache_size = atoi(v->s);
+                continue;
+            } else if (lk_string_sz_equal(k, "filecachettl")) {
+                cfg->filecache_ttl = atoi(v->s);
+                continue;
+            } else if (lk_string_sz_equal(k, "hotcachesize")) {
+                cfg->hotcache_size = atoi(v->s);
+                continue;
+            } else if (lk_string_sz_equal(k, "compress")) {
+                cfg->compress = atoi(v->s);
+                continue;
+            } else if (lk_string_sz_equal(k, "compressminsize")) {
+                cfg->compress_minsize = atoi(v->s);
+                continue;
+            } else if (lk_string_sz_equal(k, "maxbodysize")) {
+                cfg->max_body_size = atoi(v->s);
+                continue;
+            } else if (lk_string_sz_equal(k, "ctxpoolsize")) {
+                cfg->ctxpool_size = atoi(v->s);
+                continue;
             }
             continue;
         }
@@ -137,6 +204,8 @@ int lk_config_read_configfile(LKConfig *cfg, char *configfile) {
             // homedir=testsite
             // cgidir=cgi-bin
             // proxyhost=localhost:8001
+            // cachecontrol=public, max-age=3600
+            // expires=3600
             lk_string_split_assign(l, "=", k, v);
             if (lk_string_sz_equal(k, "homedir")) {
                 lk_string_assign(hc->homedir, v->s);
@@ -147,6 +216,13 @@ int lk_config_read_configfile(LKConfig *cfg, char *configfile) {
             } else if (lk_string_sz_equal(k, "proxyhost")) {
                 lk_string_assign(hc->proxyhost, v->s);
                 continue;
+            } else if (lk_string_sz_equal(k, "cachecontrol")) {
+                // Value may contain '=' itself, take everything after the first one.
+                lk_string_assign(hc->cachecontrol, l->s + k->s_len + 1);
+                continue;
+            } else if (lk_string_sz_equal(k, "expires")) {
+                hc->expires = atoi(v->s);
+                continue;
             }
             // alias latest=latest.html
             lk_string_split_assign(l, " ", k, v);
@@ -236,6 +312,39 @@ LKHostConfig *lk_config_create_get_hostconfig(LKConfig *cfg, char *hostname) {
 void lk_config_print(LKConfig *cfg) {
     printf("serverhost: %s\n", cfg->serverhost->s);
     printf("port: %s\n", cfg->port->s);
+    if (cfg->workers > 0) {
+        printf("workers: %d\n", cfg->workers);
+    }
+    if (cfg->threads > 0) {
+        printf("threads: %d\n", cfg->threads);
+    }
+    if (cfg->keepalive_timeout >= 0) {
+        printf("keepalivetimeout: %d\n", cfg->keepalive_timeout);
+    }
+    if (cfg->keepalive_max >= 0) {
+        printf("keepalivemax: %d\n", cfg->keepalive_max);
+    }
+    if (cfg->filecache_size >= 0) {
+        printf("filecachesize: %d\n", cfg->filecache_size);
+    }
+    if (cfg->filecache_ttl >= 0) {
+        printf("filecachettl: %d\n", cfg->filecache_ttl);
+    }
+    if (cfg->hotcache_size >= 0) {
+        printf("hotcachesize: %d\n", cfg->hotcache_size);
+    }
+    if (cfg->compress >= 0) {
+        printf("compress: %d\n", cfg->compress);
+    }
+    if (cfg->compress_minsize >= 0) {
+        printf("compressminsize: %d\n", cfg->compress_minsize);
+    }
+    if (cfg->max_body_size >= 0) {
+        printf("maxbodysize: %d\n", cfg->max_body_size);
+    }
+    if (cfg->ctxpool_size >= 0) {
+        printf("ctxpoolsize: %d\n", cfg->ctxpool_size);
+    }
 
     for (int i=0; i < cfg->hostconfigs_len; i++) {
         LKHostConfig *hc = cfg->hostconfigs[i];
@@ -249,6 +358,12 @@ void lk_config_print(LKConfig *cfg) {
         if (hc->proxyhost->s_len > 0) {
             printf("    proxyhost: %s\n", hc->proxyhost->s);
         }
+        if (hc->cachecontrol->s_len > 0) {
+            printf("    cachecontrol: %s\n", hc->cachecontrol->s);
+        }
+        if (hc->expires >= 0) {
+            printf("    expires: %d\n", hc->expires);
+        }
         for (int j=0; j < hc->aliases->items_len; j++) {
             printf("    alias %s=%s\n", hc->aliases->items[j].k->s, hc->aliases->items[j].v->s);
         }
@@ -266,6 +381,52 @@ void lk_config_finalize(LKConfig *cfg) {
     if (cfg->port->s_len == 0) {
         lk_string_assign(cfg->port, "8000");
     }
+    // Single process server if workers not specified.
+    if (cfg->workers < 1) {
+        cfg->workers = 1;
+    }
+    // Single event loop if threads not specified.
+    if (cfg->threads < 1) {
+        cfg->threads = 1;
+    }
+    // Keep idle connections open for 5 secs if not specified.
+    if (cfg->keepalive_timeout < 0) {
+        cfg->keepalive_timeout = 5;
+    }
+    // Close connection after 100 requests if not specified.
+    if (cfg->keepalive_max < 0) {
+        cfg->keepalive_max = 100;
+    }
+    // Cache up to 256 open files per event loop if not specified.
+    if (cfg->filecache_size < 0) {
+        cfg->filecache_size = 256;
+    }
+    // Check cached files for changes every 5 secs if not specified.
+    if (cfg->filecache_ttl < 0) {
+        cfg->filecache_ttl = 5;
+    }
+    // Keep up to 4 MB of small file responses in memory if not specified.
+    if (cfg->hotcache_size < 0) {
+        cfg->hotcache_size = 4096;
+    }
+    // Compress responses at the fastest level if not specified.
+    if (cfg->compress < 0) {
+        cfg->compress = LK_DEFLATE_FAST;
+    } else if (cfg->compress > LK_DEFLATE_BEST) {
+        cfg->compress = LK_DEFLATE_BEST;
+    }
+    // Don't compress bodies under 1 KB if not specified.
+    if (cfg->compress_minsize < 0) {
+        cfg->compress_minsize = 1024;
+    }
+    // Accept request bodies up to 1 MB if not specified.
+    if (cfg->max_body_size < 0) {
+        cfg->max_body_size = 1024;
+    }
+    // Keep up to 256 idle connection contexts per event loop if not specified.
+    if (cfg->ctxpool_size < 0) {
+        cfg->ctxpool_size = 256;
+    }
 
     // Get current working directory.
     LKString *current_dir = lk_string_new("");
@@ -338,6 +499,8 @@ LKHostConfig *lk_hostconfig_new(char *hostname) {
     hc->cgidir_abspath = lk_string_new("");
     hc->aliases = lk_stringtable_new();
     hc->proxyhost = lk_string_new("");
+    hc->cachecontrol = lk_string_new("");
+    hc->expires = -1;
 
     return hc;
 }
@@ -350,6 +513,7 @@ void lk_hostconfig_free(LKHostConfig *hc) {
     lk_string_free(hc->cgidir_abspath);
     lk_stringtable_free(hc->aliases);
     lk_string_free(hc->proxyhost);
+    lk_string_free(hc->cachecontrol);
 
     hc->hostname = NULL;
     hc->homedir = NULL;
@@ -358,6 +522,7 @@ void lk_hostconfig_free(LKHostConfig *hc) {
     hc->cgidir_abspath = NULL;
     hc->aliases = NULL;
     hc->proxyhost = NULL;
+    hc->cachecontrol = NULL;
 
     lk_free(hc);
 }
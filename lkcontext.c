@@ -4,6 +4,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <assert.h>
+#include <time.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -22,68 +23,119 @@ LKContext *lk_context_new() {
     ctx->selectfd = 0;
     ctx->clientfd = 0;
     ctx->type = 0;
-    ctx->next = NULL;
 
     ctx->client_ipaddr = NULL;
     ctx->client_port = 0;
 
-    ctx->req_line = NULL;
-    ctx->req_buf = NULL;
     ctx->sr = NULL;
     ctx->reqparser = NULL;
     ctx->req = NULL;
+    ctx->arena = NULL;
+    ctx->nrequests = 0;
+    ctx->last_active = 0;
     ctx->resp = NULL;
     ctx->buflist = NULL;
+    ctx->keepalive = 0;
+    ctx->hc = NULL;
 
     ctx->cgifd = 0;
     ctx->cgi_outputbuf = NULL;
     ctx->cgi_inputbuf = NULL;
+    ctx->cgi_gzip = NULL;
+    ctx->cgi_gzipbuf = NULL;
 
     ctx->proxyfd = 0;
     ctx->proxy_respbuf = NULL;
 
+    ctx->pool_next = NULL;
     return ctx;
 }
 
+static void init_client_context(LKContext *ctx, int fd, struct sockaddr_in *sa);
+
 LKContext *create_initial_context(int fd, struct sockaddr_in *sa) {
     LKContext *ctx = lk_malloc(sizeof(LKContext), "create_initial_context");
-    ctx->selectfd = fd;
-    ctx->clientfd = fd;
-    ctx->type = CTX_READ_REQ;
-    ctx->next = NULL;
-
-    ctx->client_sa = *sa;
-    ctx->client_ipaddr = lk_get_ipaddr_string((struct sockaddr *) sa);
-    ctx->client_port = lk_get_sockaddr_port((struct sockaddr *) sa);
-
-    ctx->req_line = lk_string_new("");
-    ctx->req_buf = lk_buffer_new(0);
+    ctx->client_ipaddr = lk_string_new("");
     ctx->sr = lk_socketreader_new(fd, 0);
     ctx->reqparser = lk_httprequestparser_new();
     ctx->req = lk_httprequest_new();
+    ctx->arena = lk_arena_new(0);
+    lk_stringtable_set_arena(ctx->req->headers, ctx->arena);
     ctx->resp = lk_httpresponse_new();
+    lk_stringtable_set_arena(ctx->resp->headers, ctx->arena);
     ctx->buflist = lk_reflist_new();
 
-    ctx->cgifd = 0;
     ctx->cgi_outputbuf = NULL;
     ctx->cgi_inputbuf = NULL;
-
-    ctx->proxyfd = 0;
+    ctx->cgi_gzip = NULL;
+    ctx->cgi_gzipbuf = NULL;
     ctx->proxy_respbuf = NULL;
 
+    ctx->pool_next = NULL;
+    init_client_context(ctx, fd, sa);
     return ctx;
 }
 
+// Set up ctx to read the first request from new client fd.
+static void init_client_context(LKContext *ctx, int fd, struct sockaddr_in *sa) {
+    ctx->selectfd = fd;
+    ctx->clientfd = fd;
+    ctx->type = CTX_READ_REQ;
+
+    ctx->client_sa = *sa;
+    lk_assign_ipaddr_string(ctx->client_ipaddr, (struct sockaddr *) sa);
+    ctx->client_port = lk_get_sockaddr_port((struct sockaddr *) sa);
+
+    ctx->nrequests = 0;
+    ctx->last_active = time(NULL);
+    ctx->keepalive = 0;
+    ctx->hc = NULL;
+    ctx->cgifd = 0;
+    ctx->proxyfd = 0;
+}
+
+// Prepare client ctx to read the next request on the same connection.
+void reset_client_context(LKContext *ctx) {
+    ctx->selectfd = ctx->clientfd;
+    ctx->type = CTX_READ_REQ;
+
+    lk_httprequestparser_reset(ctx->reqparser);
+    lk_httprequest_reset(ctx->req);
+    ctx->nrequests++;
+    ctx->last_active = time(NULL);
+
+    lk_httpresponse_reset(ctx->resp);
+    lk_arena_reset(ctx->arena);
+    lk_reflist_clear(ctx->buflist);
+    ctx->keepalive = 0;
+    ctx->hc = NULL;
+
+    if (ctx->cgi_outputbuf) {
+        lk_buffer_free(ctx->cgi_outputbuf);
+        ctx->cgi_outputbuf = NULL;
+    }
+    if (ctx->cgi_inputbuf) {
+        lk_buffer_free(ctx->cgi_inputbuf);
+        ctx->cgi_inputbuf = NULL;
+    }
+    if (ctx->cgi_gzip) {
+        lk_gzipstream_free(ctx->cgi_gzip);
+        ctx->cgi_gzip = NULL;
+    }
+    if (ctx->cgi_gzipbuf) {
+        lk_buffer_free(ctx->cgi_gzipbuf);
+        ctx->cgi_gzipbuf = NULL;
+    }
+    if (ctx->proxy_respbuf) {
+        lk_buffer_free(ctx->proxy_respbuf);
+        ctx->proxy_respbuf = NULL;
+    }
+}
+
 void lk_context_free(LKContext *ctx) {
     if (ctx->client_ipaddr) {
         lk_string_free(ctx->client_ipaddr);
     }
-    if (ctx->req_line) {
-        lk_string_free(ctx->req_line);
-    }
-    if (ctx->req_buf) {
-        lk_buffer_free(ctx->req_buf);
-    }
     if (ctx->sr) {
         lk_socketreader_free(ctx->sr);
     }
@@ -96,6 +148,9 @@ void lk_context_free(LKContext *ctx) {
     if (ctx->resp) {
         lk_httpresponse_free(ctx->resp);
     }
+    if (ctx->arena) {
+        lk_arena_free(ctx->arena);
+    }
     if (ctx->buflist) {
         lk_reflist_free(ctx->buflist);
     }
@@ -105,157 +160,201 @@ void lk_context_free(LKContext *ctx) {
     if (ctx->cgi_inputbuf) {
         lk_buffer_free(ctx->cgi_inputbuf);
     }
+    if (ctx->cgi_gzip) {
+        lk_gzipstream_free(ctx->cgi_gzip);
+    }
+    if (ctx->cgi_gzipbuf) {
+        lk_buffer_free(ctx->cgi_gzipbuf);
+    }
     if (ctx->proxy_respbuf) {
         lk_buffer_free(ctx->proxy_respbuf);
     }
 
     ctx->selectfd = 0;
     ctx->clientfd = 0;
-    ctx->next = NULL;
     memset(&ctx->client_sa, 0, sizeof(struct sockaddr_in));
     ctx->client_ipaddr = NULL;
-    ctx->req_line = NULL;
-    ctx->req_buf = NULL;
     ctx->sr = NULL;
     ctx->reqparser = NULL;
     ctx->req = NULL;
+    ctx->arena = NULL;
     ctx->resp = NULL;
     ctx->buflist = NULL;
     ctx->cgifd = 0;
     ctx->cgi_outputbuf = NULL;
     ctx->cgi_inputbuf = NULL;
+    ctx->cgi_gzip = NULL;
+    ctx->cgi_gzipbuf = NULL;
     ctx->proxyfd = 0;
     ctx->proxy_respbuf = NULL;
     lk_free(ctx);
 }
 
-// Add new client ctx to end of ctx linked list.
-// Skip if ctx clientfd already in list.
-void add_new_client_context(LKContext **pphead, LKContext *ctx) {
-    assert(pphead != NULL);
-
-    if (*pphead == NULL) {
-        // first client
-        *pphead = ctx;
-    } else {
-        // add client to end of clients list
-        LKContext *p = *pphead;
-        while (p->next != NULL) {
-            // ctx fd already exists
-            if (p->clientfd == ctx->clientfd) {
-                return;
-            }
-            p = p->next;
-        }
-        p->next = ctx;
-    }
+#define CONTEXTTABLE_INITIAL_SIZE 1024
+
+static void clear_ctx_fd(LKContextTable *tbl, int fd, LKContext *ctx);
+
+/*** LKContextTable functions ***/
+LKContextTable *lk_contexttable_new() {
+    LKContextTable *tbl = lk_malloc(sizeof(LKContextTable), "lk_contexttable_new");
+    tbl->items_size = CONTEXTTABLE_INITIAL_SIZE;
+    tbl->items = lk_malloc(tbl->items_size * sizeof(LKContext*), "lk_contexttable_new_items");
+    memset(tbl->items, 0, tbl->items_size * sizeof(LKContext*));
+    tbl->pool = NULL;
+    tbl->pool_len = 0;
+    tbl->pool_max = 0;
+    return tbl;
 }
 
-// Add ctx to end of ctx linked list, allowing duplicate clientfds.
-void add_context(LKContext **pphead, LKContext *ctx) {
-    assert(pphead != NULL);
-
-    if (*pphead == NULL) {
-        // first client
-        *pphead = ctx;
-    } else {
-        // add to end of clients list
-        LKContext *p = *pphead;
-        while (p->next != NULL) {
-            p = p->next;
+// Free table along with all contexts still in it.
+void lk_contexttable_free(LKContextTable *tbl) {
+    for (int fd=0; fd < tbl->items_size; fd++) {
+        LKContext *ctx = tbl->items[fd];
+        if (ctx == NULL) {
+            continue;
         }
-        p->next = ctx;
+        clear_ctx_fd(tbl, ctx->selectfd, ctx);
+        clear_ctx_fd(tbl, ctx->clientfd, ctx);
+        tbl->items[fd] = NULL;
+        lk_context_free(ctx);
+    }
+    lk_free(tbl->items);
+    tbl->items = NULL;
+
+    while (tbl->pool != NULL) {
+        LKContext *ctx = tbl->pool;
+        tbl->pool = ctx->pool_next;
+        lk_context_free(ctx);
     }
+    tbl->pool_len = 0;
+    lk_free(tbl);
 }
 
+// Return client ctx for new connection fd, reusing one from the pool
+// if available.
+LKContext *get_initial_context(LKContextTable *tbl, int fd, struct sockaddr_in *sa) {
+    LKContext *ctx = tbl->pool;
+    if (ctx == NULL) {
+        return create_initial_context(fd, sa);
+    }
+    tbl->pool = ctx->pool_next;
+    tbl->pool_len--;
+    ctx->pool_next = NULL;
 
-// Delete first ctx having clientfd from linked list.
-// Returns 1 if context was deleted, 0 if no deletion made.
-int remove_client_context(LKContext **pphead, int clientfd) {
-    assert(pphead != NULL);
+    lk_socketreader_reset(ctx->sr, fd);
+    init_client_context(ctx, fd, sa);
+    return ctx;
+}
 
-    if (*pphead == NULL) {
-        return 0;
-    }
-    // remove head ctx
-    if ((*pphead)->clientfd == clientfd) {
-        LKContext *tmp = *pphead;
-        *pphead = (*pphead)->next;
-        lk_context_free(tmp);
-        return 1;
+// Index ctx by fd, growing the table if needed.
+static void set_ctx_fd(LKContextTable *tbl, int fd, LKContext *ctx) {
+    assert(fd >= 0);
+    if (fd >= tbl->items_size) {
+        size_t new_size = tbl->items_size;
+        while (fd >= new_size) {
+            new_size *= 2;
+        }
+        tbl->items = lk_realloc(tbl->items, new_size * sizeof(LKContext*), "set_ctx_fd");
+        memset(tbl->items + tbl->items_size, 0, (new_size - tbl->items_size) * sizeof(LKContext*));
+        tbl->items_size = new_size;
     }
+    tbl->items[fd] = ctx;
+}
 
-    LKContext *p = *pphead;
-    LKContext *prev = NULL;
-    while (p != NULL) {
-        if (p->clientfd == clientfd) {
-            assert(prev != NULL);
-            prev->next = p->next;
-            lk_context_free(p);
-            return 1;
-        }
+// Remove fd index to ctx if fd is currently indexed to ctx.
+static void clear_ctx_fd(LKContextTable *tbl, int fd, LKContext *ctx) {
+    if (fd < 0 || fd >= tbl->items_size) {
+        return;
+    }
+    if (tbl->items[fd] == ctx) {
+        tbl->items[fd] = NULL;
+    }
+}
 
-        prev = p;
-        p = p->next;
+// Return ctx indexed by fd or NULL if none.
+static LKContext *get_ctx_fd(LKContextTable *tbl, int fd) {
+    if (fd < 0 || fd >= tbl->items_size) {
+        return NULL;
     }
+    return tbl->items[fd];
+}
 
-    return 0;
+// Remove all of ctx's indexes and free it.
+// Client contexts are kept in the pool instead while it's below pool_max,
+// with their request state cleared and their buffers left allocated.
+static void remove_ctx(LKContextTable *tbl, LKContext *ctx) {
+    clear_ctx_fd(tbl, ctx->selectfd, ctx);
+    clear_ctx_fd(tbl, ctx->clientfd, ctx);
+
+    if (ctx->sr != NULL && tbl->pool_len < tbl->pool_max) {
+        reset_client_context(ctx);
+        ctx->pool_next = tbl->pool;
+        tbl->pool = ctx;
+        tbl->pool_len++;
+        return;
+    }
+    lk_context_free(ctx);
 }
 
-// Delete all ctx's having clientfd.
-//$$ todo: unused, remove this?
-void remove_client_contexts(LKContext **pphead, int clientfd) {
-    int z = 1;
-    // Keep trying to remove matching clientfd's until none left.
-    while (z != 0) {
-        z = remove_client_context(pphead, clientfd);
+// Add new client ctx, indexed by its clientfd.
+// Skip if clientfd already in table.
+void add_new_client_context(LKContextTable *tbl, LKContext *ctx) {
+    assert(tbl != NULL);
+
+    if (get_ctx_fd(tbl, ctx->clientfd) != NULL) {
+        return;
     }
+    set_ctx_fd(tbl, ctx->clientfd, ctx);
+    set_ctx_fd(tbl, ctx->selectfd, ctx);
 }
 
-// Return ctx matching selectfd.
-LKContext *match_select_ctx(LKContext *phead, int selectfd) {
-    LKContext *ctx = phead;
-    while (ctx != NULL) {
-        if (ctx->selectfd == selectfd) {
-            break;
-        }
-        ctx = ctx->next;
+// Add ctx indexed by its selectfd, allowing duplicate clientfds.
+void add_context(LKContextTable *tbl, LKContext *ctx) {
+    assert(tbl != NULL);
+    set_ctx_fd(tbl, ctx->selectfd, ctx);
+}
+
+// Switch ctx to wait on selectfd.
+// Client contexts stay indexed by their clientfd as well.
+void set_select_ctx(LKContextTable *tbl, LKContext *ctx, int selectfd) {
+    if (ctx->selectfd != ctx->clientfd) {
+        clear_ctx_fd(tbl, ctx->selectfd, ctx);
     }
-    return ctx;
+    ctx->selectfd = selectfd;
+    set_ctx_fd(tbl, selectfd, ctx);
 }
 
-// Delete first ctx having selectfd from linked list.
+// Delete ctx having clientfd from table.
 // Returns 1 if context was deleted, 0 if no deletion made.
-int remove_selectfd_context(LKContext **pphead, int selectfd) {
-    assert(pphead != NULL);
+int remove_client_context(LKContextTable *tbl, int clientfd) {
+    assert(tbl != NULL);
 
-    if (*pphead == NULL) {
+    LKContext *ctx = get_ctx_fd(tbl, clientfd);
+    if (ctx == NULL || ctx->clientfd != clientfd) {
         return 0;
     }
-    // remove head ctx
-    if ((*pphead)->selectfd == selectfd) {
-        LKContext *tmp = *pphead;
-        *pphead = (*pphead)->next;
-        lk_context_free(tmp);
-        return 1;
-    }
-
-    LKContext *p = *pphead;
-    LKContext *prev = NULL;
-    while (p != NULL) {
-        if (p->selectfd == selectfd) {
-            assert(prev != NULL);
-            prev->next = p->next;
-            lk_context_free(p);
-            return 1;
-        }
+    remove_ctx(tbl, ctx);
+    return 1;
+}
 
-        prev = p;
-        p = p->next;
+// Return ctx matching selectfd.
+LKContext *match_select_ctx(LKContextTable *tbl, int selectfd) {
+    LKContext *ctx = get_ctx_fd(tbl, selectfd);
+    if (ctx == NULL || ctx->selectfd != selectfd) {
+        return NULL;
     }
-
-    return 0;
+    return ctx;
 }
 
+// Delete ctx having selectfd from table.
+// Returns 1 if context was deleted, 0 if no deletion made.
+int remove_selectfd_context(LKContextTable *tbl, int selectfd) {
+    assert(tbl != NULL);
 
-
+    LKContext *ctx = match_select_ctx(tbl, selectfd);
+    if (ctx == NULL) {
+        return 0;
+    }
+    remove_ctx(tbl, ctx);
+    return 1;
+}
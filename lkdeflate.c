@@ -0,0 +1,781 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include "lklib.h"
+
+// Deflate (RFC 1951) and gzip (RFC 1952) compressor.
+//
+// Matches are found with hash chains over a 32K window, greedily for
+// the fast levels and with lazy matching for the higher ones. Each block
+// is written with fixed or dynamic Huffman codes, or stored as is,
+// whichever comes out smallest.
+
+#define WINDOW_SIZE 32768
+#define MIN_MATCH 3
+#define MAX_MATCH 258
+#define TOO_FAR 4096            // min length 3 matches aren't worth it beyond this distance
+#define BLOCK_SYMBOLS 16384     // max literals and matches per block
+#define MAX_STORED 65535        // max bytes per stored block
+
+#define NLITLEN 286
+#define NFIXED_LITLEN 288       // fixed code also has lengths for 286 and 287
+#define NDIST 30
+#define NCLEN 19
+#define MAX_BITS 15
+#define MAX_CLEN_BITS 7
+
+#define OUTBUF_SIZE 4096
+
+typedef struct {
+    int max_chain;      // max hash chain entries searched per match
+    int nice_len;       // stop searching once a match is this long
+    int lazy;           // look for a longer match at the next position
+} DeflateLevel;
+
+static DeflateLevel levels[] = {
+    {0, 0, 0},          // 0: stored blocks only
+    {4, 8, 0},
+    {8, 16, 0},
+    {32, 32, 0},
+    {16, 32, 1},
+    {32, 64, 1},
+    {128, 128, 1},
+    {256, 258, 1},
+    {1024, 258, 1},
+    {4096, 258, 1},     // 9: smallest output
+};
+
+typedef struct {
+    DeflateLevel *level;
+    unsigned char *in;
+    size_t in_len;
+    size_t block_start;         // input position of current block
+    size_t block_end;           // input position after the last symbol
+
+    int hash_bits;
+    int *head;                  // most recent position for each hash
+    int *prev;                  // previous position with the same hash
+    int prev_mask;
+
+    unsigned short litlens[BLOCK_SYMBOLS];  // literal byte, or 256 + match length
+    unsigned short dists[BLOCK_SYMBOLS];    // match distance, 0 for literals
+    int nsyms;
+    unsigned int litlen_freq[NLITLEN];
+    unsigned int dist_freq[NDIST];
+
+    LKBuffer *out;
+    unsigned long long bitbuf;
+    int bitcount;
+    unsigned char outbuf[OUTBUF_SIZE];
+    size_t outbuf_len;
+} Deflater;
+
+typedef struct {
+    unsigned char lens[NFIXED_LITLEN];
+    unsigned short codes[NFIXED_LITLEN];
+} HuffTree;
+
+static unsigned short length_base[] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static unsigned char length_extra[] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static unsigned short dist_base[] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static unsigned char dist_extra[] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+// Order code length code lengths are sent in.
+static unsigned char clen_order[NCLEN] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+// Lookup tables built once by init_tables().
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+static unsigned int crc_table[256];
+static unsigned char length_code[MAX_MATCH+1];     // match length -> length code - 257
+static unsigned char dist_code[512];                // see get_dist_code()
+static HuffTree fixed_litlen;
+static HuffTree fixed_dist;
+
+static void init_tables();
+static void build_codes(HuffTree *tree, int n);
+static void deflate_greedy(Deflater *d);
+static void deflate_lazy(Deflater *d);
+static void flush_block(Deflater *d, int final);
+static void flush_outbuf(Deflater *d);
+static inline void put_bits(Deflater *d, unsigned int bits, int n);
+static void align_bits(Deflater *d);
+static void deflate_bytes(char *bytes, size_t len, int level, int final, LKBuffer *out);
+
+unsigned int lk_crc32(unsigned int crc, char *bytes, size_t len) {
+    pthread_once(&tables_once, init_tables);
+    unsigned char *p = (unsigned char *) bytes;
+    crc = ~crc;
+    for (size_t i=0; i < len; i++) {
+        crc = crc_table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static void init_tables() {
+    for (unsigned int i=0; i < 256; i++) {
+        unsigned int c = i;
+        for (int k=0; k < 8; k++) {
+            c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+
+    for (int code=0; code < 29; code++) {
+        int n = 1 << length_extra[code];
+        for (int i=0; i < n && length_base[code]+i <= MAX_MATCH; i++) {
+            length_code[length_base[code]+i] = code;
+        }
+    }
+    // Length 258 has its own code rather than 227 + 31.
+    length_code[MAX_MATCH] = 28;
+
+    // Distances up to 256 are looked up directly, the rest by dist >> 7.
+    for (int code=0; code < NDIST; code++) {
+        int n = 1 << dist_extra[code];
+        for (int i=0; i < n; i++) {
+            int dist = dist_base[code] + i - 1;
+            if (dist < 256) {
+                dist_code[dist] = code;
+            } else {
+                dist_code[256 + (dist >> 7)] = code;
+            }
+        }
+    }
+
+    for (int i=0; i < NFIXED_LITLEN; i++) {
+        fixed_litlen.lens[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+    }
+    build_codes(&fixed_litlen, NFIXED_LITLEN);
+    for (int i=0; i < NDIST; i++) {
+        fixed_dist.lens[i] = 5;
+    }
+    build_codes(&fixed_dist, NDIST);
+}
+
+static inline int get_dist_code(int dist) {
+    return dist <= 256 ? dist_code[dist-1] : dist_code[256 + ((dist-1) >> 7)];
+}
+
+void lk_deflate(char *bytes, size_t len, int level, LKBuffer *out) {
+    deflate_bytes(bytes, len, level, 1, out);
+}
+
+// Compress bytes into out. The last block is marked final, or else
+// followed by an empty stored block so that the output ends on a byte
+// boundary and can be decompressed up to here.
+static void deflate_bytes(char *bytes, size_t len, int level, int final, LKBuffer *out) {
+    pthread_once(&tables_once, init_tables);
+    if (level < 0) {
+        level = 0;
+    } else if (level > 9) {
+        level = 9;
+    }
+
+    Deflater *d = lk_malloc(sizeof(Deflater), "lk_deflate");
+    d->level = &levels[level];
+    d->in = (unsigned char *) bytes;
+    d->in_len = len;
+    d->block_start = 0;
+    d->block_end = 0;
+    d->nsyms = 0;
+    memset(d->litlen_freq, 0, sizeof(d->litlen_freq));
+    memset(d->dist_freq, 0, sizeof(d->dist_freq));
+    d->out = out;
+    d->bitbuf = 0;
+    d->bitcount = 0;
+    d->outbuf_len = 0;
+
+    // Small inputs get small hash tables, which are cheaper to clear.
+    d->hash_bits = 8;
+    while (d->hash_bits < 15 && ((size_t) 1 << d->hash_bits) < len) {
+        d->hash_bits++;
+    }
+    int window = 1 << d->hash_bits;
+    d->prev_mask = window-1;
+    d->head = lk_malloc(sizeof(int) * (1 << d->hash_bits), "lk_deflate_head");
+    d->prev = lk_malloc(sizeof(int) * window, "lk_deflate_prev");
+    memset(d->head, 0xff, sizeof(int) * (1 << d->hash_bits));
+
+    if (level == 0) {
+        d->block_end = len;
+    } else if (d->level->lazy) {
+        deflate_lazy(d);
+    } else {
+        deflate_greedy(d);
+    }
+    flush_block(d, final);
+    if (!final) {
+        put_bits(d, 0, 3);
+        align_bits(d);
+        put_bits(d, 0, 16);
+        put_bits(d, 0xffff, 16);
+        flush_outbuf(d);
+    }
+
+    lk_free(d->head);
+    lk_free(d->prev);
+    lk_free(d);
+}
+
+// No file name or modification time, OS is Unix.
+static unsigned char gzip_header[] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3};
+
+static void append_gzip_trailer(unsigned int crc, unsigned int isize, LKBuffer *out) {
+    char trailer[8];
+    for (int i=0; i < 4; i++) {
+        trailer[i] = (crc >> (i*8)) & 0xff;
+        trailer[4+i] = (isize >> (i*8)) & 0xff;
+    }
+    lk_buffer_append(out, trailer, sizeof(trailer));
+}
+
+void lk_gzip(char *bytes, size_t len, int level, LKBuffer *out) {
+    lk_buffer_append(out, (char *) gzip_header, sizeof(gzip_header));
+    lk_deflate(bytes, len, level, out);
+    append_gzip_trailer(lk_crc32(0, bytes, len), (unsigned int) len, out);
+}
+
+/*** LKGzipStream functions ***/
+
+LKGzipStream *lk_gzipstream_new(int level) {
+    LKGzipStream *gs = lk_malloc(sizeof(LKGzipStream), "lk_gzipstream_new");
+    gs->level = level;
+    gs->crc = 0;
+    gs->isize = 0;
+    gs->started = 0;
+    return gs;
+}
+
+void lk_gzipstream_free(LKGzipStream *gs) {
+    lk_free(gs);
+}
+
+// Each write is compressed on its own, without matches into earlier
+// writes, and flushed so that the receiver can decompress it right away.
+void lk_gzipstream_write(LKGzipStream *gs, char *bytes, size_t len, LKBuffer *out) {
+    if (!gs->started) {
+        lk_buffer_append(out, (char *) gzip_header, sizeof(gzip_header));
+        gs->started = 1;
+    }
+    if (len == 0) {
+        return;
+    }
+    deflate_bytes(bytes, len, gs->level, 0, out);
+    gs->crc = lk_crc32(gs->crc, bytes, len);
+    gs->isize += len;
+}
+
+void lk_gzipstream_finish(LKGzipStream *gs, LKBuffer *out) {
+    lk_gzipstream_write(gs, "", 0, out);
+    // Empty final block with fixed codes: BFINAL 1, BTYPE 01, end of block.
+    static char final_block[] = {0x03, 0x00};
+    lk_buffer_append(out, final_block, sizeof(final_block));
+    append_gzip_trailer(gs->crc, gs->isize, out);
+}
+
+/*** Output ***/
+
+static void flush_outbuf(Deflater *d) {
+    lk_buffer_append(d->out, (char *) d->outbuf, d->outbuf_len);
+    d->outbuf_len = 0;
+}
+
+static inline void put_bits(Deflater *d, unsigned int bits, int n) {
+    d->bitbuf |= (unsigned long long) bits << d->bitcount;
+    d->bitcount += n;
+    while (d->bitcount >= 8) {
+        if (d->outbuf_len == OUTBUF_SIZE) {
+            flush_outbuf(d);
+        }
+        d->outbuf[d->outbuf_len++] = d->bitbuf & 0xff;
+        d->bitbuf >>= 8;
+        d->bitcount -= 8;
+    }
+}
+
+// Pad output to a byte boundary.
+static void align_bits(Deflater *d) {
+    if (d->bitcount > 0) {
+        put_bits(d, 0, 8 - d->bitcount);
+    }
+}
+
+/*** Matching ***/
+
+static inline unsigned int hash3(Deflater *d, unsigned char *p) {
+    unsigned int v = p[0] | (p[1] << 8) | (p[2] << 16);
+    return (v * 2654435761u) >> (32 - d->hash_bits);
+}
+
+static inline void insert_pos(Deflater *d, size_t pos) {
+    if (pos + MIN_MATCH > d->in_len) {
+        return;
+    }
+    unsigned int h = hash3(d, d->in + pos);
+    d->prev[pos & d->prev_mask] = d->head[h];
+    d->head[h] = pos;
+}
+
+// Insert pos into the hash chains and return length of the longest
+// earlier match of the bytes at pos, setting *dist to its distance.
+static int find_match(Deflater *d, size_t pos, int *dist) {
+    if (pos + MIN_MATCH > d->in_len) {
+        return 0;
+    }
+    unsigned char *in = d->in;
+    unsigned char *p = in + pos;
+    unsigned int h = hash3(d, p);
+    int max_len = d->in_len - pos < MAX_MATCH ? d->in_len - pos : MAX_MATCH;
+    // Positions that fell out of prev[] can't be reached either.
+    size_t max_dist = d->prev_mask+1 < WINDOW_SIZE ? d->prev_mask+1 : WINDOW_SIZE;
+
+    int best = 0;
+    int chain = d->level->max_chain;
+    int cand = d->head[h];
+    while (cand >= 0 && pos - cand <= max_dist && chain-- > 0) {
+        unsigned char *q = in + cand;
+        if (q[best] == p[best] && q[0] == p[0] && q[1] == p[1]) {
+            int n = 2;
+            while (n < max_len && q[n] == p[n]) {
+                n++;
+            }
+            if (n > best) {
+                best = n;
+                *dist = pos - cand;
+                if (n >= d->level->nice_len || n == max_len) {
+                    break;
+                }
+            }
+        }
+        int next = d->prev[cand & d->prev_mask];
+        if (next >= cand) {
+            break;
+        }
+        cand = next;
+    }
+
+    d->prev[pos & d->prev_mask] = d->head[h];
+    d->head[h] = pos;
+
+    if (best < MIN_MATCH || (best == MIN_MATCH && *dist > TOO_FAR)) {
+        return 0;
+    }
+    return best;
+}
+
+static inline void emit_literal(Deflater *d, unsigned char c) {
+    d->litlens[d->nsyms] = c;
+    d->dists[d->nsyms] = 0;
+    d->nsyms++;
+    d->litlen_freq[c]++;
+    d->block_end++;
+    if (d->nsyms == BLOCK_SYMBOLS) {
+        flush_block(d, 0);
+    }
+}
+
+static inline void emit_match(Deflater *d, int len, int dist) {
+    d->litlens[d->nsyms] = 256 + len;
+    d->dists[d->nsyms] = dist;
+    d->nsyms++;
+    d->litlen_freq[257 + length_code[len]]++;
+    d->dist_freq[get_dist_code(dist)]++;
+    d->block_end += len;
+    if (d->nsyms == BLOCK_SYMBOLS) {
+        flush_block(d, 0);
+    }
+}
+
+// Take the longest match at each position.
+static void deflate_greedy(Deflater *d) {
+    size_t pos = 0;
+    while (pos < d->in_len) {
+        int dist = 0;
+        int len = find_match(d, pos, &dist);
+        if (len == 0) {
+            emit_literal(d, d->in[pos]);
+            pos++;
+            continue;
+        }
+        emit_match(d, len, dist);
+        for (size_t i=pos+1; i < pos+len; i++) {
+            insert_pos(d, i);
+        }
+        pos += len;
+    }
+}
+
+// Defer each match by one position in case the next one is longer.
+static void deflate_lazy(Deflater *d) {
+    size_t pos = 0;
+    int prev_len = 0;
+    int prev_dist = 0;
+    int match_available = 0;
+
+    while (pos < d->in_len) {
+        int dist = 0;
+        int len = 0;
+        if (prev_len < d->level->nice_len) {
+            len = find_match(d, pos, &dist);
+        } else {
+            insert_pos(d, pos);
+        }
+
+        // Previous match is at least as long, take it.
+        if (match_available && prev_len >= MIN_MATCH && len <= prev_len) {
+            emit_match(d, prev_len, prev_dist);
+            size_t end = pos-1 + prev_len;
+            for (size_t i=pos+1; i < end; i++) {
+                insert_pos(d, i);
+            }
+            pos = end;
+            match_available = 0;
+            prev_len = 0;
+            continue;
+        }
+
+        if (match_available) {
+            emit_literal(d, d->in[pos-1]);
+        }
+        match_available = 1;
+        prev_len = len;
+        prev_dist = dist;
+        pos++;
+    }
+    if (match_available) {
+        emit_literal(d, d->in[pos-1]);
+    }
+}
+
+/*** Huffman codes ***/
+
+// Set tree->codes from tree->lens, bit reversed for output.
+static void build_codes(HuffTree *tree, int n) {
+    int bl_count[MAX_BITS+1] = {0};
+    for (int i=0; i < n; i++) {
+        bl_count[tree->lens[i]]++;
+    }
+    bl_count[0] = 0;
+
+    int next_code[MAX_BITS+1];
+    int code = 0;
+    for (int bits=1; bits <= MAX_BITS; bits++) {
+        code = (code + bl_count[bits-1]) << 1;
+        next_code[bits] = code;
+    }
+    for (int i=0; i < n; i++) {
+        int len = tree->lens[i];
+        if (len == 0) {
+            tree->codes[i] = 0;
+            continue;
+        }
+        unsigned int c = next_code[len]++;
+        unsigned int r = 0;
+        for (int k=0; k < len; k++) {
+            r = (r << 1) | (c & 1);
+            c >>= 1;
+        }
+        tree->codes[i] = r;
+    }
+}
+
+typedef struct {
+    unsigned int freq;
+    int sym;
+} HuffLeaf;
+
+static int cmp_leaf(const void *a, const void *b) {
+    const HuffLeaf *la = a;
+    const HuffLeaf *lb = b;
+    if (la->freq != lb->freq) {
+        return la->freq < lb->freq ? -1 : 1;
+    }
+    return la->sym - lb->sym;
+}
+
+// Set Huffman code lengths of n symbols from their frequencies, limited
+// to max_bits. At least two symbols always get a code so that the code
+// is complete.
+static void build_lengths(unsigned int *freq, int n, int max_bits, unsigned char *lens) {
+    HuffLeaf leaves[NLITLEN];
+    unsigned int f[NLITLEN];
+    int parent[2*NLITLEN];
+    unsigned int node_freq[2*NLITLEN];
+    int depth[2*NLITLEN];
+
+    memcpy(f, freq, sizeof(unsigned int) * n);
+    int nused = 0;
+    for (int i=0; i < n; i++) {
+        if (f[i] > 0) {
+            nused++;
+        }
+    }
+    for (int i=0; i < n && nused < 2; i++) {
+        if (f[i] == 0) {
+            f[i] = 1;
+            nused++;
+        }
+    }
+
+    while (1) {
+        int m = 0;
+        for (int i=0; i < n; i++) {
+            if (f[i] > 0) {
+                leaves[m].freq = f[i];
+                leaves[m].sym = i;
+                m++;
+            }
+        }
+        qsort(leaves, m, sizeof(HuffLeaf), cmp_leaf);
+
+        // Two queue merge: sorted leaves 0..m-1, then internal nodes
+        // m..2m-2 in the order they are created, which is also sorted.
+        for (int i=0; i < m; i++) {
+            node_freq[i] = leaves[i].freq;
+        }
+        int nleaf = 0;
+        int ninternal = m;
+        int nnodes = m;
+        for (int k=0; k < m-1; k++) {
+            int pick[2];
+            for (int j=0; j < 2; j++) {
+                if (nleaf < m && (ninternal == nnodes || node_freq[nleaf] <= node_freq[ninternal])) {
+                    pick[j] = nleaf++;
+                } else {
+                    pick[j] = ninternal++;
+                }
+            }
+            node_freq[nnodes] = node_freq[pick[0]] + node_freq[pick[1]];
+            parent[pick[0]] = nnodes;
+            parent[pick[1]] = nnodes;
+            nnodes++;
+        }
+
+        // Children always come before their parent.
+        int max_depth = 0;
+        depth[nnodes-1] = 0;
+        for (int i=nnodes-2; i >= 0; i--) {
+            depth[i] = depth[parent[i]] + 1;
+            if (depth[i] > max_depth) {
+                max_depth = depth[i];
+            }
+        }
+
+        if (max_depth <= max_bits) {
+            memset(lens, 0, n);
+            for (int i=0; i < m; i++) {
+                lens[leaves[i].sym] = depth[i];
+            }
+            return;
+        }
+
+        // Flatten the frequencies and try again.
+        for (int i=0; i < n; i++) {
+            if (f[i] > 0) {
+                f[i] = (f[i] >> 1) | 1;
+            }
+        }
+    }
+}
+
+// Run length encode code lengths into code length symbols 0-18, with
+// the extra bits of repeat symbols 16-18 in extra[].
+static int rle_lengths(unsigned char *lens, int n, unsigned char *syms, unsigned char *extra) {
+    int nsyms = 0;
+    int i = 0;
+    while (i < n) {
+        int len = lens[i];
+        int run = 1;
+        while (i+run < n && lens[i+run] == len) {
+            run++;
+        }
+        i += run;
+
+        if (len == 0) {
+            while (run >= 11) {
+                int r = run < 138 ? run : 138;
+                syms[nsyms] = 18;
+                extra[nsyms++] = r - 11;
+                run -= r;
+            }
+            if (run >= 3) {
+                syms[nsyms] = 17;
+                extra[nsyms++] = run - 3;
+                run = 0;
+            }
+        } else {
+            syms[nsyms] = len;
+            extra[nsyms++] = 0;
+            run--;
+            while (run >= 3) {
+                int r = run < 6 ? run : 6;
+                syms[nsyms] = 16;
+                extra[nsyms++] = r - 3;
+                run -= r;
+            }
+        }
+        while (run > 0) {
+            syms[nsyms] = len;
+            extra[nsyms++] = 0;
+            run--;
+        }
+    }
+    return nsyms;
+}
+
+/*** Blocks ***/
+
+// Return number of bits to send the block's symbols with the given trees.
+static size_t symbols_cost(Deflater *d, HuffTree *litlen, HuffTree *dist) {
+    size_t bits = 0;
+    for (int i=0; i < NLITLEN; i++) {
+        size_t extra = i >= 257 ? length_extra[i-257] : 0;
+        bits += d->litlen_freq[i] * (litlen->lens[i] + extra);
+    }
+    for (int i=0; i < NDIST; i++) {
+        bits += d->dist_freq[i] * (dist->lens[i] + dist_extra[i]);
+    }
+    return bits;
+}
+
+static void write_symbols(Deflater *d, HuffTree *litlen, HuffTree *dist) {
+    for (int i=0; i < d->nsyms; i++) {
+        int sym = d->litlens[i];
+        if (sym < 256) {
+            put_bits(d, litlen->codes[sym], litlen->lens[sym]);
+            continue;
+        }
+        int len = sym - 256;
+        int lcode = length_code[len];
+        put_bits(d, litlen->codes[257+lcode], litlen->lens[257+lcode]);
+        put_bits(d, len - length_base[lcode], length_extra[lcode]);
+
+        int dcode = get_dist_code(d->dists[i]);
+        put_bits(d, dist->codes[dcode], dist->lens[dcode]);
+        put_bits(d, d->dists[i] - dist_base[dcode], dist_extra[dcode]);
+    }
+    put_bits(d, litlen->codes[256], litlen->lens[256]);
+}
+
+static void write_stored(Deflater *d, int final) {
+    size_t pos = d->block_start;
+    do {
+        size_t n = d->block_end - pos;
+        if (n > MAX_STORED) {
+            n = MAX_STORED;
+        }
+        int last = final && pos+n == d->block_end;
+        put_bits(d, last, 1);
+        put_bits(d, 0, 2);
+        align_bits(d);
+        put_bits(d, n & 0xffff, 16);
+        put_bits(d, ~n & 0xffff, 16);
+        flush_outbuf(d);
+        lk_buffer_append(d->out, (char *) d->in + pos, n);
+        pos += n;
+    } while (pos < d->block_end);
+}
+
+// Write out symbols collected since the last block.
+static void flush_block(Deflater *d, int final) {
+    d->litlen_freq[256]++;
+
+    HuffTree litlen;
+    HuffTree dist;
+    build_lengths(d->litlen_freq, NLITLEN, MAX_BITS, litlen.lens);
+    build_codes(&litlen, NLITLEN);
+    build_lengths(d->dist_freq, NDIST, MAX_BITS, dist.lens);
+    build_codes(&dist, NDIST);
+
+    int hlit = NLITLEN;
+    while (hlit > 257 && litlen.lens[hlit-1] == 0) {
+        hlit--;
+    }
+    int hdist = NDIST;
+    while (hdist > 1 && dist.lens[hdist-1] == 0) {
+        hdist--;
+    }
+
+    // Literal/length and distance code lengths are sent as one sequence.
+    unsigned char lens[NLITLEN + NDIST];
+    memcpy(lens, litlen.lens, hlit);
+    memcpy(lens+hlit, dist.lens, hdist);
+    unsigned char rle_syms[NLITLEN + NDIST];
+    unsigned char rle_extra[NLITLEN + NDIST];
+    int nrle = rle_lengths(lens, hlit+hdist, rle_syms, rle_extra);
+
+    unsigned int clen_freq[NCLEN] = {0};
+    for (int i=0; i < nrle; i++) {
+        clen_freq[rle_syms[i]]++;
+    }
+    HuffTree clen;
+    build_lengths(clen_freq, NCLEN, MAX_CLEN_BITS, clen.lens);
+    build_codes(&clen, NCLEN);
+    int hclen = NCLEN;
+    while (hclen > 4 && clen.lens[clen_order[hclen-1]] == 0) {
+        hclen--;
+    }
+
+    size_t dynamic_bits = 3 + 5 + 5 + 4 + 3*hclen + symbols_cost(d, &litlen, &dist);
+    for (int i=0; i < nrle; i++) {
+        int sym = rle_syms[i];
+        dynamic_bits += clen.lens[sym] + (sym == 16 ? 2 : sym == 17 ? 3 : sym == 18 ? 7 : 0);
+    }
+    size_t fixed_bits = 3 + symbols_cost(d, &fixed_litlen, &fixed_dist);
+    size_t stored_len = d->block_end - d->block_start;
+    size_t stored_bits = (stored_len + 5 * (stored_len / MAX_STORED + 1)) * 8 + 7;
+
+    if (d->level->max_chain == 0 || (stored_bits <= fixed_bits && stored_bits <= dynamic_bits)) {
+        write_stored(d, final);
+    } else if (fixed_bits <= dynamic_bits) {
+        put_bits(d, final, 1);
+        put_bits(d, 1, 2);
+        write_symbols(d, &fixed_litlen, &fixed_dist);
+    } else {
+        put_bits(d, final, 1);
+        put_bits(d, 2, 2);
+        put_bits(d, hlit - 257, 5);
+        put_bits(d, hdist - 1, 5);
+        put_bits(d, hclen - 4, 4);
+        for (int i=0; i < hclen; i++) {
+            put_bits(d, clen.lens[clen_order[i]], 3);
+        }
+        for (int i=0; i < nrle; i++) {
+            int sym = rle_syms[i];
+            put_bits(d, clen.codes[sym], clen.lens[sym]);
+            if (sym == 16) {
+                put_bits(d, rle_extra[i], 2);
+            } else if (sym == 17) {
+                put_bits(d, rle_extra[i], 3);
+            } else if (sym == 18) {
+                put_bits(d, rle_extra[i], 7);
+            }
+        }
+        write_symbols(d, &litlen, &dist);
+    }
+
+    if (final) {
+        align_bits(d);
+        flush_outbuf(d);
+    }
+
+    d->nsyms = 0;
+    d->block_start = d->block_end;
+    memset(d->litlen_freq, 0, sizeof(d->litlen_freq));
+    memset(d->dist_freq, 0, sizeof(d->dist_freq));
+}
@@ -0,0 +1,174 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/epoll.h>
+#include "lklib.h"
+#include "lknet.h"
+
+#define N_EVENTS 1024
+#define FDMASKS_INITIAL_SIZE 1024
+
+/*** LKEventLoop functions ***/
+LKEventLoop *lk_eventloop_new() {
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        lk_print_err("epoll_create1()");
+        return NULL;
+    }
+
+    LKEventLoop *evl = lk_malloc(sizeof(LKEventLoop), "lk_eventloop_new");
+    evl->epfd = epfd;
+    evl->fdmasks_size = FDMASKS_INITIAL_SIZE;
+    evl->fdmasks = lk_malloc(evl->fdmasks_size, "lk_eventloop_new_fdmasks");
+    memset(evl->fdmasks, 0, evl->fdmasks_size);
+    evl->events_size = N_EVENTS;
+    evl->events = lk_malloc(evl->events_size * sizeof(struct epoll_event), "lk_eventloop_new_events");
+    evl->events_len = 0;
+    return evl;
+}
+
+void lk_eventloop_free(LKEventLoop *evl) {
+    close(evl->epfd);
+    lk_free(evl->fdmasks);
+    lk_free(evl->events);
+    evl->epfd = -1;
+    evl->fdmasks = NULL;
+    evl->events = NULL;
+    lk_free(evl);
+}
+
+// Grow fdmasks[] so that fd can be used as an index.
+static void grow_fdmasks(LKEventLoop *evl, int fd) {
+    size_t new_size = evl->fdmasks_size;
+    while (fd >= new_size) {
+        new_size *= 2;
+    }
+    evl->fdmasks = lk_realloc(evl->fdmasks, new_size, "grow_fdmasks");
+    memset(evl->fdmasks + evl->fdmasks_size, 0, new_size - evl->fdmasks_size);
+    evl->fdmasks_size = new_size;
+}
+
+// Register new interest mask for fd with epoll.
+static int update_fd(LKEventLoop *evl, int fd, unsigned char oldmask, unsigned char newmask) {
+    int z;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.data.fd = fd;
+    if (newmask & LKEV_READ) {
+        ev.events |= EPOLLIN;
+    }
+    if (newmask & LKEV_WRITE) {
+        ev.events |= EPOLLOUT;
+    }
+
+    if (newmask == 0) {
+        z = epoll_ctl(evl->epfd, EPOLL_CTL_DEL, fd, NULL);
+        // fd may have been closed already, which removes it from epoll.
+        if (z == -1 && (errno == ENOENT || errno == EBADF)) {
+            z = 0;
+        }
+    } else if (oldmask == 0) {
+        z = epoll_ctl(evl->epfd, EPOLL_CTL_ADD, fd, &ev);
+        // Stale registration of a previous fd with the same number.
+        if (z == -1 && errno == EEXIST) {
+            z = epoll_ctl(evl->epfd, EPOLL_CTL_MOD, fd, &ev);
+        }
+    } else {
+        z = epoll_ctl(evl->epfd, EPOLL_CTL_MOD, fd, &ev);
+        // fd was closed and reopened without clearing its mask.
+        if (z == -1 && errno == ENOENT) {
+            z = epoll_ctl(evl->epfd, EPOLL_CTL_ADD, fd, &ev);
+        }
+    }
+    if (z == -1) {
+        lk_print_err("epoll_ctl()");
+        return z;
+    }
+    evl->fdmasks[fd] = newmask;
+    return 0;
+}
+
+// Add LKEV_READ and/or LKEV_WRITE to fd's interest mask.
+// Returns 0 for success, -1 for error.
+int lk_eventloop_set(LKEventLoop *evl, int fd, int mask) {
+    assert(fd >= 0);
+    if (fd >= evl->fdmasks_size) {
+        grow_fdmasks(evl, fd);
+    }
+    unsigned char oldmask = evl->fdmasks[fd];
+    unsigned char newmask = oldmask | mask;
+    if (newmask == oldmask) {
+        return 0;
+    }
+    return update_fd(evl, fd, oldmask, newmask);
+}
+
+// Remove LKEV_READ and/or LKEV_WRITE from fd's interest mask.
+// fd is unregistered from epoll when no interest remains.
+// Returns 0 for success, -1 for error.
+int lk_eventloop_clear(LKEventLoop *evl, int fd, int mask) {
+    if (fd < 0 || fd >= evl->fdmasks_size) {
+        return 0;
+    }
+    unsigned char oldmask = evl->fdmasks[fd];
+    unsigned char newmask = oldmask & ~mask;
+    if (newmask == oldmask) {
+        return 0;
+    }
+    return update_fd(evl, fd, oldmask, newmask);
+}
+
+// Return whether any of mask is registered for fd.
+int lk_eventloop_isset(LKEventLoop *evl, int fd, int mask) {
+    if (fd < 0 || fd >= evl->fdmasks_size) {
+        return 0;
+    }
+    return (evl->fdmasks[fd] & mask) != 0;
+}
+
+// Wait for registered fds to become ready.
+// Returns number of ready fds, 0 on timeout or interrupt, -1 for error.
+// Use lk_eventloop_get_ready() to get each of the ready fds.
+int lk_eventloop_wait(LKEventLoop *evl, int timeout_ms) {
+    int z = epoll_wait(evl->epfd, evl->events, evl->events_size, timeout_ms);
+    if (z == -1 && errno == EINTR) {
+        z = 0;
+    }
+    if (z == -1) {
+        evl->events_len = 0;
+        return z;
+    }
+    evl->events_len = z;
+    return z;
+}
+
+// Return LKEV_READ and/or LKEV_WRITE readiness of ith ready fd.
+// fd is set to the ready fd.
+// Error or hangup conditions are reported as readiness for the
+// currently registered interest so that the handler sees the error
+// on its next read or write.
+// Returns 0 if fd no longer has any interest registered (stale event).
+int lk_eventloop_get_ready(LKEventLoop *evl, int i, int *fd) {
+    assert(i >= 0 && i < evl->events_len);
+    struct epoll_event *ev = &evl->events[i];
+    *fd = ev->data.fd;
+
+    int ready = 0;
+    if (ev->events & EPOLLIN) {
+        ready |= LKEV_READ;
+    }
+    if (ev->events & EPOLLOUT) {
+        ready |= LKEV_WRITE;
+    }
+    if (ev->events & (EPOLLERR | EPOLLHUP)) {
+        ready |= LKEV_READ | LKEV_WRITE;
+    }
+    if (*fd >= evl->fdmasks_size) {
+        return 0;
+    }
+    return ready & evl->fdmasks[*fd];
+}
@@ -0,0 +1,435 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "lklib.h"
+#include "lknet.h"
+
+static unsigned int hash_path(char *s);
+static LKFileCacheItem *find_item(LKFileCache *fc, char *path, unsigned int hash);
+static LKFileCacheItem *open_item(char *home_dir, char *path);
+static int is_item_current(LKFileCacheItem *item, char *path);
+static void insert_item(LKFileCache *fc, LKFileCacheItem *item, unsigned int hash);
+static void detach_item(LKFileCache *fc, LKFileCacheItem *item);
+static void lru_unlink(LKFileCache *fc, LKFileCacheItem *item);
+static void lru_push_front(LKFileCache *fc, LKFileCacheItem *item);
+static void free_item(LKFileCacheItem *item);
+static void hot_unlink(LKFileCache *fc, LKFileCacheItem *item);
+static void hot_push_front(LKFileCache *fc, LKFileCacheItem *item);
+static void drop_hot(LKFileCache *fc, LKFileCacheItem *item);
+static void free_hot(LKFileCacheItem *item);
+
+// Largest file kept as hot content.
+#define HOT_MAX_FILE_SIZE (64*1024)
+
+/*** LKFileCache functions ***/
+
+// Create cache holding up to max_items open files.
+// Cached files are checked for changes every ttl seconds.
+// max_items of 0 disables caching, files are opened on every lookup.
+// Up to hot_max_bytes of small file responses are kept in memory.
+// The cache may be shared by several threads.
+LKFileCache *lk_filecache_new(size_t max_items, int ttl, size_t hot_max_bytes) {
+    LKFileCache *fc = lk_malloc(sizeof(LKFileCache), "lk_filecache_new");
+    pthread_mutex_init(&fc->lock, NULL);
+    fc->max_items = max_items;
+    fc->items_len = 0;
+    fc->ttl = ttl;
+    fc->lru_head = NULL;
+    fc->lru_tail = NULL;
+    fc->hot_head = NULL;
+    fc->hot_tail = NULL;
+    fc->hot_bytes = 0;
+    fc->hot_max_bytes = hot_max_bytes;
+    fc->hits = 0;
+    fc->misses = 0;
+    fc->hot_hits = 0;
+    fc->hot_misses = 0;
+
+    // Power of two buckets, about two per item.
+    fc->buckets_size = 16;
+    while (fc->buckets_size < max_items * 2) {
+        fc->buckets_size *= 2;
+    }
+    fc->buckets = lk_malloc(fc->buckets_size * sizeof(LKFileCacheItem*), "lk_filecache_new_buckets");
+    memset(fc->buckets, 0, fc->buckets_size * sizeof(LKFileCacheItem*));
+    return fc;
+}
+
+// All items returned by lk_filecache_open() must be released first.
+void lk_filecache_free(LKFileCache *fc) {
+    while (fc->lru_head != NULL) {
+        detach_item(fc, fc->lru_head);
+    }
+    lk_free(fc->buckets);
+    fc->buckets = NULL;
+    pthread_mutex_destroy(&fc->lock);
+    lk_free(fc);
+}
+
+// Return open regular file <home_dir><path>, or NULL with errno set
+// if the file doesn't exist, lies outside home_dir or isn't a regular file.
+// Hot files are returned from the cache without any filesystem calls.
+// Missing files are cached too so that repeated misses are cheap.
+// Call lk_filecache_release() when done with the returned item.
+LKFileCacheItem *lk_filecache_open(LKFileCache *fc, char *home_dir, char *path, time_t now) {
+    // full_path = home_dir + path
+    // Ex. "/path/to" + "/index.html"
+    char full_path[PATH_MAX];
+    int z = snprintf(full_path, sizeof(full_path), "%s%s", home_dir, path);
+    if (z < 0 || z >= sizeof(full_path)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+
+    unsigned int hash = hash_path(full_path);
+    pthread_mutex_lock(&fc->lock);
+    LKFileCacheItem *item = find_item(fc, full_path, hash);
+
+    // Revalidate item once ttl expires.
+    if (item != NULL && now - item->validated >= fc->ttl) {
+        if (is_item_current(item, full_path)) {
+            item->validated = now;
+        } else {
+            detach_item(fc, item);
+            item = NULL;
+        }
+    }
+
+    if (item == NULL) {
+        fc->misses++;
+        item = open_item(home_dir, full_path);
+        item->fc_lock = &fc->lock;
+        item->validated = now;
+        if (fc->max_items > 0) {
+            while (fc->items_len >= fc->max_items) {
+                detach_item(fc, fc->lru_tail);
+            }
+            insert_item(fc, item, hash);
+        }
+    } else {
+        fc->hits++;
+        // Most recently used item goes to the front.
+        lru_unlink(fc, item);
+        lru_push_front(fc, item);
+    }
+
+    if (item->fd == -1) {
+        int open_errno = item->open_errno;
+        if (!item->cached) {
+            free_item(item);
+        }
+        pthread_mutex_unlock(&fc->lock);
+        errno = open_errno;
+        return NULL;
+    }
+    item->refcount++;
+    pthread_mutex_unlock(&fc->lock);
+    return item;
+}
+
+// Release item returned by lk_filecache_open().
+void lk_filecache_release(LKFileCacheItem *item) {
+    pthread_mutex_t *lock = item->fc_lock;
+    pthread_mutex_lock(lock);
+    assert(item->refcount > 0);
+    item->refcount--;
+    if (item->refcount == 0 && !item->cached) {
+        free_item(item);
+    }
+    pthread_mutex_unlock(lock);
+}
+
+// Append item's entire file contents to buf.
+// Return number of bytes read or -1 for error.
+ssize_t lk_filecache_read(LKFileCacheItem *item, LKBuffer *buf) {
+    char readbuf[BUFSIZ];
+    off_t offset = 0;
+    lk_buffer_reserve(buf, item->size);
+    while (1) {
+        // pread() leaves the shared file offset alone.
+        ssize_t z = pread(item->fd, readbuf, sizeof(readbuf), offset);
+        if (z == -1 && errno == EINTR) {
+            continue;
+        }
+        if (z == -1) {
+            return z;
+        }
+        if (z == 0) {
+            break;
+        }
+        lk_buffer_append(buf, readbuf, z);
+        offset += z;
+    }
+    return offset;
+}
+
+// Lock fc around the hot content functions below. Hot content of an
+// item stays in memory while the item is in use, so a returned
+// response can still be sent after unlocking.
+void lk_filecache_lock(LKFileCache *fc) {
+    pthread_mutex_lock(&fc->lock);
+}
+
+void lk_filecache_unlock(LKFileCache *fc) {
+    pthread_mutex_unlock(&fc->lock);
+}
+
+// Return whether item's file can be kept as hot content for owner.
+// Hot content depends on owner's settings, only the first owner of an
+// item gets to use it.
+int lk_filecache_can_hot(LKFileCache *fc, LKFileCacheItem *item, void *owner) {
+    return item->cached &&
+           item->size <= HOT_MAX_FILE_SIZE &&
+           item->size < fc->hot_max_bytes &&
+           (item->hot_bytes == 0 || item->hot_owner == owner);
+}
+
+// Return preformatted response of item for variant, or NULL if not
+// in memory yet. head_len is set to the length of the response head.
+LKBuffer *lk_filecache_get_hot(LKFileCache *fc, LKFileCacheItem *item, int variant, size_t *head_len) {
+    assert(variant >= 0 && variant < LKFILECACHE_HOT_VARIANTS);
+    LKBuffer *resp = item->hot[variant];
+    if (resp == NULL) {
+        fc->hot_misses++;
+        return NULL;
+    }
+    fc->hot_hits++;
+    hot_unlink(fc, item);
+    hot_push_front(fc, item);
+    *head_len = item->hot_head_len[variant];
+    return resp;
+}
+
+// Keep preformatted response of item for variant in memory.
+// fc takes ownership of resp. The least recently used hot content
+// of other items is dropped to stay within the hot content budget.
+void lk_filecache_set_hot(LKFileCache *fc, LKFileCacheItem *item, int variant, LKBuffer *resp, size_t head_len, void *owner) {
+    assert(variant >= 0 && variant < LKFILECACHE_HOT_VARIANTS);
+    assert(item->cached);
+    assert(item->hot[variant] == NULL);
+    assert(item->hot_bytes == 0 || item->hot_owner == owner);
+
+    if (item->hot_bytes > 0) {
+        hot_unlink(fc, item);
+    }
+    hot_push_front(fc, item);
+    item->hot[variant] = resp;
+    item->hot_head_len[variant] = head_len;
+    item->hot_owner = owner;
+    item->hot_bytes += resp->bytes_len;
+    fc->hot_bytes += resp->bytes_len;
+
+    // Hot content still being sent is skipped.
+    LKFileCacheItem *p = fc->hot_tail;
+    while (fc->hot_bytes > fc->hot_max_bytes && p != NULL) {
+        LKFileCacheItem *prev = p->hot_prev;
+        if (p->refcount == 0) {
+            drop_hot(fc, p);
+        }
+        p = prev;
+    }
+}
+
+void lk_filecache_print_stats(LKFileCache *fc) {
+    pthread_mutex_lock(&fc->lock);
+    printf("filecache: %ld items, %ld hits, %ld misses\n", fc->items_len, fc->hits, fc->misses);
+    printf("hot content: %ld bytes, %ld hits, %ld misses\n", fc->hot_bytes, fc->hot_hits, fc->hot_misses);
+    pthread_mutex_unlock(&fc->lock);
+}
+
+// FNV-1a hash
+static unsigned int hash_path(char *s) {
+    unsigned int h = 2166136261u;
+    for (; *s != '\0'; s++) {
+        h ^= (unsigned char) *s;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static LKFileCacheItem *find_item(LKFileCache *fc, char *path, unsigned int hash) {
+    LKFileCacheItem *item = fc->buckets[hash & (fc->buckets_size-1)];
+    while (item != NULL) {
+        if (item->hash == hash && !strcmp(item->path->s, path)) {
+            return item;
+        }
+        item = item->hnext;
+    }
+    return NULL;
+}
+
+// Open full path file, returning a negative item (fd -1) on error.
+static LKFileCacheItem *open_item(char *home_dir, char *path) {
+    LKFileCacheItem *item = lk_malloc(sizeof(LKFileCacheItem), "open_item");
+    memset(item, 0, sizeof(LKFileCacheItem));
+    item->path = lk_string_new(path);
+    item->fd = -1;
+
+    // Expand "/../", etc. into real_path.
+    char real_path[PATH_MAX];
+    char *pz = realpath(path, real_path);
+    // real_path should start with home_dir
+    if (pz == NULL || strncmp(real_path, home_dir, strlen(home_dir))) {
+        item->open_errno = EPERM;
+        return item;
+    }
+
+    int fd = open(real_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        item->open_errno = errno;
+        return item;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        item->open_errno = EISDIR;
+        return item;
+    }
+    item->fd = fd;
+    item->dev = st.st_dev;
+    item->ino = st.st_ino;
+    item->size = st.st_size;
+    item->mtime = st.st_mtime;
+    snprintf(item->etag, sizeof(item->etag), "\"%lx-%lx-%lx\"",
+             (unsigned long) item->ino, (unsigned long) item->size, (unsigned long) item->mtime);
+    lk_http_date_string(item->mtime, item->last_modified, sizeof(item->last_modified));
+    return item;
+}
+
+// Return whether path still refers to the same unmodified file as item,
+// or is still missing for a negative item.
+static int is_item_current(LKFileCacheItem *item, char *path) {
+    struct stat st;
+    int z = stat(path, &st);
+    if (item->fd == -1) {
+        return z == -1;
+    }
+    return z == 0 &&
+           st.st_dev == item->dev && st.st_ino == item->ino &&
+           st.st_size == item->size && st.st_mtime == item->mtime;
+}
+
+static void insert_item(LKFileCache *fc, LKFileCacheItem *item, unsigned int hash) {
+    size_t i = hash & (fc->buckets_size-1);
+    item->hash = hash;
+    item->hnext = fc->buckets[i];
+    fc->buckets[i] = item;
+    item->cached = 1;
+    lru_push_front(fc, item);
+    fc->items_len++;
+}
+
+// Remove item from cache. It is freed once no longer in use.
+static void detach_item(LKFileCache *fc, LKFileCacheItem *item) {
+    assert(item->cached);
+    LKFileCacheItem **pp = &fc->buckets[item->hash & (fc->buckets_size-1)];
+    while (*pp != item) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = item->hnext;
+    item->hnext = NULL;
+    lru_unlink(fc, item);
+    item->cached = 0;
+    fc->items_len--;
+
+    // Hot content of an item in use is freed along with the item.
+    if (item->hot_bytes > 0) {
+        hot_unlink(fc, item);
+        fc->hot_bytes -= item->hot_bytes;
+    }
+
+    if (item->refcount == 0) {
+        free_item(item);
+    }
+}
+
+static void lru_unlink(LKFileCache *fc, LKFileCacheItem *item) {
+    if (item->prev != NULL) {
+        item->prev->next = item->next;
+    } else {
+        fc->lru_head = item->next;
+    }
+    if (item->next != NULL) {
+        item->next->prev = item->prev;
+    } else {
+        fc->lru_tail = item->prev;
+    }
+    item->prev = NULL;
+    item->next = NULL;
+}
+
+static void lru_push_front(LKFileCache *fc, LKFileCacheItem *item) {
+    item->prev = NULL;
+    item->next = fc->lru_head;
+    if (fc->lru_head != NULL) {
+        fc->lru_head->prev = item;
+    }
+    fc->lru_head = item;
+    if (fc->lru_tail == NULL) {
+        fc->lru_tail = item;
+    }
+}
+
+static void hot_unlink(LKFileCache *fc, LKFileCacheItem *item) {
+    if (item->hot_prev != NULL) {
+        item->hot_prev->hot_next = item->hot_next;
+    } else {
+        fc->hot_head = item->hot_next;
+    }
+    if (item->hot_next != NULL) {
+        item->hot_next->hot_prev = item->hot_prev;
+    } else {
+        fc->hot_tail = item->hot_prev;
+    }
+    item->hot_prev = NULL;
+    item->hot_next = NULL;
+}
+
+static void hot_push_front(LKFileCache *fc, LKFileCacheItem *item) {
+    item->hot_prev = NULL;
+    item->hot_next = fc->hot_head;
+    if (fc->hot_head != NULL) {
+        fc->hot_head->hot_prev = item;
+    }
+    fc->hot_head = item;
+    if (fc->hot_tail == NULL) {
+        fc->hot_tail = item;
+    }
+}
+
+// Free item's hot content, leaving the open file cached.
+static void drop_hot(LKFileCache *fc, LKFileCacheItem *item) {
+    hot_unlink(fc, item);
+    fc->hot_bytes -= item->hot_bytes;
+    free_hot(item);
+}
+
+static void free_hot(LKFileCacheItem *item) {
+    for (int i=0; i < LKFILECACHE_HOT_VARIANTS; i++) {
+        if (item->hot[i] != NULL) {
+            lk_buffer_free(item->hot[i]);
+            item->hot[i] = NULL;
+        }
+        item->hot_head_len[i] = 0;
+    }
+    item->hot_bytes = 0;
+    item->hot_owner = NULL;
+}
+
+static void free_item(LKFileCacheItem *item) {
+    free_hot(item);
+    if (item->fd != -1) {
+        close(item->fd);
+    }
+    lk_string_free(item->path);
+    item->path = NULL;
+    lk_free(item);
+}
@@ -46,6 +46,40 @@ void parse_cgi_output(LKBuffer *buf, LKHttpResponse *resp) {
     }
 }
 
+// Parse the complete header lines in buf starting from buf->bytes_cur,
+// for cgi output that is still coming in.
+// buf->bytes_cur is updated to point to the first byte not parsed.
+// Returns 1 once the empty line ending the headers is parsed, 0 if more
+// output is needed, -1 if the headers don't end within max_len bytes.
+int parse_cgi_head(LKBuffer *buf, size_t max_len, LKHttpResponse *resp) {
+    char cgiline[LK_BUFSIZE_MEDIUM];
+
+    while (buf->bytes_cur < buf->bytes_len) {
+        if (buf->bytes_cur >= max_len) {
+            return -1;
+        }
+        char *line = buf->bytes + buf->bytes_cur;
+        char *eol = lk_scan(line, buf->bytes_len - buf->bytes_cur, "\n");
+        if (eol == NULL) {
+            break;
+        }
+        size_t line_len = eol - line + 1;
+        buf->bytes_cur += line_len;
+        snprintf(cgiline, sizeof(cgiline), "%.*s", (int) line_len, line);
+        lk_chomp(cgiline);
+
+        if (is_empty_line(cgiline)) {
+            return 1;
+        }
+        parse_cgi_header_line(cgiline, resp);
+    }
+    // Rest of the output is a partial line.
+    if (buf->bytes_len >= max_len) {
+        return -1;
+    }
+    return 0;
+}
+
 // Parse header line in the format Ex. User-Agent: browser
 void parse_cgi_header_line(char *line, LKHttpResponse *resp) {
     char *saveptr;
@@ -6,44 +6,182 @@
 #include <unistd.h>
 #include <errno.h>
 #include <assert.h>
+#include <ctype.h>
+#include <stdint.h>
 #include "lklib.h"
 #include "lknet.h"
 
+// Chunked body parser states
+// Ex. "1a;ext=1\r\n<26 bytes>\r\n0\r\nTrailer: x\r\n\r\n"
+enum {
+    CHUNK_SIZE_START,       // first hex digit of chunk size
+    CHUNK_SIZE,             // more hex digits of chunk size
+    CHUNK_EXT,              // chunk extensions up to end of size line
+    CHUNK_DATA,             // chunk_left bytes of chunk data
+    CHUNK_DATA_END,         // CRLF after chunk data
+    CHUNK_TRAILER,          // start of trailer line, empty line ends body
+    CHUNK_TRAILER_LINE,     // rest of trailer line
+};
+
+// Longest request head accepted, longer heads are rejected with 431.
+#define MAX_HEAD_SIZE (64*1024)
+// Body bytes allocated up front from Content-Length, larger bodies
+// grow as they're received.
+#define MAX_BODY_RESERVE (1024*1024)
+
 void parse_line(LKHttpRequestParser *parser, char *line, LKHttpRequest *req);
 void parse_request_line(char *line, LKHttpRequest *req);
 static void parse_header_line(LKHttpRequestParser *parser, char *line, LKHttpRequest *req);
+static void parse_head_bytes(LKHttpRequestParser *parser, char *bytes, size_t len, LKHttpRequest *req);
+static char *slice_sz(char *bytes, LKSlice slice);
+static void add_header(LKHttpRequestParser *parser, char *k, char *v, LKHttpRequest *req);
+static void end_head(LKHttpRequestParser *parser);
+static void parse_chunked_bytes(LKHttpRequestParser *parser, LKBuffer *buf, LKHttpRequest *req);
+static void end_chunk_size_line(LKHttpRequestParser *parser, LKHttpRequest *req);
+static void reject_request(LKHttpRequestParser *parser, int status);
 void parse_uri(LKString *lks_uri, LKString *lks_path, LKString *lks_filename, LKString *lks_qs);
 
+/*** LKHttpRequestHead functions ***/
+LKHttpRequestHead *lk_httprequesthead_new() {
+    LKHttpRequestHead *head = lk_malloc(sizeof(LKHttpRequestHead), "lk_httprequesthead_new");
+    memset(&head->method, 0, sizeof(LKSlice));
+    memset(&head->uri, 0, sizeof(LKSlice));
+    memset(&head->version, 0, sizeof(LKSlice));
+    head->headers_len = 0;
+    head->headers_size = 16;
+    head->headers = lk_malloc(head->headers_size * sizeof(LKHeaderSlice), "lk_httprequesthead_new_headers");
+    return head;
+}
+
+void lk_httprequesthead_free(LKHttpRequestHead *head) {
+    lk_free(head->headers);
+    head->headers = NULL;
+    lk_free(head);
+}
+
+static int is_blank(char ch) {
+    return ch == ' ' || ch == '\t';
+}
+
+// Parse request head in bytes into slices of bytes, in one pass and
+// without copying. Nothing is allocated unless there are more headers
+// than ever before, which grows the headers array.
+// bytes is the request line and header lines up to the empty line.
+// Ex. "GET /index.html HTTP/1.1\r\nHost: localhost:8000\r\n\r\n" ==>
+// method = "GET", uri = "/index.html", version = "HTTP/1.1"
+// headers = {"Host", "localhost:8000"}
+// When bytes ends with a line end, every slice is followed by a delimiter
+// byte within bytes.
+void lk_httprequesthead_parse(LKHttpRequestHead *head, char *bytes, size_t len) {
+    head->headers_len = 0;
+
+    // Request line: method, uri and version separated by spaces or tabs.
+    char *eol = lk_scan(bytes, len, "\n");
+    size_t line_end = eol != NULL ? eol - bytes : len;
+    LKSlice *toks[] = {&head->method, &head->uri, &head->version};
+    size_t pos = 0;
+    for (int i=0; i < 3; i++) {
+        while (pos < line_end && (is_blank(bytes[pos]) || bytes[pos] == '\r')) {
+            pos++;
+        }
+        toks[i]->offset = pos;
+        char *tok_end = lk_scan(bytes+pos, line_end-pos, " \t\r");
+        pos = tok_end != NULL ? tok_end - bytes : line_end;
+        toks[i]->len = pos - toks[i]->offset;
+    }
+
+    // Header lines: "name: value" up to the empty line.
+    for (pos = line_end+1; pos < len; pos = line_end+1) {
+        // Value is everything after the first ':', it may contain ':' itself.
+        // Ex. "Host: localhost:8000"
+        char *colon = lk_scan(bytes+pos, len-pos, ":\n");
+        eol = colon;
+        if (colon != NULL && *colon == ':') {
+            eol = lk_scan(colon+1, len - (colon+1 - bytes), "\n");
+        } else {
+            colon = NULL;
+        }
+        line_end = eol != NULL ? eol - bytes : len;
+        size_t end = line_end;
+        if (end > pos && bytes[end-1] == '\r') {
+            end--;
+        }
+        if (end == pos) {
+            break;
+        }
+        // Lines without a name are skipped.
+        if (bytes[pos] == ':') {
+            continue;
+        }
+
+        size_t name_end = colon != NULL ? colon - bytes : end;
+        size_t v = colon != NULL ? name_end+1 : end;
+        while (v < end && is_blank(bytes[v])) {
+            v++;
+        }
+        size_t v_end = end;
+        while (v_end > v && is_blank(bytes[v_end-1])) {
+            v_end--;
+        }
+
+        if (head->headers_len == head->headers_size) {
+            head->headers_size *= 2;
+            head->headers = lk_realloc(head->headers, head->headers_size * sizeof(LKHeaderSlice), "lk_httprequesthead_parse");
+        }
+        LKHeaderSlice *hs = &head->headers[head->headers_len];
+        hs->name.offset = pos;
+        hs->name.len = name_end - pos;
+        hs->value.offset = v;
+        hs->value.len = v_end - v;
+        head->headers_len++;
+    }
+}
+
 /*** LKHttpRequestParser functions ***/
 LKHttpRequestParser *lk_httprequestparser_new() {
     LKHttpRequestParser *parser = lk_malloc(sizeof(LKHttpRequestParser), "lk_httprequest_parser_new");
     parser->partial_line = lk_string_new("");
+    parser->head = lk_httprequesthead_new();
+    parser->head_scanned = 0;
     parser->nlinesread = 0;
     parser->content_length = 0;
     parser->head_complete = 0;
     parser->body_complete = 0;
+    parser->chunked = 0;
+    parser->chunk_state = CHUNK_SIZE_START;
+    parser->chunk_left = 0;
+    parser->max_body_size = 0;
+    parser->error_status = 0;
     return parser;
 }
 
 void lk_httprequestparser_free(LKHttpRequestParser *parser) {
     lk_string_free(parser->partial_line);
     parser->partial_line = NULL;
+    lk_httprequesthead_free(parser->head);
+    parser->head = NULL;
     lk_free(parser);
 }
 
-// Clear any pending state.
+// Clear any pending state. max_body_size is kept.
 void lk_httprequestparser_reset(LKHttpRequestParser *parser) {
     lk_string_assign(parser->partial_line, "");
+    parser->head_scanned = 0;
     parser->nlinesread = 0;
     parser->content_length = 0;
     parser->head_complete = 0;
     parser->body_complete = 0;
+    parser->chunked = 0;
+    parser->chunk_state = CHUNK_SIZE_START;
+    parser->chunk_left = 0;
+    parser->error_status = 0;
 }
 
 // Parse one line and cumulatively compile results into req.
 // You can check the state of the parser through the following fields:
 // parser->head_complete   Request Line and Headers complete
 // parser->body_complete   httprequest is complete
+// parser->error_status    request is rejected with this http status
 void lk_httprequestparser_parse_line(LKHttpRequestParser *parser, LKString *line, LKHttpRequest *req) {
     // If there's a previous partial line, combine it with current line.
     if (parser->partial_line->s_len > 0) {
@@ -79,12 +217,7 @@ void parse_line(LKHttpRequestParser *parser, char *line, LKHttpRequest *req) {
     if (!parser->head_complete) {
         // Empty CRLF line ends the headers section
         if (is_empty_line(line)) {
-            parser->head_complete = 1;
-
-            // No body to read (Content-Length: 0)
-            if (parser->content_length == 0) {
-                parser->body_complete = 1;
-            }
+            end_head(parser);
             return;
         }
         parse_header_line(parser, line, req);
@@ -92,6 +225,117 @@ void parse_line(LKHttpRequestParser *parser, char *line, LKHttpRequest *req) {
     }
 }
 
+// Request line and headers read, a body may follow.
+static void end_head(LKHttpRequestParser *parser) {
+    parser->head_complete = 1;
+
+    // Transfer-Encoding overrides any Content-Length.
+    if (parser->chunked) {
+        parser->content_length = 0;
+        return;
+    }
+    if (parser->max_body_size > 0 && parser->content_length > parser->max_body_size) {
+        reject_request(parser, 413);
+        return;
+    }
+    // No body to read (Content-Length: 0)
+    if (parser->content_length == 0) {
+        parser->body_complete = 1;
+    }
+}
+
+// Parse request head from buf->bytes_cur once the whole head is in buf,
+// compiling results into req. Head bytes are parsed in place and consumed,
+// leaving the body and any pipelined requests in buf.
+// Call again after more bytes are appended to buf, until
+// parser->head_complete is set. Bytes already scanned for the end of the
+// head are not scanned again.
+void lk_httprequestparser_parse_head(LKHttpRequestParser *parser, LKBuffer *buf, LKHttpRequest *req) {
+    if (parser->head_complete) {
+        return;
+    }
+    // Skip any empty lines before the request line.
+    if (parser->head_scanned == 0) {
+        while (buf->bytes_cur < buf->bytes_len &&
+               (buf->bytes[buf->bytes_cur] == '\r' || buf->bytes[buf->bytes_cur] == '\n')) {
+            buf->bytes_cur++;
+        }
+    }
+
+    // Look for the empty line ending the head: "\n\r\n" or "\n\n".
+    char *bytes = buf->bytes + buf->bytes_cur;
+    size_t len = buf->bytes_len - buf->bytes_cur;
+    size_t pos = parser->head_scanned;
+    size_t head_len = 0;
+    while (head_len == 0) {
+        char *eol = lk_scan(bytes+pos, len-pos, "\n");
+        if (eol == NULL) {
+            pos = len;
+            break;
+        }
+        pos = eol - bytes;
+        if (pos+1 < len && bytes[pos+1] == '\n') {
+            head_len = pos+2;
+        } else if (pos+2 < len && bytes[pos+1] == '\r' && bytes[pos+2] == '\n') {
+            head_len = pos+3;
+        } else if (pos+1 == len || (pos+2 == len && bytes[pos+1] == '\r')) {
+            // Line end at the end of bytes, check it again with more bytes.
+            break;
+        } else {
+            pos++;
+        }
+    }
+    if (head_len == 0) {
+        parser->head_scanned = pos;
+        if (len >= MAX_HEAD_SIZE) {
+            reject_request(parser, 431);
+        }
+        return;
+    }
+
+    parse_head_bytes(parser, bytes, head_len, req);
+    buf->bytes_cur += head_len;
+}
+
+// Parse all unread bytes in buf as the request head, when no more bytes
+// are coming to complete it.
+void lk_httprequestparser_end_head(LKHttpRequestParser *parser, LKBuffer *buf, LKHttpRequest *req) {
+    if (parser->head_complete) {
+        return;
+    }
+    // End the last line so that every slice is followed by a delimiter.
+    lk_buffer_append(buf, "\n", 1);
+    parse_head_bytes(parser, buf->bytes + buf->bytes_cur, buf->bytes_len - buf->bytes_cur, req);
+    buf->bytes_cur = buf->bytes_len;
+}
+
+// Parse head bytes into slices, passing them on to req as strings.
+static void parse_head_bytes(LKHttpRequestParser *parser, char *bytes, size_t len, LKHttpRequest *req) {
+    LKHttpRequestHead *head = parser->head;
+    lk_httprequesthead_parse(head, bytes, len);
+
+    lk_string_assign(req->method, slice_sz(bytes, head->method));
+    lk_string_assign(req->uri, slice_sz(bytes, head->uri));
+    lk_string_assign(req->version, slice_sz(bytes, head->version));
+    parse_uri(req->uri, req->path, req->filename, req->querystring);
+
+    for (int i=0; i < head->headers_len; i++) {
+        LKHeaderSlice *hs = &head->headers[i];
+        add_header(parser, slice_sz(bytes, hs->name), slice_sz(bytes, hs->value), req);
+    }
+    parser->nlinesread = head->headers_len + 2;
+    if (!parser->head_complete) {
+        end_head(parser);
+    }
+}
+
+// Return slice as a string, terminating it in place over the delimiter
+// byte that follows it.
+static char *slice_sz(char *bytes, LKSlice slice) {
+    bytes[slice.offset + slice.len] = '\0';
+    return bytes + slice.offset;
+}
+
 // Parse initial request line in the format:
 // GET /path/to/index.html HTTP/1.0
 void parse_request_line(char *line, LKHttpRequest *req) {
@@ -134,44 +378,47 @@ void parse_request_line(char *line, LKHttpRequest *req) {
 // lks_path         = "/path/blog/file1.html"
 // lks_filename     = "file1.html"
 // lks_qs           = "a=1&b=2"
-void parse_uri(LKString *lks_uri, LKString *lks_path, LKString *lks_filename, LKString *lks_qs) { 
+void parse_uri(LKString *lks_uri, LKString *lks_path, LKString *lks_filename, LKString *lks_qs) {
     // Get path and querystring
     // "/path/blog/file1.html?a=1&b=2" ==> "/path/blog/file1.html" and "a=1&b=2"
-    LKStringList *uri_ss = lk_string_split(lks_uri, "?");
-    lk_string_assign(lks_path, uri_ss->items[0]->s);
-    if (uri_ss->items_len > 1) {
-        lk_string_assign(lks_qs, uri_ss->items[1]->s);
+    // The uri is split in place and restored, without copying it.
+    char *qs = strchr(lks_uri->s, '?');
+    if (qs != NULL) {
+        lk_string_assign(lks_qs, qs+1);
+        *qs = '\0';
+        lk_string_assign(lks_path, lks_uri->s);
+        *qs = '?';
     } else {
         lk_string_assign(lks_qs, "");
+        lk_string_assign(lks_path, lks_uri->s);
     }
 
     // Remove any trailing slash from uri. "/path/blog/" ==> "/path/blog"
     lk_string_chop_end(lks_path, "/");
 
     // Extract filename from path. "/path/blog/file1.html" ==> "file1.html"
-    LKStringList *path_ss = lk_string_split(lks_path, "/");
-    assert(path_ss->items_len > 0);
-    lk_string_assign(lks_filename, path_ss->items[path_ss->items_len-1]->s);
-
-    lk_stringlist_free(uri_ss);
-    lk_stringlist_free(path_ss);
+    char *filename = strrchr(lks_path->s, '/');
+    lk_string_assign(lks_filename, filename != NULL ? filename+1 : lks_path->s);
 }
 
 
 // Parse header line in the format Ex. User-Agent: browser
 static void parse_header_line(LKHttpRequestParser *parser, char *line, LKHttpRequest *req) {
-    char *saveptr;
-    char *delim = ":";
-
     char *linetmp = lk_strdup(line, "parse_header_line");
     lk_chomp(linetmp);
-    char *k = strtok_r(linetmp, delim, &saveptr);
-    if (k == NULL) {
+    char *k = linetmp;
+    if (*k == '\0' || *k == ':') {
         lk_free(linetmp);
         return;
     }
-    char *v = strtok_r(NULL, delim, &saveptr);
-    if (v == NULL) {
+
+    // Value is everything after the first ':', it may contain ':' itself.
+    // Ex. "Host: localhost:8000", "If-Modified-Since: Sun, 06 Nov 1994 08:49:37 GMT"
+    char *v = strchr(linetmp, ':');
+    if (v != NULL) {
+        *v = '\0';
+        v++;
+    } else {
         v = "";
     }
 
@@ -179,33 +426,157 @@ static void parse_header_line(LKHttpRequestParser *parser, char *line, LKHttpReq
     while (*v == ' ' || *v == '\t') {
         v++;
     }
+
+    add_header(parser, k, v, req);
+    lk_free(linetmp);
+}
+
+static void add_header(LKHttpRequestParser *parser, char *k, char *v, LKHttpRequest *req) {
+    // Only chunked transfer coding is supported. The body is passed on
+    // decoded, so the header is left out of req.
+    if (!strcasecmp(k, "Transfer-Encoding")) {
+        if (!strcasecmp(v, "chunked")) {
+            parser->chunked = 1;
+        } else {
+            reject_request(parser, 501);
+        }
+        return;
+    }
     lk_httprequest_add_header(req, k, v);
 
     if (!strcasecmp(k, "Content-Length")) {
         int content_length = atoi(v);
         parser->content_length = content_length;
     }
-
-    lk_free(linetmp);
 }
 
 
 // Parse sequence of bytes into request body. Compile results into req.
+// Consumes buf bytes from buf->bytes_cur up to the end of the body.
+// Chunked bodies are decoded into req->body as the bytes come in.
 // You can check the state of the parser through the following fields:
 // parser->head_complete   Request Line and Headers complete
 // parser->body_complete   httprequest is complete
+// parser->error_status    request is rejected with this http status
 void lk_httprequestparser_parse_bytes(LKHttpRequestParser *parser, LKBuffer *buf, LKHttpRequest *req) {
-    // Head should be parsed line by line. Call parse_line() instead.
+    // Head should be parsed first. Call parse_head() or parse_line() instead.
     if (!parser->head_complete) {
         return;
     }
     if (parser->body_complete) {
         return;
     }
+    if (parser->chunked) {
+        parse_chunked_bytes(parser, buf, req);
+        return;
+    }
+
+    if (req->body->bytes_len == 0) {
+        size_t nreserve = parser->content_length;
+        if (nreserve > MAX_BODY_RESERVE) {
+            nreserve = MAX_BODY_RESERVE;
+        }
+        lk_buffer_reserve(req->body, nreserve);
+    }
 
-    lk_buffer_append(req->body, buf->bytes, buf->bytes_len);
+    // Body ends at content_length. Any bytes after it belong to the
+    // next request and are left in buf.
+    size_t nbody = parser->content_length - req->body->bytes_len;
+    size_t navail = buf->bytes_len - buf->bytes_cur;
+    if (nbody > navail) {
+        nbody = navail;
+    }
+    lk_buffer_append(req->body, buf->bytes + buf->bytes_cur, nbody);
+    buf->bytes_cur += nbody;
     if (req->body->bytes_len >= parser->content_length) {
         parser->body_complete = 1;
     }
 }
 
+static void parse_chunked_bytes(LKHttpRequestParser *parser, LKBuffer *buf, LKHttpRequest *req) {
+    while (buf->bytes_cur < buf->bytes_len && !parser->body_complete) {
+        // Chunk data is copied as is, only the framing is parsed bytewise.
+        if (parser->chunk_state == CHUNK_DATA) {
+            size_t ncopy = buf->bytes_len - buf->bytes_cur;
+            if (ncopy > parser->chunk_left) {
+                ncopy = parser->chunk_left;
+            }
+            lk_buffer_append(req->body, buf->bytes + buf->bytes_cur, ncopy);
+            buf->bytes_cur += ncopy;
+            parser->chunk_left -= ncopy;
+            if (parser->chunk_left == 0) {
+                parser->chunk_state = CHUNK_DATA_END;
+            }
+            continue;
+        }
+
+        char ch = buf->bytes[buf->bytes_cur];
+        buf->bytes_cur++;
+        switch (parser->chunk_state) {
+        case CHUNK_SIZE_START:
+        case CHUNK_SIZE:
+            if (isxdigit(ch)) {
+                if (parser->chunk_left > (SIZE_MAX >> 4)) {
+                    reject_request(parser, 413);
+                    return;
+                }
+                int digit = isdigit(ch) ? ch - '0' : tolower(ch) - 'a' + 10;
+                parser->chunk_left = parser->chunk_left * 16 + digit;
+                parser->chunk_state = CHUNK_SIZE;
+            } else if (parser->chunk_state == CHUNK_SIZE && ch == '\n') {
+                end_chunk_size_line(parser, req);
+            } else if (parser->chunk_state == CHUNK_SIZE && strchr(";\r \t", ch) != NULL) {
+                parser->chunk_state = CHUNK_EXT;
+            } else {
+                reject_request(parser, 400);
+            }
+            break;
+        case CHUNK_EXT:
+            if (ch == '\n') {
+                end_chunk_size_line(parser, req);
+            }
+            break;
+        case CHUNK_DATA_END:
+            if (ch == '\n') {
+                parser->chunk_state = CHUNK_SIZE_START;
+            } else if (ch != '\r') {
+                reject_request(parser, 400);
+            }
+            break;
+        case CHUNK_TRAILER:
+            // Trailer fields are skipped.
+            if (ch == '\n') {
+                parser->body_complete = 1;
+            } else if (ch != '\r') {
+                parser->chunk_state = CHUNK_TRAILER_LINE;
+            }
+            break;
+        case CHUNK_TRAILER_LINE:
+            if (ch == '\n') {
+                parser->chunk_state = CHUNK_TRAILER;
+            }
+            break;
+        }
+    }
+}
+
+// Chunk size line read, chunk data or the last chunk trailer follows.
+static void end_chunk_size_line(LKHttpRequestParser *parser, LKHttpRequest *req) {
+    if (parser->chunk_left == 0) {
+        parser->chunk_state = CHUNK_TRAILER;
+        return;
+    }
+    if (parser->max_body_size > 0 &&
+        parser->chunk_left > parser->max_body_size - req->body->bytes_len) {
+        reject_request(parser, 413);
+        return;
+    }
+    parser->chunk_state = CHUNK_DATA;
+}
+
+// Stop parsing the request, it's to be answered with an error status.
+static void reject_request(LKHttpRequestParser *parser, int status) {
+    parser->error_status = status;
+    parser->head_complete = 1;
+    parser->body_complete = 1;
+}
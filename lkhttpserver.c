@@ -4,16 +4,18 @@
 #include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <assert.h>
 #include <limits.h>
 #include <signal.h>
+#include <time.h>
 #include <sys/wait.h>
+#include <sys/prctl.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
-#include <sys/select.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
@@ -22,7 +24,51 @@
 #include "lklib.h"
 #include "lknet.h"
 
+// Larger static files are sent uncompressed, unless precompressed
+// sidecar files are available.
+#define COMPRESS_MAX_FILE_SIZE (64*1024)
+
+// Most cgi output bytes held per request. Longer output is streamed.
+#define CGI_BUFSIZE (64*1024)
+// Longer cgi headers are taken to be missing and the output sent as is.
+#define CGI_HEAD_MAX LK_BUFSIZE_XXL
+// Room for a chunk size line, up to 16 hex digits and CRLF.
+#define CHUNK_HEAD_SIZE 18
+
+// Longest wait between retries of failed worker forks.
+#define MAX_FORK_RETRY_SECS 32
+
 // local functions
+static int serve_workers(LKHttpServer *server);
+static pid_t fork_worker(LKHttpServer *server, struct sigaction *sa_chld);
+static int serve_loop(LKHttpServer *server, int reuseport);
+static int serve_threads(LKHttpServer *server, int listenfd);
+static void *loop_thread(void *arg);
+static int init_loop(LKHttpServer *server);
+static void free_loop(LKHttpServer *server);
+static int run_loop(LKHttpServer *server, int listenfd);
+static void add_client(LKHttpServer *server, int clientfd, struct sockaddr_in *sa);
+static void read_handoffs(LKHttpServer *server);
+static void close_idle_clients(LKHttpServer *server, time_t now);
+static int is_keepalive(LKHttpServer *server, LKContext *ctx);
+static int set_hot_response(LKHttpServer *server, LKContext *ctx);
+static int is_not_modified(LKHttpRequest *req, char *etag, time_t mtime);
+static int etag_list_match(char *etags, char *etag);
+static void add_cache_headers(LKHttpResponse *resp, LKHostConfig *hc);
+static int is_range_current(LKHttpRequest *req, LKFileCacheItem *file);
+static void serve_ranges(LKHttpResponse *resp, LKFileCacheItem *file, char *content_type, char *range);
+static LKFileCacheItem *open_sidecar(LKHttpServer *server, LKHostConfig *hc, LKHttpRequest *req, LKFileCacheItem *file, char **encoding);
+static int is_compressible(LKHttpServer *server, LKHttpRequest *req, char *content_type);
+static void set_compress(LKHttpResponse *resp);
+static LKBuffer *gzip_buffer(LKHttpServer *server, LKBuffer *buf);
+static void compress_body(LKHttpServer *server, LKHttpResponse *resp);
+static void clear_chunk_buffer(LKBuffer *buf);
+static void start_cgi_stream(LKHttpServer *server, LKContext *ctx);
+static void send_cgi_output(LKHttpServer *server, LKContext *ctx, int eof);
+static LKBuffer *frame_cgi_output(LKContext *ctx, int eof);
+static char **create_envp(LKStringTable *env);
+static void free_envp(char **envp);
+
 void FD_SET_READ(int fd, LKHttpServer *server);
 void FD_SET_WRITE(int fd, LKHttpServer *server);
 void FD_CLR_READ(int fd, LKHttpServer *server);
@@ -42,8 +88,6 @@ void set_cgi_env1(LKHttpServer *server);
 void set_cgi_env2(LKHttpServer *server, LKContext *ctx, LKHostConfig *hc);
 
 void get_localtime_string(char *time_str, size_t time_str_len);
-int open_path_file(char *home_dir, char *path);
-int read_path_file(char *home_dir, char *path, LKBuffer *buf);
 char *fileext(char *filepath);
 
 void write_response(LKHttpServer *server, LKContext *ctx);
@@ -60,20 +104,53 @@ void pipe_proxy_response(LKHttpServer *server, LKContext *ctx);
 LKHttpServer *lk_httpserver_new(LKConfig *cfg) {
     LKHttpServer *server = lk_malloc(sizeof(LKHttpServer), "lk_httpserver_new");
     server->cfg = cfg;
-    server->ctxhead = NULL;
-    server->maxfd = 0;
+    server->ctxtable = lk_contexttable_new();
+    server->evloop = NULL;
+    server->cgienv = lk_stringtable_new();
+    server->filecache = NULL;
+    server->loops = NULL;
+    server->loops_len = 0;
+    server->handoff_fds[0] = -1;
+    server->handoff_fds[1] = -1;
+    server->nclients = 0;
     return server;
 }
 
 void lk_httpserver_free(LKHttpServer *server) {
+    // Stop the event loop threads before freeing their state.
+    for (int i=0; i < server->loops_len; i++) {
+        LKHttpServer *loop = server->loops[i];
+        pthread_cancel(loop->thread);
+        pthread_join(loop->thread, NULL);
+        // Shared file cache is freed with the server.
+        loop->filecache = NULL;
+        free_loop(loop);
+    }
+    if (server->loops) {
+        lk_free(server->loops);
+    }
+
     lk_config_free(server->cfg);
+    free_loop(server);
+}
+
+// Free event loop state. Shared cfg is left to the owning server.
+static void free_loop(LKHttpServer *server) {
+    lk_contexttable_free(server->ctxtable);
+
+    if (server->evloop) {
+        lk_eventloop_free(server->evloop);
+    }
+    lk_stringtable_free(server->cgienv);
+    // Freed after the contexts, which release their cached files.
+    if (server->filecache) {
+        lk_filecache_print_stats(server->filecache);
+        lk_filecache_free(server->filecache);
+    }
 
-    // Free ctx linked list
-    LKContext *ctx = server->ctxhead;
-    while (ctx != NULL) {
-        LKContext *ptmp = ctx;
-        ctx = ctx->next;
-        lk_context_free(ptmp);
+    if (server->handoff_fds[0] != -1) {
+        close(server->handoff_fds[0]);
+        close(server->handoff_fds[1]);
     }
 
     memset(server, 0, sizeof(LKHttpServer));
@@ -81,32 +158,160 @@ void lk_httpserver_free(LKHttpServer *server) {
 }
 
 void FD_SET_READ(int fd, LKHttpServer *server) {
-    FD_SET(fd, &server->readfds);
-    if (fd > server->maxfd) {
-        server->maxfd = fd;
-    }
+    lk_eventloop_set(server->evloop, fd, LKEV_READ);
 }
 void FD_SET_WRITE(int fd, LKHttpServer *server) {
-    FD_SET(fd, &server->writefds);
-    if (fd > server->maxfd) {
-        server->maxfd = fd;
-    }
+    lk_eventloop_set(server->evloop, fd, LKEV_WRITE);
 }
 void FD_CLR_READ(int fd, LKHttpServer *server) {
-    FD_CLR(fd, &server->readfds);
+    lk_eventloop_clear(server->evloop, fd, LKEV_READ);
 }
 void FD_CLR_WRITE(int fd, LKHttpServer *server) {
-    FD_CLR(fd, &server->writefds);
+    lk_eventloop_clear(server->evloop, fd, LKEV_WRITE);
 }
 
 int lk_httpserver_serve(LKHttpServer *server) {
-    int z;
     LKConfig *cfg = server->cfg;
     lk_config_finalize(cfg);
 
+    // Used for multipart boundaries.
+    srandom(time(NULL) ^ getpid());
+
+    if (cfg->workers > 1) {
+        return serve_workers(server);
+    }
+    return serve_loop(server, 0);
+}
+
+// Fork cfg->workers processes, each running its own serve_loop() on a
+// separate SO_REUSEPORT listen socket. Restart any worker that exits,
+// and retry forks that failed, waiting longer after each failure.
+// Only returns on error.
+static int serve_workers(LKHttpServer *server) {
+    int nworkers = server->cfg->workers;
+    pid_t *pids = lk_malloc(sizeof(pid_t) * nworkers, "serve_workers");
+    time_t *start_times = lk_malloc(sizeof(time_t) * nworkers, "serve_workers_start_times");
+
+    // The supervisor reaps its workers through waitpid() below, so don't let
+    // any SIGCHLD handler reap them first. Workers restore the original
+    // handler to reap their own cgi processes.
+    struct sigaction sa_dfl, sa_chld;
+    memset(&sa_dfl, 0, sizeof(sa_dfl));
+    sa_dfl.sa_handler = SIG_DFL;
+    sigaction(SIGCHLD, &sa_dfl, &sa_chld);
+
+    for (int i=0; i < nworkers; i++) {
+        pids[i] = fork_worker(server, &sa_chld);
+        start_times[i] = time(NULL);
+    }
+    printf("Started %d worker processes\n", nworkers);
+    fflush(stdout);
+
+    int retry_secs = 1;
+    while (1) {
+        int nfailed = 0;
+        for (int i=0; i < nworkers; i++) {
+            if (pids[i] == -1) {
+                nfailed++;
+            }
+        }
+
+        // Don't wait for workers to exit while there are forks to retry.
+        int status;
+        pid_t pid = waitpid(-1, &status, nfailed > 0 ? WNOHANG : 0);
+        if (pid == -1 && errno == EINTR) {
+            continue;
+        }
+        if (pid == -1 && (errno != ECHILD || nfailed == 0)) {
+            lk_print_err("waitpid()");
+            break;
+        }
+        if (pid <= 0) {
+            printf("Retrying %d failed worker forks in %d secs...\n", nfailed, retry_secs);
+            fflush(stdout);
+            sleep(retry_secs);
+            nfailed = 0;
+            for (int i=0; i < nworkers; i++) {
+                if (pids[i] == -1) {
+                    pids[i] = fork_worker(server, &sa_chld);
+                    start_times[i] = time(NULL);
+                    if (pids[i] == -1) {
+                        nfailed++;
+                    }
+                }
+            }
+            if (nfailed == 0) {
+                retry_secs = 1;
+            } else if (retry_secs < MAX_FORK_RETRY_SECS) {
+                retry_secs *= 2;
+            }
+            continue;
+        }
+
+        for (int i=0; i < nworkers; i++) {
+            if (pids[i] != pid) {
+                continue;
+            }
+            if (WIFEXITED(status)) {
+                printf("Worker %d exited with status %d, restarting...\n", pid, WEXITSTATUS(status));
+            } else if (WIFSIGNALED(status)) {
+                printf("Worker %d killed by signal %d (%s), restarting...\n", pid, WTERMSIG(status), strsignal(WTERMSIG(status)));
+            }
+            fflush(stdout);
+
+            // Throttle restarts of workers that fail right away,
+            // such as when the listen socket can't be opened.
+            if (time(NULL) - start_times[i] < 1) {
+                sleep(1);
+            }
+            pids[i] = fork_worker(server, &sa_chld);
+            start_times[i] = time(NULL);
+            break;
+        }
+    }
+
+    lk_free(pids);
+    lk_free(start_times);
+    return -1;
+}
+
+// Start a worker process running serve_loop().
+// Returns worker pid to the supervisor. Worker process doesn't return.
+static pid_t fork_worker(LKHttpServer *server, struct sigaction *sa_chld) {
+    pid_t supervisor_pid = getpid();
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) {
+        lk_print_err("fork()");
+        return pid;
+    }
+    if (pid > 0) {
+        return pid;
+    }
+
+    // Worker exits along with the supervisor.
+    sigaction(SIGCHLD, sa_chld, NULL);
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != supervisor_pid) {
+        exit(1);
+    }
+
+    // Write whole log lines so they don't interleave with other workers.
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    int z = serve_loop(server, 1);
+    exit(z == -1 ? 1 : 0);
+}
+
+// Serve http requests from a listen socket bound to cfg serverhost and port.
+// Set reuseport when other processes are listening on the same port.
+// Only returns on error.
+static int serve_loop(LKHttpServer *server, int reuseport) {
+    LKConfig *cfg = server->cfg;
+
     int backlog = 50;
     struct sockaddr sa;
-    int s0 = lk_open_listen_socket(cfg->serverhost->s, cfg->port->s, backlog, &sa);
+    int s0 = lk_open_listen_socket(cfg->serverhost->s, cfg->port->s, backlog, reuseport, &sa);
     if (s0 == -1) {
         lk_print_err("lk_open_listen_socket() failed");
         return -1;
@@ -116,54 +321,176 @@ int lk_httpserver_serve(LKHttpServer *server) {
     printf("Serving HTTP on %s port %s...\n", server_ipaddr_str->s, cfg->port->s);
     lk_string_free(server_ipaddr_str);
 
-    clearenv();
-    set_cgi_env1(server);
+    if (cfg->threads > 1) {
+        return serve_threads(server, s0);
+    }
 
-    FD_ZERO(&server->readfds);
-    FD_ZERO(&server->writefds);
+    if (init_loop(server) == -1) {
+        return -1;
+    }
     FD_SET_READ(s0, server);
+    return run_loop(server, s0);
+}
+
+// Accepted client passed from the acceptor to an event loop thread.
+typedef struct {
+    int clientfd;
+    struct sockaddr_in sa;
+} ClientHandoff;
+
+// Start cfg->threads event loop threads, each with its own context table,
+// event loop and cgi environment, sharing one file cache. Accept clients
+// on listenfd and hand each one to the loop thread with the fewest clients.
+// Only returns on error.
+static int serve_threads(LKHttpServer *server, int listenfd) {
+    LKConfig *cfg = server->cfg;
+
+    // Loop threads inherit a blocked signal mask so that signal handlers
+    // only run in the acceptor thread.
+    sigset_t blockset, oldset;
+    sigemptyset(&blockset);
+    sigaddset(&blockset, SIGINT);
+    sigaddset(&blockset, SIGTERM);
+    sigaddset(&blockset, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &blockset, &oldset);
+
+    // Files opened and responses cached by one thread are served from
+    // memory by all of them.
+    server->filecache = lk_filecache_new(cfg->filecache_size, cfg->filecache_ttl, cfg->hotcache_size * 1024L);
+
+    server->loops = lk_malloc(sizeof(LKHttpServer *) * cfg->threads, "serve_threads");
+    for (int i=0; i < cfg->threads; i++) {
+        LKHttpServer *loop = lk_httpserver_new(cfg);
+        loop->filecache = server->filecache;
+        if (pipe2(loop->handoff_fds, O_CLOEXEC) == -1) {
+            lk_exit_err("pipe2()");
+        }
+        lk_set_sock_nonblocking(loop->handoff_fds[0]);
+        if (init_loop(loop) == -1) {
+            exit(1);
+        }
+        FD_SET_READ(loop->handoff_fds[0], loop);
+
+        int z = pthread_create(&loop->thread, NULL, loop_thread, loop);
+        if (z != 0) {
+            errno = z;
+            lk_exit_err("pthread_create()");
+        }
+        server->loops[i] = loop;
+        server->loops_len++;
+    }
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    printf("Started %d event loop threads\n", cfg->threads);
 
     while (1) {
-        // readfds contain the master list of read sockets
-        fd_set cur_readfds = server->readfds;
-        fd_set cur_writefds = server->writefds;
-        z = select(server->maxfd+1, &cur_readfds, &cur_writefds, NULL, NULL);
-        if (z == -1 && errno == EINTR) {
+        ClientHandoff handoff;
+        socklen_t sa_len = sizeof(handoff.sa);
+        handoff.clientfd = accept4(listenfd, (struct sockaddr *) &handoff.sa, &sa_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (handoff.clientfd == -1) {
+            if (errno != EINTR) {
+                lk_print_err("accept()");
+            }
             continue;
         }
+
+        LKHttpServer *target = server->loops[0];
+        for (int i=1; i < server->loops_len; i++) {
+            LKHttpServer *loop = server->loops[i];
+            if (__atomic_load_n(&loop->nclients, __ATOMIC_RELAXED) <
+                __atomic_load_n(&target->nclients, __ATOMIC_RELAXED)) {
+                target = loop;
+            }
+        }
+        __atomic_add_fetch(&target->nclients, 1, __ATOMIC_RELAXED);
+
+        // handoff is smaller than PIPE_BUF so it's written atomically.
+        int z = write(target->handoff_fds[1], &handoff, sizeof(handoff));
+        if (z != sizeof(handoff)) {
+            lk_print_err("write() handoff");
+            __atomic_sub_fetch(&target->nclients, 1, __ATOMIC_RELAXED);
+            close(handoff.clientfd);
+        }
+    }
+    return 0;
+}
+
+static void *loop_thread(void *arg) {
+    LKHttpServer *loop = arg;
+
+    // Cancellation is only enabled while waiting in run_loop().
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    run_loop(loop, -1);
+    return NULL;
+}
+
+// Create event loop, cgi environment and file cache, unless the file
+// cache is shared with other loops.
+// Returns 0 for success, -1 for error.
+static int init_loop(LKHttpServer *server) {
+    set_cgi_env1(server);
+    LKConfig *cfg = server->cfg;
+    if (server->filecache == NULL) {
+        server->filecache = lk_filecache_new(cfg->filecache_size, cfg->filecache_ttl, cfg->hotcache_size * 1024L);
+    }
+    server->ctxtable->pool_max = cfg->ctxpool_size;
+
+    server->evloop = lk_eventloop_new();
+    if (server->evloop == NULL) {
+        return -1;
+    }
+    return 0;
+}
+
+// Run event loop, accepting new clients from listenfd if specified,
+// or from the handoff pipe in threaded mode.
+// Only returns on error.
+static int run_loop(LKHttpServer *server, int listenfd) {
+    int z;
+    LKConfig *cfg = server->cfg;
+
+    // Wake up every second to check for idle keep-alive connections.
+    int timeout_ms = -1;
+    if (cfg->keepalive_timeout > 0) {
+        timeout_ms = 1000;
+    }
+    time_t last_sweep = time(NULL);
+
+    while (1) {
+        // Threaded mode loops can only be cancelled while idle.
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        z = lk_eventloop_wait(server->evloop, timeout_ms);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
         if (z == -1) {
-            lk_print_err("select()");
+            lk_print_err("lk_eventloop_wait()");
             return z;
         }
-        if (z == 0) {
-            // timeout returned
-            continue;
-        }
 
-        // fds now contain list of clients with data available to be read.
-        for (int i=0; i <= server->maxfd; i++) {
-            if (FD_ISSET(i, &cur_readfds)) {
+        // Dispatch only the fds that are ready.
+        for (int i=0; i < server->evloop->events_len; i++) {
+            int selectfd;
+            int ready = lk_eventloop_get_ready(server->evloop, i, &selectfd);
+
+            if (ready & LKEV_READ) {
                 // New client connection
-                if (i == s0) {
+                if (selectfd == listenfd) {
                     socklen_t sa_len = sizeof(struct sockaddr_in);
                     struct sockaddr_in sa;
-                    int clientfd = accept(s0, (struct sockaddr*)&sa, &sa_len);
+                    int clientfd = accept4(listenfd, (struct sockaddr*)&sa, &sa_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
                     if (clientfd == -1) {
                         lk_print_err("accept()");
                         continue;
                     }
-
-                    // Add new client socket to list of read sockets.
-                    FD_SET_READ(clientfd, server);
-
-                    LKContext *ctx = create_initial_context(clientfd, &sa);
-                    add_new_client_context(&server->ctxhead, ctx);
+                    __atomic_add_fetch(&server->nclients, 1, __ATOMIC_RELAXED);
+                    add_client(server, clientfd, &sa);
+                    continue;
+                } else if (selectfd == server->handoff_fds[0]) {
+                    // New clients from acceptor thread
+                    read_handoffs(server);
                     continue;
                 } else {
-                    //printf("read fd %d\n", i);
+                    //printf("read fd %d\n", selectfd);
 
-                    int selectfd = i;
-                    LKContext *ctx = match_select_ctx(server->ctxhead, selectfd);
+                    LKContext *ctx = match_select_ctx(server->ctxtable, selectfd);
                     if (ctx == NULL) {
                         printf("read selectfd %d not in ctx list\n", selectfd);
                         terminate_fd(selectfd, FD_SOCK, FD_READ, server);
@@ -180,11 +507,10 @@ int lk_httpserver_serve(LKHttpServer *server) {
                         printf("read selectfd %d with unknown ctx type %d\n", selectfd, ctx->type);
                     }
                 }
-            } else if (FD_ISSET(i, &cur_writefds)) {
-                //printf("write fd %d\n", i);
+            } else if (ready & LKEV_WRITE) {
+                //printf("write fd %d\n", selectfd);
 
-                int selectfd = i;
-                LKContext *ctx = match_select_ctx(server->ctxhead, selectfd);
+                LKContext *ctx = match_select_ctx(server->ctxtable, selectfd);
                 if (ctx == NULL) {
                     printf("write selectfd %d not in ctx list\n", selectfd);
                     terminate_fd(selectfd, FD_SOCK, FD_WRITE, server);
@@ -206,12 +532,67 @@ int lk_httpserver_serve(LKHttpServer *server) {
                 }
             }
         }
+
+        if (cfg->keepalive_timeout > 0) {
+            time_t now = time(NULL);
+            if (now != last_sweep) {
+                close_idle_clients(server, now);
+                last_sweep = now;
+            }
+        }
     } // while (1)
 
     return 0;
 }
 
+// Add new client socket to event loop.
+static void add_client(LKHttpServer *server, int clientfd, struct sockaddr_in *sa) {
+    // Responses are written as separate head and body buffers. Don't let
+    // the body wait on the head's ack while the connection is kept alive.
+    lk_set_sock_nodelay(clientfd);
+    FD_SET_READ(clientfd, server);
+
+    LKContext *ctx = get_initial_context(server->ctxtable, clientfd, sa);
+    ctx->reqparser->max_body_size = (size_t) server->cfg->max_body_size * 1024;
+    add_new_client_context(server->ctxtable, ctx);
+}
+
+// Close connections that have been waiting too long for their first or
+// next request, or for the rest of one.
+static void close_idle_clients(LKHttpServer *server, time_t now) {
+    LKContextTable *tbl = server->ctxtable;
+    for (int fd=0; fd < tbl->items_size; fd++) {
+        LKContext *ctx = tbl->items[fd];
+        if (ctx == NULL || ctx->clientfd != fd) {
+            continue;
+        }
+        if (ctx->type != CTX_READ_REQ) {
+            continue;
+        }
+        if (now - ctx->last_active >= server->cfg->keepalive_timeout) {
+            terminate_client_session(server, ctx);
+        }
+    }
+}
+
+// Read all pending client handoffs from the acceptor thread.
+static void read_handoffs(LKHttpServer *server) {
+    ClientHandoff handoff;
+    while (1) {
+        int z = read(server->handoff_fds[0], &handoff, sizeof(handoff));
+        if (z == -1 && errno == EINTR) {
+            continue;
+        }
+        if (z != sizeof(handoff)) {
+            break;
+        }
+        add_client(server, handoff.clientfd, &handoff.sa);
+    }
+}
+
 // Sets the cgi environment variables that stay the same across http requests.
+// Each event loop keeps its own cgi environment instead of modifying the
+// process environment, which is shared by all threads.
 void set_cgi_env1(LKHttpServer *server) {
     int z;
     LKConfig *cfg = server->cfg;
@@ -224,83 +605,117 @@ void set_cgi_env1(LKHttpServer *server) {
     }
     hostname[sizeof(hostname)-1] = '\0';
     
-    setenv("SERVER_NAME", hostname, 1);
-    setenv("SERVER_SOFTWARE", "littlekitten/0.1", 1);
-    setenv("SERVER_PROTOCOL", "HTTP/1.0", 1);
-    setenv("SERVER_PORT", cfg->port->s, 1);
-
+    lk_stringtable_set(server->cgienv, "SERVER_NAME", hostname);
+    lk_stringtable_set(server->cgienv, "SERVER_SOFTWARE", "littlekitten/0.1");
+    lk_stringtable_set(server->cgienv, "SERVER_PROTOCOL", "HTTP/1.0");
+    lk_stringtable_set(server->cgienv, "SERVER_PORT", cfg->port->s);
 }
 
 // Sets the cgi environment variables that vary for each http request.
 void set_cgi_env2(LKHttpServer *server, LKContext *ctx, LKHostConfig *hc) {
     LKHttpRequest *req = ctx->req;
 
-    setenv("DOCUMENT_ROOT", hc->homedir_abspath->s, 1);
+    lk_stringtable_set(server->cgienv, "DOCUMENT_ROOT", hc->homedir_abspath->s);
 
     char *http_user_agent = lk_stringtable_get(req->headers, "User-Agent");
     if (!http_user_agent) http_user_agent = "";
-    setenv("HTTP_USER_AGENT", http_user_agent, 1);
+    lk_stringtable_set(server->cgienv, "HTTP_USER_AGENT", http_user_agent);
 
     char *http_host = lk_stringtable_get(req->headers, "Host");
     if (!http_host) http_host = "";
-    setenv("HTTP_HOST", http_host, 1);
+    lk_stringtable_set(server->cgienv, "HTTP_HOST", http_host);
 
     LKString *lkscript_filename = lk_string_new(hc->homedir_abspath->s);
     lk_string_append(lkscript_filename, req->path->s);
-    setenv("SCRIPT_FILENAME", lkscript_filename->s, 1);
+    lk_stringtable_set(server->cgienv, "SCRIPT_FILENAME", lkscript_filename->s);
     lk_string_free(lkscript_filename);
 
-    setenv("REQUEST_METHOD", req->method->s, 1);
-    setenv("SCRIPT_NAME", req->path->s, 1);
-    setenv("REQUEST_URI", req->uri->s, 1);
-    setenv("QUERY_STRING", req->querystring->s, 1);
+    lk_stringtable_set(server->cgienv, "REQUEST_METHOD", req->method->s);
+    lk_stringtable_set(server->cgienv, "SCRIPT_NAME", req->path->s);
+    lk_stringtable_set(server->cgienv, "REQUEST_URI", req->uri->s);
+    lk_stringtable_set(server->cgienv, "QUERY_STRING", req->querystring->s);
 
     char *content_type = lk_stringtable_get(req->headers, "Content-Type");
     if (content_type == NULL) {
         content_type = "";
     }
-    setenv("CONTENT_TYPE", content_type, 1);
+    lk_stringtable_set(server->cgienv, "CONTENT_TYPE", content_type);
 
     char content_length[10];
     snprintf(content_length, sizeof(content_length), "%ld", req->body->bytes_len);
     content_length[sizeof(content_length)-1] = '\0';
-    setenv("CONTENT_LENGTH", content_length, 1);
+    lk_stringtable_set(server->cgienv, "CONTENT_LENGTH", content_length);
 
-    setenv("REMOTE_ADDR", ctx->client_ipaddr->s, 1);
+    lk_stringtable_set(server->cgienv, "REMOTE_ADDR", ctx->client_ipaddr->s);
     char portstr[10];
     snprintf(portstr, sizeof(portstr), "%d", ctx->client_port);
-    setenv("REMOTE_PORT", portstr, 1);
+    lk_stringtable_set(server->cgienv, "REMOTE_PORT", portstr);
+}
+
+// Return environ style "k=v" strings array from env table.
+static char **create_envp(LKStringTable *env) {
+    char **envp = lk_malloc(sizeof(char *) * (env->items_len+1), "create_envp");
+    for (int i=0; i < env->items_len; i++) {
+        LKStringTableItem *item = &env->items[i];
+        LKString *kv = lk_string_new(item->k->s);
+        lk_string_append(kv, "=");
+        lk_string_append(kv, item->v->s);
+        envp[i] = lk_strdup(kv->s, "create_envp_kv");
+        lk_string_free(kv);
+    }
+    envp[env->items_len] = NULL;
+    return envp;
+}
+
+static void free_envp(char **envp) {
+    for (char **p = envp; *p != NULL; p++) {
+        lk_free(*p);
+    }
+    lk_free(envp);
 }
 
 void read_request(LKHttpServer *server, LKContext *ctx) {
-    int z = 0;
+    LKHttpRequestParser *parser = ctx->reqparser;
+    LKSocketReader *sr = ctx->sr;
+    ctx->last_active = time(NULL);
 
     while (1) {
-        if (!ctx->reqparser->head_complete) {
-            z = lk_socketreader_readline(ctx->sr, ctx->req_line);
-            if (z == Z_ERR) {
-                lk_print_err("lksocketreader_readline()");
-                break;
-            }
-            lk_httprequestparser_parse_line(ctx->reqparser, ctx->req_line, ctx->req);
-        } else {
-            z = lk_socketreader_recv(ctx->sr, ctx->req_buf);
-            if (z == Z_ERR) {
-                lk_print_err("lksocketreader_readbytes()");
-                break;
-            }
-            lk_httprequestparser_parse_bytes(ctx->reqparser, ctx->req_buf, ctx->req);
+        // Parse the head, then the body, straight from the socket reader
+        // buffer. Parsing stops at the end of the body, leaving any
+        // pipelined requests that follow in the buffer.
+        lk_httprequestparser_parse_head(parser, sr->buf, ctx->req);
+        if (parser->head_complete) {
+            lk_httprequestparser_parse_bytes(parser, sr->buf, ctx->req);
         }
-        // No more data coming in.
-        if (ctx->sr->sockclosed) {
-            ctx->reqparser->body_complete = 1;
-        }
-        if (ctx->reqparser->body_complete) {
+        if (parser->body_complete) {
             FD_CLR_READ(ctx->selectfd, server);
-            shutdown(ctx->selectfd, SHUT_RD);
             process_request(server, ctx);
             break;
         }
+
+        // An incomplete head is kept in the buffer until the rest of it
+        // comes in.
+        int z;
+        if (!parser->head_complete) {
+            z = lk_socketreader_readmore(sr);
+        } else {
+            z = lk_socketreader_fill(sr);
+        }
+        if (z == Z_ERR) {
+            lk_print_err("lk_socketreader_readmore()");
+            break;
+        }
+        // No more data coming in.
+        if (sr->sockclosed) {
+            // Client closed the connection without starting a new request.
+            if (!parser->head_complete && lk_socketreader_buffered(sr) == 0) {
+                terminate_client_session(server, ctx);
+                return;
+            }
+            lk_httprequestparser_end_head(parser, sr->buf, ctx->req);
+            parser->body_complete = 1;
+            continue;
+        }
         if (z != Z_OPEN) {
             break;
         }
@@ -320,53 +735,241 @@ void write_cgi_input(LKHttpServer *server, LKContext *ctx) {
         if (z == 0) {
             ctx->cgifd = 0;
         }
-        remove_selectfd_context(&server->ctxhead, ctx->selectfd);
+        remove_selectfd_context(server->ctxtable, ctx->selectfd);
         return;
     }
     if (z == Z_EOF) {
         // Completed writing input bytes.
         FD_CLR_WRITE(ctx->selectfd, server);
         shutdown(ctx->selectfd, SHUT_WR);
-        remove_selectfd_context(&server->ctxhead, ctx->selectfd);
+        remove_selectfd_context(server->ctxtable, ctx->selectfd);
     }
 }
 
 // Read cgi output to cgi_outputbuf.
+// Headers are parsed as they come in. Output that ends within the first
+// CGI_BUFSIZE bytes is sent as a whole, longer output is streamed to the
+// client, CGI_BUFSIZE bytes at most at a time.
 void read_cgi_output(LKHttpServer *server, LKContext *ctx) {
-    int z = lk_read_all_file(ctx->selectfd, ctx->cgi_outputbuf);
-    if (z == Z_BLOCK) {
-        return;
+    LKHttpResponse *resp = ctx->resp;
+    LKBuffer *buf = ctx->cgi_outputbuf;
+    int streaming = resp->chunked || resp->close_delimited;
+
+    if (streaming) {
+        clear_chunk_buffer(buf);
     }
+    size_t nread;
+    int z = lk_read_file(ctx->selectfd, buf, CGI_BUFSIZE - buf->bytes_len, &nread);
     if (z == Z_ERR) {
-        lk_print_err("lk_read_all_file()");
+        lk_print_err("lk_read_file()");
         z = terminate_fd(ctx->cgifd, FD_FILE, FD_READ, server);
         if (z == 0) {
             ctx->cgifd = 0;
         }
+        // Response head was already sent, so just drop the connection.
+        if (streaming) {
+            terminate_client_session(server, ctx);
+            return;
+        }
         process_error_response(server, ctx, 500, "Error processing CGI output.");
         return;
     }
+    int eof = (z == Z_EOF);
+    if (eof) {
+        // Remove cgi output from read list.
+        z = terminate_fd(ctx->cgifd, FD_FILE, FD_READ, server);
+        if (z == 0) {
+            ctx->cgifd = 0;
+        }
+    }
+    if (streaming) {
+        send_cgi_output(server, ctx, eof);
+        return;
+    }
 
-    // EOF - finished reading cgi output.
-    assert(z == 0);
+    int head = parse_cgi_head(buf, CGI_HEAD_MAX, resp);
+    if (head == -1) {
+        // No end of headers in sight, send the output as is.
+        lk_stringtable_clear(resp->headers);
+        resp->status = 0;
+        lk_httpresponse_add_header(resp, "Content-Type", "text/plain");
+        buf->bytes_cur = 0;
+    }
+    if (eof) {
+        if (head != 0) {
+            lk_buffer_append(resp->body, buf->bytes + buf->bytes_cur, buf->bytes_len - buf->bytes_cur);
+        } else {
+            // Let parse_cgi_output() deal with output missing the blank line.
+            lk_stringtable_clear(resp->headers);
+            resp->status = 0;
+            buf->bytes_cur = 0;
+            parse_cgi_output(buf, resp);
+        }
+        // Content-Length is set from the body when the response is finalized.
+        lk_stringtable_remove(resp->headers, "Content-Length");
+
+        // Compress cgi output unless the script already encoded it.
+        char *content_type = lk_stringtable_get(resp->headers, "Content-Type");
+        if ((resp->status == 0 || resp->status == 200) &&
+            lk_stringtable_get(resp->headers, "Content-Encoding") == NULL &&
+            resp->body->bytes_len >= server->cfg->compress_minsize &&
+            is_compressible(server, ctx->req, content_type)) {
+            set_compress(resp);
+            lk_httpresponse_add_header(resp, "Vary", "Accept-Encoding");
+        }
+        process_response(server, ctx);
+        return;
+    }
+    // Wait for the rest of the headers.
+    if (head == 0) {
+        return;
+    }
+    start_cgi_stream(server, ctx);
+}
 
-    // Remove cgi output from read list.
-    z = terminate_fd(ctx->cgifd, FD_FILE, FD_READ, server);
-    if (z == 0) {
-        ctx->cgifd = 0;
+// Clear buf, leaving room for a chunk size line before the bytes to follow.
+static void clear_chunk_buffer(LKBuffer *buf) {
+    lk_buffer_clear(buf);
+    lk_buffer_append_sprintf(buf, "%*s", CHUNK_HEAD_SIZE, "");
+    buf->bytes_cur = buf->bytes_len;
+}
+
+// Send response head along with the cgi output read so far. The rest of
+// the output is relayed by send_cgi_output() as it's read. Output is sent
+// in chunks to HTTP/1.1 clients, and until the connection closes to
+// HTTP/1.0 clients.
+static void start_cgi_stream(LKHttpServer *server, LKContext *ctx) {
+    LKHttpResponse *resp = ctx->resp;
+
+    // The script doesn't get to choose the framing.
+    lk_stringtable_remove(resp->headers, "Content-Length");
+    lk_stringtable_remove(resp->headers, "Transfer-Encoding");
+    if (lk_string_sz_equal(ctx->req->version, "HTTP/1.1")) {
+        resp->chunked = 1;
+    } else {
+        resp->close_delimited = 1;
+    }
+
+    // Compress cgi output unless the script already encoded it. Output
+    // size isn't known yet, so compressminsize doesn't apply.
+    char *content_type = lk_stringtable_get(resp->headers, "Content-Type");
+    if ((resp->status == 0 || resp->status == 200) &&
+        lk_stringtable_get(resp->headers, "Content-Encoding") == NULL &&
+        is_compressible(server, ctx->req, content_type)) {
+        ctx->cgi_gzip = lk_gzipstream_new(server->cfg->compress);
+        ctx->cgi_gzipbuf = lk_buffer_new(0);
+        lk_httpresponse_add_header(resp, "Content-Encoding", "gzip");
+        lk_httpresponse_add_header(resp, "Vary", "Accept-Encoding");
     }
 
-    parse_cgi_output(ctx->cgi_outputbuf, ctx->resp);
+    // Stop reading cgi output while the response head is sent.
+    FD_CLR_READ(ctx->cgifd, server);
     process_response(server, ctx);
+
+    // No body for HEAD, so the rest of the output isn't needed.
+    if (lk_string_sz_equal(ctx->req->method, "HEAD")) {
+        int z = terminate_fd(ctx->cgifd, FD_FILE, FD_READ, server);
+        if (z == 0) {
+            ctx->cgifd = 0;
+        }
+        return;
+    }
+    lk_reflist_append(ctx->buflist, frame_cgi_output(ctx, 0));
+}
+
+// Send cgi output read into cgi_outputbuf to the client.
+// The cgi program is not read from while the output is being sent, so a
+// slow client holds back the cgi program instead of output piling up here.
+static void send_cgi_output(LKHttpServer *server, LKContext *ctx, int eof) {
+    LKBuffer *out = frame_cgi_output(ctx, eof);
+    // Nothing read yet, keep waiting for cgi output.
+    if (!eof && out->bytes_cur == out->bytes_len) {
+        return;
+    }
+
+    if (ctx->cgifd != 0) {
+        FD_CLR_READ(ctx->cgifd, server);
+    }
+    set_select_ctx(server->ctxtable, ctx, ctx->clientfd);
+    ctx->type = CTX_WRITE_RESP;
+    FD_SET_WRITE(ctx->selectfd, server);
+    lk_reflist_clear(ctx->buflist);
+    lk_reflist_append(ctx->buflist, out);
+}
+
+// Return buffer holding the cgi output from cgi_outputbuf, compressed and
+// framed as a chunk as needed, ready to send from its bytes_cur.
+// Chunk size line is written in place just before the output bytes.
+static LKBuffer *frame_cgi_output(LKContext *ctx, int eof) {
+    LKBuffer *buf = ctx->cgi_outputbuf;
+    if (ctx->cgi_gzip != NULL) {
+        LKBuffer *gz = ctx->cgi_gzipbuf;
+        clear_chunk_buffer(gz);
+        lk_gzipstream_write(ctx->cgi_gzip, buf->bytes + buf->bytes_cur, buf->bytes_len - buf->bytes_cur, gz);
+        if (eof) {
+            lk_gzipstream_finish(ctx->cgi_gzip, gz);
+        }
+        buf = gz;
+    }
+    if (!ctx->resp->chunked) {
+        return buf;
+    }
+
+    size_t len = buf->bytes_len - buf->bytes_cur;
+    if (len > 0) {
+        char line[CHUNK_HEAD_SIZE+1];
+        size_t line_len = snprintf(line, sizeof(line), "%lx\r\n", len);
+        // Headers read before the first chunk may leave too little room.
+        if (line_len > buf->bytes_cur) {
+            size_t shift = line_len - buf->bytes_cur;
+            lk_buffer_append(buf, line, shift);
+            memmove(buf->bytes + buf->bytes_cur + shift, buf->bytes + buf->bytes_cur, len);
+            buf->bytes_cur += shift;
+        }
+        buf->bytes_cur -= line_len;
+        memcpy(buf->bytes + buf->bytes_cur, line, line_len);
+        lk_buffer_append(buf, "\r\n", 2);
+    }
+    if (eof) {
+        lk_buffer_append(buf, "0\r\n\r\n", 5);
+    }
+    return buf;
 }
 
 void process_request(LKHttpServer *server, LKContext *ctx) {
-    char *hostname = lk_stringtable_get(ctx->req->headers, "Host");
-    LKHostConfig *hc = lk_config_find_hostconfig(server->cfg, hostname);
+    switch (ctx->reqparser->error_status) {
+    case 0:
+        break;
+    case 413:
+        process_error_response(server, ctx, 413, "Request body too large.");
+        return;
+    case 431:
+        process_error_response(server, ctx, 431, "Request header fields too large.");
+        return;
+    case 501:
+        process_error_response(server, ctx, 501, "Transfer-Encoding not supported.");
+        return;
+    default:
+        process_error_response(server, ctx, 400, "Bad request.");
+        return;
+    }
+
+    // Match hostname without any port. Ex. "localhost:8000"
+    char hostname[LK_BUFSIZE_SMALL];
+    char *host = lk_stringtable_get(ctx->req->headers, "Host");
+    if (host != NULL) {
+        snprintf(hostname, sizeof(hostname), "%s", host);
+        char *port = strchr(hostname, ':');
+        if (port != NULL) {
+            *port = '\0';
+        }
+    }
+    LKHostConfig *hc = lk_config_find_hostconfig(server->cfg, host != NULL ? hostname : NULL);
     if (hc == NULL) {
         process_error_response(server, ctx, 404, "LittleKitten webserver: hostconfig not found.");
         return;
     }
+    ctx->hc = hc;
 
     // Forward request to proxyhost if proxyhost specified.
     if (hc->proxyhost->s_len > 0) {
@@ -398,7 +1001,6 @@ void process_request(LKHttpServer *server, LKContext *ctx) {
 // Generate an http response to an http request.
 #define POSTTEST
 void serve_files(LKHttpServer *server, LKContext *ctx, LKHostConfig *hc) {
-    int z;
     static char *html_error_start = 
        "<!DOCTYPE html>\n"
        "<html>\n"
@@ -413,32 +1015,94 @@ void serve_files(LKHttpServer *server, LKContext *ctx, LKHostConfig *hc) {
     LKString *path = req->path;
 
     if (lk_string_sz_equal(method, "GET") || lk_string_sz_equal(method, "HEAD")) {
+        LKFileCacheItem *file = NULL;
+        time_t now = time(NULL);
         // For root, default to index.html, ...
         if (path->s_len == 0) {
             char *default_files[] = {"/index.html", "/index.htm", "/default.html", "/default.htm"};
             for (int i=0; i < sizeof(default_files) / sizeof(char *); i++) {
-                z = read_path_file(hc->homedir_abspath->s, default_files[i], resp->body);
-                if (z >= 0) {
-                    lk_httpresponse_add_header(resp, "Content-Type", "text/html");
+                file = lk_filecache_open(server->filecache, hc->homedir_abspath->s, default_files[i], now);
+                if (file != NULL) {
                     break;
                 }
                 // Update path with default file for File not found error message.
                 lk_string_assign(path, default_files[i]);
             }
         } else {
-            z = read_path_file(hc->homedir_abspath->s, path->s, resp->body);
-            char *content_type = (char *) lk_lookup(mimetypes_tbl, fileext(path->s));
-            if (content_type == NULL) {
-                content_type = "text/plain";
-            }
-            lk_httpresponse_add_header(resp, "Content-Type", content_type);
+            file = lk_filecache_open(server->filecache, hc->homedir_abspath->s, path->s, now);
         }
-        if (z == -1) {
+        if (file == NULL) {
             // path not found
             resp->status = 404;
             lk_string_assign_sprintf(resp->statustext, "File not found '%s'", path->s);
             lk_httpresponse_add_header(resp, "Content-Type", "text/plain");
             lk_buffer_append_sprintf(resp->body, "File not found '%s'\n", path->s);
+            return;
+        }
+
+        // Content type is looked up once per cached file. Loop threads
+        // sharing the cache may both look it up, storing the same value.
+        char *content_type = __atomic_load_n(&file->content_type, __ATOMIC_ACQUIRE);
+        if (content_type == NULL) {
+            content_type = (char *) lk_lookup(mimetypes_tbl, fileext(file->path->s));
+            if (content_type == NULL) {
+                content_type = "text/plain";
+            }
+            __atomic_store_n(&file->content_type, content_type, __ATOMIC_RELEASE);
+        }
+
+        // Send precompressed file.gz or file.br instead if client accepts it.
+        char *encoding = NULL;
+        LKFileCacheItem *sidecar = open_sidecar(server, hc, req, file, &encoding);
+        if (sidecar != NULL) {
+            lk_filecache_release(file);
+            file = sidecar;
+        }
+
+        // Otherwise gzip small text files, unless only parts are wanted.
+        char *range = lk_stringtable_get(req->headers, "Range");
+        int compress = sidecar == NULL && range == NULL &&
+            file->size >= server->cfg->compress_minsize && file->size <= COMPRESS_MAX_FILE_SIZE &&
+            is_compressible(server, req, content_type);
+        char etag[sizeof(file->etag) + 4];
+        snprintf(etag, sizeof(etag), "%s", file->etag);
+        if (compress) {
+            // Compressed bytes get their own etag. Ex. "1a2b-3c-4d5e-gz"
+            snprintf(etag, sizeof(etag), "%.*s-gz\"", (int) strlen(file->etag)-1, file->etag);
+        }
+        lk_httpresponse_add_header(resp, "Vary", "Accept-Encoding");
+        lk_httpresponse_add_header(resp, "ETag", etag);
+        lk_httpresponse_add_header(resp, "Last-Modified", file->last_modified);
+        add_cache_headers(resp, hc);
+
+        // Client's cached copy is still current. There's no body to
+        // encode.
+        if (is_not_modified(req, etag, file->mtime)) {
+            resp->status = 304;
+            lk_string_assign(resp->statustext, "Not Modified");
+            lk_filecache_release(file);
+            return;
+        }
+
+        if (encoding != NULL) {
+            lk_httpresponse_add_header(resp, "Content-Encoding", encoding);
+        } else if (compress) {
+            set_compress(resp);
+        }
+
+        resp->status = 200;
+        lk_string_assign(resp->statustext, "OK");
+        if (!resp->compress) {
+            lk_httpresponse_add_header(resp, "Accept-Ranges", "bytes");
+        }
+        lk_httpresponse_add_header(resp, "Content-Type", content_type);
+
+        // File contents are sent directly from the open file.
+        lk_httpresponse_set_bodyfile(resp, file, 0, file->size);
+
+        // Send only the requested byte ranges.
+        if (range != NULL && lk_string_sz_equal(method, "GET") && is_range_current(req, file)) {
+            serve_ranges(resp, file, content_type, range);
         }
         return;
     }
@@ -463,7 +1127,7 @@ void serve_files(LKHttpServer *server, LKContext *ctx, LKHostConfig *hc) {
 #endif
 
     resp->status = 501;
-    lk_string_assign_sprintf(resp->statustext, "Unsupported method ('%s')", method);
+    lk_string_assign_sprintf(resp->statustext, "Unsupported method ('%s')", method->s);
 
     lk_httpresponse_add_header(resp, "Content-Type", "text/html");
     lk_buffer_append(resp->body, html_error_start, strlen(html_error_start));
@@ -502,7 +1166,9 @@ void serve_cgi(LKHttpServer *server, LKContext *ctx, LKHostConfig *hc) {
     // cgi stdout and stderr are streamed to fd_out.
     //$$todo pass any request body to fd_in.
     int fd_in, fd_out;
-    int z = lk_popen3(real_path, &fd_in, &fd_out, NULL);
+    char **envp = create_envp(server->cgienv);
+    int z = lk_popen3(real_path, envp, &fd_in, &fd_out, NULL);
+    free_envp(envp);
     if (z == -1) {
         resp->status = 500;
         lk_string_assign_sprintf(resp->statustext, "Server error '%s'", strerror(errno));
@@ -511,11 +1177,12 @@ void serve_cgi(LKHttpServer *server, LKContext *ctx, LKHostConfig *hc) {
         process_response(server, ctx);
         return;
     }
+    // Don't block the event loop waiting on the cgi program.
+    fcntl(fd_in, F_SETFL, O_NONBLOCK);
+    fcntl(fd_out, F_SETFL, O_NONBLOCK);
 
-    close(fd_in);
-
-    // Read cgi output in select()
-    ctx->selectfd = fd_out;
+    // Read cgi output in event loop
+    set_select_ctx(server->ctxtable, ctx, fd_out);
     ctx->cgifd = fd_out;
     ctx->type = CTX_READ_CGI_OUTPUT;
     ctx->cgi_outputbuf = lk_buffer_new(0);
@@ -524,17 +1191,18 @@ void serve_cgi(LKHttpServer *server, LKContext *ctx, LKHostConfig *hc) {
     // If req is POST with body, pass it to cgi process stdin.
     if (req->body->bytes_len > 0) {
         LKContext *ctx_in = lk_context_new();
-        add_context(&server->ctxhead, ctx_in);
-
         ctx_in->selectfd = fd_in;
         ctx_in->cgifd = fd_in;
         ctx_in->clientfd = ctx->clientfd;
         ctx_in->type = CTX_WRITE_CGI_INPUT;
+        add_context(server->ctxtable, ctx_in);
 
         ctx_in->cgi_inputbuf = lk_buffer_new(0);
         lk_buffer_append(ctx_in->cgi_inputbuf, req->body->bytes, req->body->bytes_len);
 
         FD_SET_WRITE(ctx_in->selectfd, server);
+    } else {
+        close(fd_in);
     }
 }
 
@@ -542,11 +1210,25 @@ void process_response(LKHttpServer *server, LKContext *ctx) {
     LKHttpRequest *req = ctx->req;
     LKHttpResponse *resp = ctx->resp;
 
-    lk_httpresponse_finalize(resp);
+    // Respond in HTTP/1.1 to HTTP/1.1 clients.
+    if (resp->version->s_len == 0 && lk_string_sz_equal(req->version, "HTTP/1.1")) {
+        lk_string_assign(resp->version, "HTTP/1.1");
+    }
+    ctx->keepalive = is_keepalive(server, ctx);
+
+    // Small static files are sent from their preformatted response.
+    if (!set_hot_response(server, ctx)) {
+        if (resp->compress) {
+            compress_body(server, resp);
+        }
+        lk_httpresponse_add_header(resp, "Connection", ctx->keepalive ? "keep-alive" : "close");
+        lk_httpresponse_finalize(resp);
 
-    // Clear response body on HEAD request.
-    if (lk_string_sz_equal(req->method, "HEAD")) {
-        lk_buffer_clear(resp->body);
+        // Clear response body on HEAD request.
+        if (lk_string_sz_equal(req->method, "HEAD")) {
+            lk_buffer_clear(resp->body);
+            lk_httpresponse_close_bodyfd(resp);
+        }
     }
 
     char time_str[TIME_STRING_SIZE];
@@ -561,61 +1243,378 @@ void process_response(LKHttpServer *server, LKContext *ctx) {
             resp->status, resp->statustext->s);
     }
 
-    ctx->selectfd = ctx->clientfd;
+    set_select_ctx(server->ctxtable, ctx, ctx->clientfd);
     ctx->type = CTX_WRITE_RESP;
     FD_SET_WRITE(ctx->selectfd, server);
     lk_reflist_clear(ctx->buflist);
     lk_reflist_append(ctx->buflist, resp->head);
-    lk_reflist_append(ctx->buflist, resp->body);
+    // File body is sent by lk_httpresponse_write_bodyfd() along with body.
+    if (resp->bodyfd == -1) {
+        lk_reflist_append(ctx->buflist, resp->body);
+    }
     return;
 }
 
-void process_error_response(LKHttpServer *server, LKContext *ctx, int status, char *msg) {
+// Point resp->rawresp to the complete response of a small static file
+// kept in the hot cache, formatting and caching it on first use.
+// Returns 1 if rawresp is set, 0 if resp is to be finalized as usual.
+static int set_hot_response(LKHttpServer *server, LKContext *ctx) {
+    LKFileCache *fc = server->filecache;
     LKHttpResponse *resp = ctx->resp;
-    resp->status = status;
-    lk_string_assign(resp->statustext, msg);
-    lk_httpresponse_add_header(resp, "Content-Type", "text/plain");
-    lk_buffer_append_sz(resp->body, msg);
+    LKFileCacheItem *file = resp->bodyfile;
 
-    process_response(server, ctx);
+    // Only whole file 200 responses are cached.
+    // Expires changes every second so it is never cached.
+    if (file == NULL || resp->status != 200 ||
+        resp->bodyfd_offset != 0 || resp->bodyfd_end != file->size ||
+        ctx->hc == NULL || ctx->hc->expires >= 0) {
+        return 0;
+    }
+
+    // Held until the response is cached so that loop threads sharing fc
+    // format each variant only once.
+    lk_filecache_lock(fc);
+    if (!lk_filecache_can_hot(fc, file, ctx->hc)) {
+        lk_filecache_unlock(fc);
+        return 0;
+    }
+
+    int variant = 0;
+    if (lk_string_sz_equal(resp->version, "HTTP/1.1")) {
+        variant |= 1;
+    }
+    if (ctx->keepalive) {
+        variant |= 2;
+    }
+    // A sidecar file is also served as is when requested by its own
+    // path, and may be gzipped then.
+    if (resp->compress) {
+        variant |= 8;
+    } else if (lk_stringtable_get(resp->headers, "Content-Encoding") != NULL) {
+        variant |= 4;
+    }
+
+    size_t head_len;
+    LKBuffer *hot = lk_filecache_get_hot(fc, file, variant, &head_len);
+    if (hot == NULL) {
+        LKBuffer *body = lk_buffer_new(file->size);
+        // File may have changed since it was opened.
+        if (lk_filecache_read(file, body) != file->size) {
+            lk_buffer_free(body);
+            lk_filecache_unlock(fc);
+            return 0;
+        }
+        // Compressed once here, then sent from memory like any hot file.
+        // resp keeps file referenced while the hot response is sent.
+        if (resp->compress) {
+            LKBuffer *gz = gzip_buffer(server, body);
+            lk_buffer_free(body);
+            body = gz;
+            resp->bodyfd_offset = resp->bodyfd_end;
+            lk_buffer_clear(resp->body);
+            lk_buffer_append(resp->body, body->bytes, body->bytes_len);
+        }
+
+        lk_httpresponse_add_header(resp, "Connection", ctx->keepalive ? "keep-alive" : "close");
+        lk_httpresponse_finalize(resp);
+
+        hot = lk_buffer_new(resp->head->bytes_len + body->bytes_len);
+        lk_buffer_append(hot, resp->head->bytes, resp->head->bytes_len);
+        lk_buffer_append(hot, body->bytes, body->bytes_len);
+        lk_buffer_free(body);
+        head_len = resp->head->bytes_len;
+        lk_filecache_set_hot(fc, file, variant, hot, head_len, ctx->hc);
+    }
+    lk_filecache_unlock(fc);
+
+    resp->rawresp = hot;
+    resp->rawresp_len = hot->bytes_len;
+    resp->rawresp_cur = 0;
+    if (lk_string_sz_equal(ctx->req->method, "HEAD")) {
+        resp->rawresp_len = head_len;
+    }
+    return 1;
 }
 
-// Open <home_dir>/<uri> file in nonblocking mode.
-// Returns 0 for success, -1 for error.
-int open_path_file(char *home_dir, char *path) {
-    // full_path = home_dir + path
-    // Ex. "/path/to" + "/index.html"
-    LKString *full_path = lk_string_new(home_dir);
-    lk_string_append(full_path, path);
-
-    int z = open(full_path->s, O_RDONLY | O_NONBLOCK);
-    lk_string_free(full_path);
-    return z;
+// Return whether request's If-None-Match or If-Modified-Since headers
+// match the current file's etag and mtime.
+static int is_not_modified(LKHttpRequest *req, char *etag, time_t mtime) {
+    // If-None-Match takes precedence over If-Modified-Since.
+    char *if_none_match = lk_stringtable_get(req->headers, "If-None-Match");
+    if (if_none_match != NULL) {
+        return etag_list_match(if_none_match, etag);
+    }
+    char *if_modified_since = lk_stringtable_get(req->headers, "If-Modified-Since");
+    if (if_modified_since != NULL) {
+        time_t t = lk_parse_http_date(if_modified_since);
+        return t != -1 && mtime <= t;
+    }
+    return 0;
 }
 
-// Read <home_dir>/<uri> file into buffer.
-// Return number of bytes read or -1 for error.
-int read_path_file(char *home_dir, char *path, LKBuffer *buf) {
-    int z;
-    // full_path = home_dir + path
-    // Ex. "/path/to" + "/index.html"
-    LKString *full_path = lk_string_new(home_dir);
-    lk_string_append(full_path, path);
+// Return whether etag is in comma separated etags list or list is "*".
+// Uses weak comparison, ignoring any W/ prefix.
+static int etag_list_match(char *etags, char *etag) {
+    size_t etag_len = strlen(etag);
+    char *p = etags;
+    while (*p != '\0') {
+        while (*p == ' ' || *p == '\t' || *p == ',') {
+            p++;
+        }
+        char *end = p;
+        while (*end != '\0' && *end != ',') {
+            end++;
+        }
+        char *q = end;
+        while (q > p && (q[-1] == ' ' || q[-1] == '\t')) {
+            q--;
+        }
+        if (q - p == 1 && *p == '*') {
+            return 1;
+        }
+        if (q - p > 2 && !strncmp(p, "W/", 2)) {
+            p += 2;
+        }
+        if (q - p == etag_len && !strncmp(p, etag, etag_len)) {
+            return 1;
+        }
+        p = end;
+    }
+    return 0;
+}
 
-    // Expand "/../", etc. into real_path.
-    char real_path[PATH_MAX];
-    char *pz = realpath(full_path->s, real_path);
-    // real_path should start with home_dir
-    if (pz == NULL || strncmp(real_path, home_dir, strlen(home_dir))) {
-        lk_string_free(full_path);
-        z = -1;
-        errno = EPERM;
-        return z;
+// Return whether If-Range header, if any, matches the current file.
+// Range requests for a changed file get the whole file instead.
+static int is_range_current(LKHttpRequest *req, LKFileCacheItem *file) {
+    char *if_range = lk_stringtable_get(req->headers, "If-Range");
+    if (if_range == NULL) {
+        return 1;
+    }
+    // Entity tag uses strong comparison.
+    if (if_range[0] == '"' || !strncmp(if_range, "W/", 2)) {
+        return !strcmp(if_range, file->etag);
+    }
+    return lk_parse_http_date(if_range) == file->mtime;
+}
+
+#define MAX_RANGES 16
+
+// Turn file response into 206 Partial Content response with the ranges
+// specified in Range header. Multiple ranges are sent as multipart/byteranges.
+// Invalid Range headers are ignored, unsatisfiable ranges return 416.
+static void serve_ranges(LKHttpResponse *resp, LKFileCacheItem *file, char *content_type, char *range) {
+    off_t starts[MAX_RANGES];
+    off_t ends[MAX_RANGES];
+    int nranges = lk_parse_byte_ranges(range, file->size, starts, ends, MAX_RANGES);
+    if (nranges == -1) {
+        return;
     }
+    if (nranges == 0) {
+        lk_httpresponse_close_bodyfd(resp);
+        resp->status = 416;
+        lk_string_assign(resp->statustext, "Range Not Satisfiable");
+        lk_stringtable_remove(resp->headers, "Accept-Ranges");
+        lk_stringtable_remove(resp->headers, "Content-Encoding");
+        lk_httpresponse_add_header(resp, "Content-Type", "text/plain");
+        lk_buffer_append_sprintf(resp->body, "Range not satisfiable '%s'\n", range);
 
-    z = lk_readfile(real_path, buf);
-    lk_string_free(full_path);
-    return z;
+        char content_range[LK_BUFSIZE_SMALL];
+        snprintf(content_range, sizeof(content_range), "bytes */%ld", file->size);
+        lk_httpresponse_add_header(resp, "Content-Range", content_range);
+        return;
+    }
+
+    resp->status = 206;
+    lk_string_assign(resp->statustext, "Partial Content");
+    if (nranges == 1) {
+        char content_range[LK_BUFSIZE_SMALL];
+        snprintf(content_range, sizeof(content_range), "bytes %ld-%ld/%ld", starts[0], ends[0]-1, file->size);
+        lk_httpresponse_add_header(resp, "Content-Range", content_range);
+        resp->bodyfd_offset = starts[0];
+        resp->bodyfd_end = ends[0];
+        return;
+    }
+
+    // Each range is sent as a part with its own headers, in between boundaries.
+    char boundary[32];
+    snprintf(boundary, sizeof(boundary), "%08lx%08lx", random(), random());
+    char multipart_type[LK_BUFSIZE_SMALL];
+    snprintf(multipart_type, sizeof(multipart_type), "multipart/byteranges; boundary=%s", boundary);
+    lk_httpresponse_add_header(resp, "Content-Type", multipart_type);
+
+    resp->bodyfd_offset = 0;
+    resp->bodyfd_end = 0;
+    for (int i=0; i < nranges; i++) {
+        lk_buffer_append_sprintf(resp->body, "\r\n--%s\r\n", boundary);
+        lk_buffer_append_sprintf(resp->body, "Content-Type: %s\r\n", content_type);
+        lk_buffer_append_sprintf(resp->body, "Content-Range: bytes %ld-%ld/%ld\r\n\r\n", starts[i], ends[i]-1, file->size);
+        lk_httpresponse_add_bodyfd_range(resp, starts[i], ends[i]);
+    }
+    lk_buffer_append_sprintf(resp->body, "\r\n--%s--\r\n", boundary);
+}
+
+// Sidecar encodings in order of preference.
+static struct {
+    char *coding;
+    char *ext;
+} sidecar_encodings[] = {
+    {"br", ".br"},
+    {"gzip", ".gz"},
+};
+
+// Return precompressed sidecar of file, such as "style.css.gz" for
+// "style.css", in the first encoding accepted by the client, or NULL if
+// there is none. Sidecar must not be older than file.
+// Sidecars are looked up through the file cache, which also remembers
+// the ones that don't exist.
+static LKFileCacheItem *open_sidecar(LKHttpServer *server, LKHostConfig *hc, LKHttpRequest *req, LKFileCacheItem *file, char **encoding) {
+    char *accept_encoding = lk_stringtable_get(req->headers, "Accept-Encoding");
+    if (accept_encoding == NULL) {
+        return NULL;
+    }
+
+    // file->path is "<homedir><path>"
+    char *path = file->path->s + hc->homedir_abspath->s_len;
+    char sidecar_path[PATH_MAX];
+    time_t now = time(NULL);
+
+    for (int i=0; i < sizeof(sidecar_encodings) / sizeof(sidecar_encodings[0]); i++) {
+        if (!lk_accepts_encoding(accept_encoding, sidecar_encodings[i].coding)) {
+            continue;
+        }
+        int z = snprintf(sidecar_path, sizeof(sidecar_path), "%s%s", path, sidecar_encodings[i].ext);
+        if (z < 0 || z >= sizeof(sidecar_path)) {
+            continue;
+        }
+        LKFileCacheItem *sidecar = lk_filecache_open(server->filecache, hc->homedir_abspath->s, sidecar_path, now);
+        if (sidecar == NULL) {
+            continue;
+        }
+        // Stale sidecar left over from an older version of file.
+        if (sidecar->mtime < file->mtime) {
+            lk_filecache_release(sidecar);
+            continue;
+        }
+        *encoding = sidecar_encodings[i].coding;
+        return sidecar;
+    }
+    return NULL;
+}
+
+// Return whether a response body of content_type should be gzip
+// compressed for the client of req.
+static int is_compressible(LKHttpServer *server, LKHttpRequest *req, char *content_type) {
+    LKConfig *cfg = server->cfg;
+    if (cfg->compress == 0 || content_type == NULL) {
+        return 0;
+    }
+
+    // Match media type without parameters. Ex. "text/html; charset=utf-8"
+    size_t type_len = strcspn(content_type, "; \t");
+    int match = 0;
+    for (char **p = compresstypes_tbl; *p != NULL; p++) {
+        if (strlen(*p) == type_len && !strncasecmp(*p, content_type, type_len)) {
+            match = 1;
+            break;
+        }
+    }
+    if (!match) {
+        return 0;
+    }
+
+    char *accept_encoding = lk_stringtable_get(req->headers, "Accept-Encoding");
+    return accept_encoding != NULL && lk_accepts_encoding(accept_encoding, "gzip");
+}
+
+// Mark response body to be sent gzip compressed.
+static void set_compress(LKHttpResponse *resp) {
+    resp->compress = 1;
+    lk_httpresponse_add_header(resp, "Content-Encoding", "gzip");
+}
+
+// Return new buffer with gzip compressed bytes of buf.
+static LKBuffer *gzip_buffer(LKHttpServer *server, LKBuffer *buf) {
+    LKBuffer *gz = lk_buffer_new(buf->bytes_len / 2 + 64);
+    lk_gzip(buf->bytes, buf->bytes_len, server->cfg->compress, gz);
+    return gz;
+}
+
+// Replace response body, or the file it is sent from, with its gzip
+// compressed bytes.
+static void compress_body(LKHttpServer *server, LKHttpResponse *resp) {
+    LKBuffer *body = resp->body;
+    if (resp->bodyfile != NULL) {
+        body = lk_buffer_new(resp->bodyfile->size);
+        if (lk_filecache_read(resp->bodyfile, body) != resp->bodyfile->size) {
+            // Send the file uncompressed if it can't be read whole.
+            lk_buffer_free(body);
+            resp->compress = 0;
+            lk_stringtable_remove(resp->headers, "Content-Encoding");
+            return;
+        }
+    }
+
+    LKBuffer *gz = gzip_buffer(server, body);
+    if (body != resp->body) {
+        lk_buffer_free(body);
+        lk_httpresponse_close_bodyfd(resp);
+    }
+    lk_buffer_free(resp->body);
+    resp->body = gz;
+    resp->compress = 0;
+}
+
+// Add hostconfig's Cache-Control and Expires headers for static files.
+static void add_cache_headers(LKHttpResponse *resp, LKHostConfig *hc) {
+    if (hc->cachecontrol->s_len > 0) {
+        lk_httpresponse_add_header(resp, "Cache-Control", hc->cachecontrol->s);
+    }
+    if (hc->expires >= 0) {
+        char expires_str[HTTP_DATE_SIZE];
+        lk_http_date_string(time(NULL) + hc->expires, expires_str, sizeof(expires_str));
+        lk_httpresponse_add_header(resp, "Expires", expires_str);
+    }
+}
+
+// Return whether client connection should stay open for the next request.
+static int is_keepalive(LKHttpServer *server, LKContext *ctx) {
+    LKConfig *cfg = server->cfg;
+    LKHttpRequest *req = ctx->req;
+
+    if (cfg->keepalive_timeout == 0) {
+        return 0;
+    }
+    if (cfg->keepalive_max > 0 && ctx->nrequests+1 >= cfg->keepalive_max) {
+        return 0;
+    }
+    // Client already closed its end, or request couldn't be parsed.
+    // Rest of a rejected request is left unread.
+    if (ctx->sr->sockclosed || req->method->s_len == 0 || ctx->reqparser->error_status != 0) {
+        return 0;
+    }
+    // Proxy responses are passed through as is until the proxy closes,
+    // as is streamed output to HTTP/1.0 clients.
+    if (ctx->type == CTX_PROXY_WRITE_REQ || ctx->type == CTX_PROXY_PIPE_RESP ||
+        ctx->resp->close_delimited) {
+        return 0;
+    }
+
+    // HTTP/1.1 defaults to keep-alive, HTTP/1.0 has to ask for it.
+    char *connection = lk_stringtable_get(req->headers, "Connection");
+    if (lk_string_sz_equal(req->version, "HTTP/1.1")) {
+        return connection == NULL || strcasecmp(connection, "close");
+    }
+    return connection != NULL && !strcasecmp(connection, "keep-alive");
+}
+
+void process_error_response(LKHttpServer *server, LKContext *ctx, int status, char *msg) {
+    LKHttpResponse *resp = ctx->resp;
+    resp->status = status;
+    lk_string_assign(resp->statustext, msg);
+    lk_httpresponse_add_header(resp, "Content-Type", "text/plain");
+    lk_buffer_append_sz(resp->body, msg);
+
+    process_response(server, ctx);
 }
 
 int is_valid_http_method(char *method) {
@@ -654,17 +1653,48 @@ char *fileext(char *filepath) {
 }
 
 void write_response(LKHttpServer *server, LKContext *ctx) {
-    int z = lk_buflist_write_all(ctx->selectfd, FD_SOCK, ctx->buflist);
+    LKHttpResponse *resp = ctx->resp;
+    int z;
+    if (resp->rawresp != NULL) {
+        z = lk_write_all_bytes(ctx->selectfd, FD_SOCK, resp->rawresp->bytes, resp->rawresp_len, &resp->rawresp_cur);
+    } else {
+        z = lk_buflist_write_all(ctx->selectfd, FD_SOCK, ctx->buflist);
+        if (z == Z_EOF && resp->bodyfd != -1) {
+            z = lk_httpresponse_write_bodyfd(ctx->selectfd, resp);
+        }
+    }
     if (z == Z_BLOCK) {
         return;
     }
     if (z == Z_ERR) {
-        lk_print_err("write_response lk_buflist_write_all()");
+        lk_print_err("write_response()");
         terminate_client_session(server, ctx);
         return;
     }
     if (z == Z_EOF) {
+        // Output sent, read more of the streamed cgi output.
+        if ((resp->chunked || resp->close_delimited) && ctx->cgifd != 0) {
+            FD_CLR_WRITE(ctx->selectfd, server);
+            set_select_ctx(server->ctxtable, ctx, ctx->cgifd);
+            ctx->type = CTX_READ_CGI_OUTPUT;
+            FD_SET_READ(ctx->cgifd, server);
+            return;
+        }
+
         // Completed sending http response.
+        if (ctx->keepalive) {
+            // Wait for next request on the same connection.
+            FD_SET_READ(ctx->selectfd, server);
+            FD_CLR_WRITE(ctx->selectfd, server);
+            reset_client_context(ctx);
+
+            // Pipelined requests already read into the socket reader
+            // won't trigger another read event, so process them now.
+            if (lk_socketreader_buffered(ctx->sr) > 0) {
+                read_request(server, ctx);
+            }
+            return;
+        }
         terminate_client_session(server, ctx);
     }
 }
@@ -677,9 +1707,11 @@ void serve_proxy(LKHttpServer *server, LKContext *ctx, char *targethost) {
         return;
     }
 
+    // Proxy response is piped to the client until the proxy closes.
+    lk_httprequest_add_header(ctx->req, "Connection", "close");
     lk_httprequest_finalize(ctx->req);
     ctx->proxyfd = proxyfd;
-    ctx->selectfd = proxyfd;
+    set_select_ctx(server->ctxtable, ctx, proxyfd);
     ctx->type = CTX_PROXY_WRITE_REQ;
     FD_SET_WRITE(proxyfd, server);
     lk_reflist_clear(ctx->buflist);
@@ -803,7 +1835,7 @@ void write_proxy_response(LKHttpServer *server, LKContext *ctx) {
 }
 #endif
 
-// Clear fd from select()'s, shutdown, and close.
+// Clear fd from event loop, shutdown, and close.
 int terminate_fd(int fd, FDType fd_type, FDAction fd_action, LKHttpServer *server) {
     int z;
     if (fd_action == FD_READ || fd_action == FD_READWRITE) {
@@ -844,7 +1876,8 @@ void terminate_client_session(LKHttpServer *server, LKContext *ctx) {
     if (ctx->proxyfd) {
         terminate_fd(ctx->proxyfd, FD_SOCK, FD_READWRITE, server);
     }
-    // Remove from linked list and free ctx.
-    remove_client_context(&server->ctxhead, ctx->clientfd);
+    // Remove from context table and free ctx.
+    remove_client_context(server->ctxtable, ctx->clientfd);
+    __atomic_sub_fetch(&server->nclients, 1, __ATOMIC_RELAXED);
 }
 
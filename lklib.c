@@ -1,9 +1,11 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <time.h>
+#include <fcntl.h>
 #include "lklib.h"
 
 // forward declarations
@@ -45,59 +47,67 @@ int ends_with_newline(char *s) {
 
 
 // Like popen() but returning input, output, error fds for cmd.
-int lk_popen3(char *cmd, int *fd_in, int *fd_out, int *fd_err) {
+// cmd is run with environment envp, or the current environment if
+// envp is NULL.
+int lk_popen3(char *cmd, char **envp, int *fd_in, int *fd_out, int *fd_err) {
     int z;
     int in[2] = {0, 0};
     int out[2] = {0, 0};
     int err[2] = {0, 0};
 
-    z = pipe(in);
+    // Close on exec so that cgi processes started concurrently by other
+    // threads don't inherit these pipes and hold them open.
+    z = pipe2(in, O_CLOEXEC);
     if (z == -1) {
         return z;
     }
-    z = pipe(out);
+    z = pipe2(out, O_CLOEXEC);
     if (z == -1) {
         close_pipes(in, out, err);
         return z;
     }
-    z = pipe(err);
+    z = pipe2(err, O_CLOEXEC);
     if (z == -1) {
         close_pipes(in, out, err);
         return z;
     }
 
     int pid = fork();
+    if (pid == -1) {
+        close_pipes(in, out, err);
+        return pid;
+    }
     if (pid == 0) {
         // child proc
         z = dup2(in[0], STDIN_FILENO);
         if (z == -1) {
-            close_pipes(in, out, err);
-            return z;
+            _exit(1);
         }
         z = dup2(out[1], STDOUT_FILENO);
         if (z == -1) {
-            close_pipes(in, out, err);
-            return z;
+            _exit(1);
         }
         // If fd_err parameter provided, use separate fd for stderr.
         // If fd_err is NULL, combine stdout and stderr into fd_out.
         if (fd_err != NULL) {
             z = dup2(err[1], STDERR_FILENO);
             if (z == -1) {
-                close_pipes(in, out, err);
-                return z;
+                _exit(1);
             }
         } else {
             z = dup2(out[1], STDERR_FILENO);
             if (z == -1) {
-                close_pipes(in, out, err);
-                return z;
+                _exit(1);
             }
         }
 
         close_pipes(in, out, err);
-        z = execl("/bin/sh", "sh",  "-c", cmd, NULL);
-        return z;
+        if (envp != NULL) {
+            execle("/bin/sh", "sh",  "-c", cmd, NULL, envp);
+        } else {
+            execl("/bin/sh", "sh",  "-c", cmd, NULL);
+        }
+        _exit(1);
     }
 
     // parent proc
@@ -22,7 +22,7 @@ void lk_exit_err(char *s);
 char *lk_vasprintf(char *fmt, va_list args);
 int is_empty_line(char *s);
 int ends_with_newline(char *s);
-int lk_popen3(char *cmd, int *fd_in, int *fd_out, int *fd_err);
+int lk_popen3(char *cmd, char **envp, int *fd_in, int *fd_out, int *fd_err);
 
 // Return localtime in server format: 11/Mar/2023 14:05:46
 // Usage:
@@ -31,6 +31,14 @@ int lk_popen3(char *cmd, int *fd_in, int *fd_out, int *fd_err);
 #define TIME_STRING_SIZE 25
 void get_localtime_string(char *time_str, size_t time_str_len);
 
+// Allocation stats per label, kept when built with -DDEBUGALLOC.
+typedef struct {
+    char *label;
+    unsigned long nallocs;      // allocations made with label
+    unsigned long nlive;        // allocations not yet freed
+    size_t live_bytes;          // bytes of allocations not yet freed
+} LKAllocStats;
+
 void lk_alloc_init();
 void *lk_malloc(size_t size, char *label);
 void *lk_realloc(void *p, size_t size, char *label);
@@ -38,6 +46,24 @@ void lk_free(void *p);
 char *lk_strdup(const char *s, char *label);
 char *lk_strndup(const char *s, size_t n, char *label);
 void lk_print_allocitems();
+unsigned long lk_alloc_count();
+int lk_alloc_stats(char *label, LKAllocStats *stats);
+
+// Largest object allocated from slabs.
+#define LK_SLAB_MAXSIZE 256
+
+// Slab allocator stats of a thread.
+typedef struct {
+    unsigned long nallocs;      // objects allocated from slabs
+    long live_bytes;            // bytes of objects not yet freed, by size class
+    size_t slab_bytes;          // bytes of slab chunks allocated
+} LKSlabStats;
+
+void *lk_slab_alloc(size_t size);
+void lk_slab_free(void *p, size_t size);
+void lk_slab_stats(LKSlabStats *stats);
+void *lk_obj_alloc(size_t size, char *label);
+void lk_obj_free(void *p, size_t size);
 // vasprintf(&ps, fmt, args); //$$ lk_vasprintf()?
 
 // Return matching item in lookup table given testk.
@@ -47,10 +73,15 @@ void lk_print_allocitems();
 void **lk_lookup(void **tbl, char *testk);
 
 /*** LKString ***/
+// Strings of up to LK_STRING_INLINE_SIZE chars are kept in inline_s,
+// longer ones in a separately allocated buffer. s points to either one.
+#define LK_STRING_INLINE_SIZE 23
+
 typedef struct {
     char *s;
     size_t s_len;
     size_t s_size;
+    char inline_s[LK_STRING_INLINE_SIZE+1];
 } LKString;
 
 typedef struct lkstringlist LKStringList;
@@ -65,6 +96,8 @@ void lk_string_assign_sprintf(LKString *lks, char *fmt, ...);
 void lk_string_append(LKString *lks, char *s);
 void lk_string_append_sprintf(LKString *lks, char *fmt, ...);
 void lk_string_append_char(LKString *lks, char c);
+void lk_string_append_bytes(LKString *lks, char *bytes, size_t len);
+void lk_string_reserve(LKString *lks, size_t len);
 
 void lk_string_prepend(LKString *lks, char *s);
 
@@ -81,23 +114,49 @@ void lk_string_split_assign(LKString *s, char *delim, LKString *k, LKString *v);
 void sz_string_split_assign(char *s, char *delim, LKString *k, LKString *v);
 
 
+/*** LKArena - Bump allocator for objects freed together ***/
+typedef struct lkarenablock LKArenaBlock;
+
+typedef struct {
+    LKArenaBlock *blocks;   // current block, linked to the previous ones
+    size_t block_size;
+    size_t nallocs;         // allocations since the last reset
+    size_t nbytes;          // bytes allocated since the last reset
+} LKArena;
+
+LKArena *lk_arena_new(size_t block_size);
+void lk_arena_free(LKArena *arena);
+void *lk_arena_alloc(LKArena *arena, size_t size);
+char *lk_arena_strdup(LKArena *arena, char *s);
+void lk_arena_reset(LKArena *arena);
+
+
 /*** LKStringTable ***/
 typedef struct {
     LKString *k;
     LKString *v;
 } LKStringTableItem;
 
+// Items are kept in the order they were set, and are looked up through
+// a hash index of item positions.
 typedef struct {
     LKStringTableItem *items;
     size_t items_len;
     size_t items_size;
+    unsigned int *index;    // item position+1 per hash slot, 0 if empty
+    size_t index_size;      // power of 2, at least twice items_size
+    int nocase;             // match keys case-insensitively
+    LKArena *arena;         // items allocated from arena, NULL if lk_malloc()
 } LKStringTable;
 
 LKStringTable *lk_stringtable_new();
+LKStringTable *lk_stringtable_nocase_new();
+void lk_stringtable_set_arena(LKStringTable *st, LKArena *arena);
 void lk_stringtable_free(LKStringTable *sm);
 void lk_stringtable_set(LKStringTable *sm, char *ks, char *v);
 char *lk_stringtable_get(LKStringTable *sm, char *ks);
 void lk_stringtable_remove(LKStringTable *sm, char *ks);
+void lk_stringtable_clear(LKStringTable *sm);
 
 
 /*** LKStringList ***/
@@ -128,12 +187,52 @@ LKBuffer *lk_buffer_new(size_t bytes_size);
 void lk_buffer_free(LKBuffer *buf);
 void lk_buffer_resize(LKBuffer *buf, size_t bytes_size);
 void lk_buffer_clear(LKBuffer *buf);
+int lk_buffer_reserve(LKBuffer *buf, size_t len);
 int lk_buffer_append(LKBuffer *buf, char *bytes, size_t len);
 int lk_buffer_append_sz(LKBuffer *buf, char *s);
 void lk_buffer_append_sprintf(LKBuffer *buf, const char *fmt, ...);
 size_t lk_buffer_readline(LKBuffer *buf, char *dst, size_t dst_len);
 
 
+/*** Delimiter scanning ***/
+#define LK_SCAN_MAXDELIMS 4
+
+enum {LK_SCAN_AUTO, LK_SCAN_SCALAR, LK_SCAN_SSE2, LK_SCAN_AVX2};
+
+char *lk_scan(char *bytes, size_t len, char *delims);
+int lk_scan_select(int impl);
+char *lk_scan_impl_name();
+
+
+/*** Deflate and gzip compression ***/
+// Compression levels from 1 (fastest) to 9 (smallest), 0 for no compression.
+#define LK_DEFLATE_FAST 1
+#define LK_DEFLATE_BEST 9
+
+// Append deflate (RFC 1951) compressed bytes to out.
+void lk_deflate(char *bytes, size_t len, int level, LKBuffer *out);
+// Append gzip (RFC 1952) compressed bytes to out.
+void lk_gzip(char *bytes, size_t len, int level, LKBuffer *out);
+// Return crc updated with CRC-32 of bytes. Start with crc 0.
+unsigned int lk_crc32(unsigned int crc, char *bytes, size_t len);
+
+// Gzip compressor for data that arrives in pieces.
+typedef struct {
+    int level;
+    unsigned int crc;
+    unsigned int isize;         // input size mod 2^32
+    int started;                // gzip header written
+} LKGzipStream;
+
+LKGzipStream *lk_gzipstream_new(int level);
+void lk_gzipstream_free(LKGzipStream *gs);
+// Append compressed bytes to out, which can be decompressed as soon
+// as it's received.
+void lk_gzipstream_write(LKGzipStream *gs, char *bytes, size_t len, LKBuffer *out);
+// Append the end of the gzip stream to out.
+void lk_gzipstream_finish(LKGzipStream *gs, LKBuffer *out);
+
+
 /*** LKRefList ***/
 typedef struct {
     void **items;
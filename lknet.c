@@ -8,10 +8,15 @@
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <netinet/tcp.h>
 #include "lklib.h"
 #include "lknet.h"
 
-int lk_open_listen_socket(char *host, char *port, int backlog, struct sockaddr *psa) {
+// Set reuseport to allow several processes to bind their own listen socket
+// to the same host and port (SO_REUSEPORT). The kernel then distributes
+// incoming connections among them.
+int lk_open_listen_socket(char *host, char *port, int backlog, int reuseport, struct sockaddr *psa) {
     int z;
 
     struct addrinfo hints, *ai;
@@ -41,6 +46,13 @@ int lk_open_listen_socket(char *host, char *port, int backlog, struct sockaddr *
         lk_print_err("setsockopt()");
         goto error_return;
     }
+    if (reuseport) {
+        z = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
+        if (z == -1) {
+            lk_print_err("setsockopt(SO_REUSEPORT)");
+            goto error_return;
+        }
+    }
     z = bind(fd, ai->ai_addr, ai->ai_addrlen);
     if (z == -1) {
         lk_print_err("bind()");
@@ -142,6 +154,13 @@ void lk_set_sock_nonblocking(int sock) {
     fcntl(sock, F_SETFL, O_NONBLOCK);
 }
 
+// Send small writes right away instead of waiting for the previous
+// write to be acked (Nagle's algorithm).
+void lk_set_sock_nodelay(int sock) {
+    int yes = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+}
+
 // Return sin_addr or sin6_addr depending on address family.
 void *sockaddr_sin_addr(struct sockaddr *sa) {
     // addr->ai_addr is either struct sockaddr_in* or sockaddr_in6* depending on ai_family
@@ -165,16 +184,148 @@ unsigned short lk_get_sockaddr_port(struct sockaddr *sa) {
     }
 }
 
+void lk_http_date_string(time_t t, char *date_str, size_t date_str_len) {
+    struct tm tmtime;
+    if (gmtime_r(&t, &tmtime) == NULL ||
+        strftime(date_str, date_str_len, "%a, %d %b %Y %H:%M:%S GMT", &tmtime) == 0) {
+        snprintf(date_str, date_str_len, "???");
+    }
+}
+
+time_t lk_parse_http_date(char *s) {
+    struct tm tmtime;
+    memset(&tmtime, 0, sizeof(tmtime));
+    char *pz = strptime(s, "%a, %d %b %Y %H:%M:%S GMT", &tmtime);
+    if (pz == NULL || *pz != '\0') {
+        return -1;
+    }
+    return timegm(&tmtime);
+}
+
+int lk_parse_byte_ranges(char *s, off_t size, off_t *starts, off_t *ends, int max_ranges) {
+    if (strncmp(s, "bytes=", 6)) {
+        return -1;
+    }
+    char *p = s + 6;
+    int nranges = 0;
+    int nspecs = 0;
+    while (1) {
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        off_t start = -1;
+        off_t last = -1;
+        char *endp;
+        if (*p >= '0' && *p <= '9') {
+            start = strtoll(p, &endp, 10);
+            p = endp;
+        }
+        if (*p != '-') {
+            return -1;
+        }
+        p++;
+        if (*p >= '0' && *p <= '9') {
+            last = strtoll(p, &endp, 10);
+            p = endp;
+        }
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        if (*p != ',' && *p != '\0') {
+            return -1;
+        }
+
+        if (start == -1 && last == -1) {
+            return -1;
+        }
+        if (start != -1 && last != -1 && last < start) {
+            return -1;
+        }
+        nspecs++;
+        if (nspecs > max_ranges) {
+            return -1;
+        }
+
+        // "-500" is the last 500 bytes, "9500-" from byte 9500 to the end.
+        if (start == -1) {
+            start = last < size ? size - last : 0;
+            last = size - 1;
+        } else if (last == -1 || last >= size) {
+            last = size - 1;
+        }
+        if (start < size && start <= last) {
+            starts[nranges] = start;
+            ends[nranges] = last + 1;
+            nranges++;
+        }
+
+        if (*p == '\0') {
+            break;
+        }
+        p++;
+    }
+    return nranges;
+}
+
+int lk_accepts_encoding(char *accept_encoding, char *coding) {
+    size_t coding_len = strlen(coding);
+    int star = 0;
+    char *p = accept_encoding;
+    while (*p != '\0') {
+        while (*p == ' ' || *p == '\t' || *p == ',') {
+            p++;
+        }
+        char *end = p;
+        while (*end != '\0' && *end != ',' && *end != ';' && *end != ' ' && *end != '\t') {
+            end++;
+        }
+        size_t name_len = end - p;
+        char *name = p;
+
+        // Optional weight, where q=0 means not acceptable.
+        double q = 1.0;
+        p = end;
+        while (*p != '\0' && *p != ',') {
+            if (*p == ';') {
+                char *param = p+1;
+                while (*param == ' ' || *param == '\t') {
+                    param++;
+                }
+                if ((param[0] == 'q' || param[0] == 'Q') && param[1] == '=') {
+                    q = strtod(param+2, NULL);
+                }
+            }
+            p++;
+        }
+
+        if (name_len == coding_len && !strncasecmp(name, coding, coding_len)) {
+            return q > 0;
+        }
+        if (name_len == 1 && *name == '*') {
+            star = q > 0;
+        }
+    }
+    return star;
+}
+
 // Return human readable IP address from sockaddr
 LKString *lk_get_ipaddr_string(struct sockaddr *sa) {
+    LKString *lks = lk_string_new("");
+    lk_assign_ipaddr_string(lks, sa);
+    return lks;
+}
+
+// Assign ip address of sa to lks.
+void lk_assign_ipaddr_string(LKString *lks, struct sockaddr *sa) {
     char servipstr[INET6_ADDRSTRLEN];
     const char *pz = inet_ntop(sa->sa_family, sockaddr_sin_addr(sa),
                                servipstr, sizeof(servipstr));
     if (pz == NULL) {
         lk_print_err("inet_ntop()");
-        return lk_string_new("");
+        lk_string_assign(lks, "");
+        return;
     }
-    return lk_string_new(servipstr);
+    lk_string_assign(lks, servipstr);
 }
 
 int nonblocking_error(int z) {
@@ -348,22 +499,25 @@ int lk_write_file(int fd, LKBuffer *buf, size_t count, size_t *nbytes) {
 // Note: This keeps track of last buf position written.
 // Used to cumulatively write data into buf.
 int lk_write_all(int fd, FDType fd_type, LKBuffer *buf) {
+    return lk_write_all_bytes(fd, fd_type, buf->bytes, buf->bytes_len, &buf->bytes_cur);
+}
+
+int lk_write_all_bytes(int fd, FDType fd_type, char *bytes, size_t bytes_len, size_t *bytes_cur) {
     int z;
     while (1) {
-        int nwrite = buf->bytes_len - buf->bytes_cur;
-        if (nwrite <= 0) {
+        if (*bytes_cur >= bytes_len) {
             z = Z_EOF;
             break;
         }
         if (fd_type == FD_SOCK) {
             z = send(fd,
-                     buf->bytes + buf->bytes_cur, 
-                     buf->bytes_len - buf->bytes_cur,
+                     bytes + *bytes_cur,
+                     bytes_len - *bytes_cur,
                      MSG_DONTWAIT | MSG_NOSIGNAL);
         } else {
             z = write(fd,
-                      buf->bytes + buf->bytes_cur, 
-                      buf->bytes_len - buf->bytes_cur);
+                      bytes + *bytes_cur,
+                      bytes_len - *bytes_cur);
         }
         // interrupt occured during read, retry read.
         if (z == -1 && errno == EINTR) {
@@ -379,7 +533,7 @@ int lk_write_all(int fd, FDType fd_type, LKBuffer *buf) {
             break;
         }
         assert(z >= 0);
-        buf->bytes_cur += z;
+        *bytes_cur += z;
     }
     if (z > 0) {
         z = Z_OPEN;
@@ -395,20 +549,41 @@ int lk_write_all_file(int fd, LKBuffer *buf) {
 
 // Similar to lk_write_all(), but sending buflist buf's sequentially.
 int lk_buflist_write_all(int fd, FDType fd_type, LKRefList *buflist) {
-    if (buflist->items_cur >= buflist->items_len) {
-        return Z_EOF;
-    }
-
-    LKBuffer *buf = lk_reflist_get_cur(buflist);
-    assert(buf != NULL);
-    int z = lk_write_all(fd, fd_type, buf);
-    if (z == Z_EOF) {
+    int z = Z_EOF;
+    while (buflist->items_cur < buflist->items_len) {
+        LKBuffer *buf = lk_reflist_get_cur(buflist);
+        assert(buf != NULL);
+        z = lk_write_all(fd, fd_type, buf);
+        if (z != Z_EOF) {
+            break;
+        }
         buflist->items_cur++;
-        z = Z_OPEN;
     }
     return z;
 }
 
+int lk_sendfile_all(int fd, int infd, off_t *offset, off_t end) {
+    while (*offset < end) {
+        ssize_t z = sendfile(fd, infd, offset, end - *offset);
+        // interrupt occured during send, retry send.
+        if (z == -1 && errno == EINTR) {
+            continue;
+        }
+        if (z == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return Z_BLOCK;
+        }
+        if (z == -1) {
+            return Z_ERR;
+        }
+        // File was truncated after its size was taken.
+        if (z == 0) {
+            errno = EIO;
+            return Z_ERR;
+        }
+    }
+    return Z_EOF;
+}
+
 // Pipe all available nonblocking readfd bytes into writefd.
 // Uses buf as buffer for queued up bytes waiting to be written.
 // Returns one of the following:
@@ -447,7 +622,7 @@ int lk_pipe_all(int readfd, int writefd, FDType fd_type, LKBuffer *buf) {
 /** lksocketreader functions **/
 
 LKSocketReader *lk_socketreader_new(int sock, size_t buf_size) {
-    LKSocketReader *sr = lk_malloc(sizeof(LKSocketReader), "lk_socketreader_new");
+    LKSocketReader *sr = lk_obj_alloc(sizeof(LKSocketReader), "lk_socketreader_new");
     if (buf_size == 0) {
         buf_size = 1024;
     }
@@ -460,7 +635,39 @@ LKSocketReader *lk_socketreader_new(int sock, size_t buf_size) {
 void lk_socketreader_free(LKSocketReader *sr) {
     lk_buffer_free(sr->buf);
     sr->buf = NULL;
-    lk_free(sr);
+    lk_obj_free(sr, sizeof(LKSocketReader));
+}
+
+// Reuse sr to read from sock, discarding buffered bytes.
+// The buffer keeps its capacity.
+void lk_socketreader_reset(LKSocketReader *sr, int sock) {
+    sr->sock = sock;
+    lk_buffer_clear(sr->buf);
+    sr->sockclosed = 0;
+}
+
+// Read more socket bytes into empty sr buffer.
+// Returns Z_OPEN, Z_EOF, Z_ERR or Z_BLOCK.
+static int fill_buf(LKSocketReader *sr) {
+    LKBuffer *buf = sr->buf;
+    assert(buf->bytes_cur >= buf->bytes_len);
+
+    int z = recv(sr->sock, buf->bytes, buf->bytes_size, MSG_DONTWAIT | MSG_NOSIGNAL);
+    // socket closed, no more data
+    if (z == 0) {
+        sr->sockclosed = 1;
+        return Z_EOF;
+    }
+    if (z == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return Z_BLOCK;
+    }
+    // any other error
+    if (z == -1) {
+        return Z_ERR;
+    }
+    buf->bytes_len = z;
+    buf->bytes_cur = 0;
+    return Z_OPEN;
 }
 
 // Read one line from buffered socket including the \n char if present.
@@ -481,43 +688,27 @@ int lk_socketreader_readline(LKSocketReader *sr, LKString *line) {
     while (1) { // leave space for null terminator
         // If no buffer chars available, read from socket.
         if (buf->bytes_cur >= buf->bytes_len) {
-            memset(buf->bytes, '*', buf->bytes_size); // initialize for debugging purposes.
-            z = recv(sr->sock, buf->bytes, buf->bytes_size, MSG_DONTWAIT | MSG_NOSIGNAL);
-            // socket closed, no more data
-            if (z == 0) {
-                sr->sockclosed = 1;
-                z = Z_EOF;
+            z = fill_buf(sr);
+            if (z == Z_EOF) {
                 break;
             }
-            // any other error
-            if (z == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-                return Z_BLOCK;
-            }
-            if (z == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
-                return Z_ERR;
+            if (z != Z_OPEN) {
+                return z;
             }
-            assert(z > 0);
-            buf->bytes_len = z;
-            buf->bytes_cur = 0;
-            z = Z_OPEN;
         }
 
-        // Copy unread buffer bytes into dst until a '\n' char.
-        while (1) {
-            if (buf->bytes_cur >= buf->bytes_len) {
-                break;
-            }
-            char ch = buf->bytes[buf->bytes_cur];
-            lk_string_append_char(line, ch);
-            buf->bytes_cur++;
-
-            if (ch == '\n') {
-                goto readline_end;
-            }
+        // Copy unread buffer bytes into dst up to and including '\n'.
+        char *bytes = buf->bytes + buf->bytes_cur;
+        size_t navail = buf->bytes_len - buf->bytes_cur;
+        char *eol = lk_scan(bytes, navail, "\n");
+        size_t ncopy = eol != NULL ? eol - bytes + 1 : navail;
+        lk_string_append_bytes(line, bytes, ncopy);
+        buf->bytes_cur += ncopy;
+        if (eol != NULL) {
+            break;
         }
     }
 
-readline_end:
     assert(z <= Z_OPEN);
     return z;
 }
@@ -540,6 +731,100 @@ int lk_socketreader_recv(LKSocketReader *sr, LKBuffer *buf_dest) {
     return z;
 }
 
+// Read up to count bytes from buffered socket, appending them to buf_dest.
+// Bytes past count are left buffered for the next read.
+// Function return values:
+// Z_OPEN (fd still open)
+// Z_EOF (end of file)
+// Z_ERR (errno set with error detail)
+// Z_BLOCK (fd blocked, no data)
+int lk_socketreader_readbytes(LKSocketReader *sr, LKBuffer *buf_dest, size_t count) {
+    LKBuffer *buf = sr->buf;
+
+    while (count > 0) {
+        if (buf->bytes_cur >= buf->bytes_len) {
+            if (sr->sockclosed) {
+                return Z_EOF;
+            }
+            int z = fill_buf(sr);
+            if (z != Z_OPEN) {
+                return z;
+            }
+        }
+        size_t ncopy = buf->bytes_len - buf->bytes_cur;
+        if (ncopy > count) {
+            ncopy = count;
+        }
+        lk_buffer_append(buf_dest, buf->bytes + buf->bytes_cur, ncopy);
+        buf->bytes_cur += ncopy;
+        count -= ncopy;
+    }
+    return Z_OPEN;
+}
+
+// Read more socket bytes if all buffered bytes have been read.
+// Unread bytes are available in sr->buf from sr->buf->bytes_cur.
+// Function return values:
+// Z_OPEN (bytes available)
+// Z_EOF (end of file)
+// Z_ERR (errno set with error detail)
+// Z_BLOCK (fd blocked, no data)
+int lk_socketreader_fill(LKSocketReader *sr) {
+    if (lk_socketreader_buffered(sr) > 0) {
+        return Z_OPEN;
+    }
+    if (sr->sockclosed) {
+        return Z_EOF;
+    }
+    return fill_buf(sr);
+}
+
+// Read more socket bytes after the unread bytes in sr->buf, when they're
+// not enough to parse. The unread bytes are moved to the start of sr->buf,
+// which is grown if they fill it.
+// Function return values:
+// Z_OPEN (more bytes available)
+// Z_EOF (end of file)
+// Z_ERR (errno set with error detail)
+// Z_BLOCK (fd blocked, no data)
+int lk_socketreader_readmore(LKSocketReader *sr) {
+    LKBuffer *buf = sr->buf;
+    if (sr->sockclosed) {
+        return Z_EOF;
+    }
+    size_t nunread = buf->bytes_len - buf->bytes_cur;
+    if (nunread == 0) {
+        return fill_buf(sr);
+    }
+    if (buf->bytes_cur > 0) {
+        memmove(buf->bytes, buf->bytes + buf->bytes_cur, nunread);
+        buf->bytes_len = nunread;
+        buf->bytes_cur = 0;
+    }
+    if (buf->bytes_len == buf->bytes_size) {
+        lk_buffer_resize(buf, buf->bytes_size * 2);
+    }
+
+    int z = recv(sr->sock, buf->bytes + buf->bytes_len, buf->bytes_size - buf->bytes_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (z == 0) {
+        sr->sockclosed = 1;
+        return Z_EOF;
+    }
+    if (z == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return Z_BLOCK;
+    }
+    if (z == -1) {
+        return Z_ERR;
+    }
+    buf->bytes_len += z;
+    return Z_OPEN;
+}
+
+// Return number of bytes buffered and not yet read.
+size_t lk_socketreader_buffered(LKSocketReader *sr) {
+    return sr->buf->bytes_len - sr->buf->bytes_cur;
+}
+
 void debugprint_buf(char *buf, size_t buf_size) {
     printf("buf: ");
     for (int i=0; i < buf_size; i++) {
@@ -561,14 +846,14 @@ void lk_socketreader_debugprint(LKSocketReader *sr) {
 
 /*** LKHttpRequest functions ***/
 LKHttpRequest *lk_httprequest_new() {
-    LKHttpRequest *req = lk_malloc(sizeof(LKHttpRequest), "lk_httprequest_new");
+    LKHttpRequest *req = lk_obj_alloc(sizeof(LKHttpRequest), "lk_httprequest_new");
     req->method = lk_string_new("");
     req->uri = lk_string_new("");
     req->path = lk_string_new("");
     req->filename = lk_string_new("");
     req->querystring = lk_string_new("");
     req->version = lk_string_new("");
-    req->headers = lk_stringtable_new();
+    req->headers = lk_stringtable_nocase_new();
     req->head = lk_buffer_new(0);
     req->body = lk_buffer_new(0);
     return req;
@@ -594,7 +879,20 @@ void lk_httprequest_free(LKHttpRequest *req) {
     req->headers = NULL;
     req->head = NULL;
     req->body = NULL;
-    lk_free(req);
+    lk_obj_free(req, sizeof(LKHttpRequest));
+}
+
+// Clear request fields for reuse by the next request on the connection.
+void lk_httprequest_reset(LKHttpRequest *req) {
+    lk_string_assign(req->method, "");
+    lk_string_assign(req->uri, "");
+    lk_string_assign(req->path, "");
+    lk_string_assign(req->filename, "");
+    lk_string_assign(req->querystring, "");
+    lk_string_assign(req->version, "");
+    lk_stringtable_clear(req->headers);
+    lk_buffer_clear(req->head);
+    lk_buffer_clear(req->body);
 }
 
 void lk_httprequest_add_header(LKHttpRequest *req, char *k, char *v) {
@@ -617,6 +915,10 @@ void lk_httprequest_finalize(LKHttpRequest *req) {
         lk_buffer_append_sprintf(req->head, "Content-Length: %ld\n", req->body->bytes_len);
     }
     for (int i=0; i < req->headers->items_len; i++) {
+        // Replaced by the length of body above.
+        if (!strcasecmp(req->headers->items[i].k->s, "Content-Length")) {
+            continue;
+        }
         lk_buffer_append_sprintf(req->head, "%s: %s\n", req->headers->items[i].k->s, req->headers->items[i].v->s);
     }
     lk_buffer_append(req->head, "\r\n", 2);
@@ -653,13 +955,27 @@ void lk_httprequest_debugprint(LKHttpRequest *req) {
 
 /** httpresp functions **/
 LKHttpResponse *lk_httpresponse_new() {
-    LKHttpResponse *resp = lk_malloc(sizeof(LKHttpResponse), "lk_httpresponse_new");
+    LKHttpResponse *resp = lk_obj_alloc(sizeof(LKHttpResponse), "lk_httpresponse_new");
     resp->status = 0;
     resp->statustext = lk_string_new("");
     resp->version = lk_string_new("");
-    resp->headers = lk_stringtable_new();
+    resp->headers = lk_stringtable_nocase_new();
     resp->head = lk_buffer_new(0);
     resp->body = lk_buffer_new(0);
+    resp->compress = 0;
+    resp->chunked = 0;
+    resp->close_delimited = 0;
+    resp->bodyfd = -1;
+    resp->bodyfile = NULL;
+    resp->rawresp = NULL;
+    resp->rawresp_len = 0;
+    resp->rawresp_cur = 0;
+    resp->bodyfd_offset = 0;
+    resp->bodyfd_end = 0;
+    resp->ranges = NULL;
+    resp->ranges_len = 0;
+    resp->ranges_size = 0;
+    resp->ranges_cur = 0;
     return resp;
 }
 
@@ -669,19 +985,116 @@ void lk_httpresponse_free(LKHttpResponse *resp) {
     lk_stringtable_free(resp->headers);
     lk_buffer_free(resp->head);
     lk_buffer_free(resp->body);
+    lk_httpresponse_close_bodyfd(resp);
+    if (resp->ranges != NULL) {
+        lk_free(resp->ranges);
+    }
 
     resp->statustext = NULL;
     resp->version = NULL;
     resp->headers = NULL;
     resp->head = NULL;
     resp->body = NULL;
-    lk_free(resp);
+    lk_obj_free(resp, sizeof(LKHttpResponse));
+}
+
+// Clear response fields for reuse by the next response on the connection.
+void lk_httpresponse_reset(LKHttpResponse *resp) {
+    resp->status = 0;
+    lk_string_assign(resp->statustext, "");
+    lk_string_assign(resp->version, "");
+    lk_stringtable_clear(resp->headers);
+    lk_buffer_clear(resp->head);
+    lk_buffer_clear(resp->body);
+    resp->compress = 0;
+    resp->chunked = 0;
+    resp->close_delimited = 0;
+    lk_httpresponse_close_bodyfd(resp);
 }
 
 void lk_httpresponse_add_header(LKHttpResponse *resp, char *k, char *v) {
     lk_stringtable_set(resp->headers, k, v);
 }
 
+// Use open file fd bytes from offset up to end as the response body.
+// The body is sent straight from the file with sendfile() instead of
+// being copied into resp->body. resp takes ownership of fd.
+void lk_httpresponse_set_bodyfd(LKHttpResponse *resp, int fd, off_t offset, off_t end) {
+    lk_httpresponse_close_bodyfd(resp);
+    resp->bodyfd = fd;
+    resp->bodyfd_offset = offset;
+    resp->bodyfd_end = end;
+}
+
+// Use file cache item bytes from offset up to end as the response body.
+// resp holds on to item until the body is closed, which also keeps
+// any rawresp taken from item valid.
+void lk_httpresponse_set_bodyfile(LKHttpResponse *resp, LKFileCacheItem *item, off_t offset, off_t end) {
+    lk_httpresponse_close_bodyfd(resp);
+    resp->bodyfd = item->fd;
+    resp->bodyfile = item;
+    resp->bodyfd_offset = offset;
+    resp->bodyfd_end = end;
+}
+
+void lk_httpresponse_close_bodyfd(LKHttpResponse *resp) {
+    if (resp->bodyfile != NULL) {
+        lk_filecache_release(resp->bodyfile);
+    } else if (resp->bodyfd != -1) {
+        close(resp->bodyfd);
+    }
+    resp->bodyfd = -1;
+    resp->bodyfile = NULL;
+    resp->rawresp = NULL;
+    resp->rawresp_len = 0;
+    resp->rawresp_cur = 0;
+    resp->bodyfd_offset = 0;
+    resp->bodyfd_end = 0;
+    resp->ranges_len = 0;
+    resp->ranges_cur = 0;
+}
+
+// Add file range to be sent after the bytes currently in resp->body.
+// Used after lk_httpresponse_set_bodyfd() or lk_httpresponse_set_bodyfile()
+// with an empty offset..end range to send several file ranges.
+void lk_httpresponse_add_bodyfd_range(LKHttpResponse *resp, off_t offset, off_t end) {
+    if (resp->ranges_len == resp->ranges_size) {
+        resp->ranges_size = resp->ranges_size == 0 ? 4 : resp->ranges_size * 2;
+        resp->ranges = lk_realloc(resp->ranges, resp->ranges_size * sizeof(LKBodyRange), "lk_httpresponse_add_bodyfd_range");
+    }
+    LKBodyRange *r = &resp->ranges[resp->ranges_len];
+    r->body_pos = resp->body->bytes_len;
+    r->offset = offset;
+    r->end = end;
+    resp->ranges_len++;
+}
+
+// Write file body of resp to nonblocking socket fd: the ranges with
+// the body bytes before each of them, the bodyfd range, then the rest
+// of the body. Keeps track of progress in resp.
+// Returns Z_EOF when all is sent, Z_ERR or Z_BLOCK.
+int lk_httpresponse_write_bodyfd(int fd, LKHttpResponse *resp) {
+    int z;
+    LKBuffer *body = resp->body;
+    while (resp->ranges_cur < resp->ranges_len) {
+        LKBodyRange *r = &resp->ranges[resp->ranges_cur];
+        z = lk_write_all_bytes(fd, FD_SOCK, body->bytes, r->body_pos, &body->bytes_cur);
+        if (z != Z_EOF) {
+            return z;
+        }
+        z = lk_sendfile_all(fd, resp->bodyfd, &r->offset, r->end);
+        if (z != Z_EOF) {
+            return z;
+        }
+        resp->ranges_cur++;
+    }
+    z = lk_sendfile_all(fd, resp->bodyfd, &resp->bodyfd_offset, resp->bodyfd_end);
+    if (z != Z_EOF) {
+        return z;
+    }
+    return lk_write_all(fd, FD_SOCK, body);
+}
+
 // Finalize the http response by setting head buffer.
 // Writes the status line, headers and CRLF blank string to head buffer.
 void lk_httpresponse_finalize(LKHttpResponse *resp) {
@@ -697,7 +1110,19 @@ void lk_httpresponse_finalize(LKHttpResponse *resp) {
         lk_string_assign(resp->version, "HTTP/1.0");
     }
     lk_buffer_append_sprintf(resp->head, "%s %d %s\n", resp->version->s, resp->status, resp->statustext->s);
-    lk_buffer_append_sprintf(resp->head, "Content-Length: %ld\n", resp->body->bytes_len);
+    size_t content_length = resp->body->bytes_len;
+    if (resp->bodyfd != -1) {
+        content_length += resp->bodyfd_end - resp->bodyfd_offset;
+        for (int i=0; i < resp->ranges_len; i++) {
+            content_length += resp->ranges[i].end - resp->ranges[i].offset;
+        }
+    }
+    // 304 Not Modified has no body.
+    if (resp->chunked) {
+        lk_buffer_append(resp->head, "Transfer-Encoding: chunked\n", 27);
+    } else if (resp->status != 304 && !resp->close_delimited) {
+        lk_buffer_append_sprintf(resp->head, "Content-Length: %ld\n", content_length);
+    }
     for (int i=0; i < resp->headers->items_len; i++) {
         lk_buffer_append_sprintf(resp->head, "%s: %s\n", resp->headers->items[i].k->s, resp->headers->items[i].v->s);
     }
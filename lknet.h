@@ -7,6 +7,9 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <fcntl.h>
+#include <sys/epoll.h>
+#include <pthread.h>
+#include <time.h>
 #include "lklib.h"
 
 /*** LKHttpRequest - HTTP Request struct ***/
@@ -24,13 +27,95 @@ typedef struct {
 
 LKHttpRequest *lk_httprequest_new();
 void lk_httprequest_free(LKHttpRequest *req);
+void lk_httprequest_reset(LKHttpRequest *req);
 void lk_httprequest_add_header(LKHttpRequest *req, char *k, char *v);
 void lk_httprequest_append_body(LKHttpRequest *req, char *bytes, int bytes_len);
 void lk_httprequest_finalize(LKHttpRequest *req);
 void lk_httprequest_debugprint(LKHttpRequest *req);
 
 
+// Size of HTTP date strings, see lk_http_date_string().
+#define HTTP_DATE_SIZE 32
+
+/*** LKFileCache - Open static files indexed by path ***/
+// Preformatted responses are kept per variant: HTTP/1.0 or HTTP/1.1,
+// connection close or keep-alive, sent as is, as a precompressed sidecar
+// or gzipped.
+#define LKFILECACHE_HOT_VARIANTS 16
+
+typedef struct lkfilecacheitem_s {
+    LKString *path;             // "<homedir><path>" as requested
+    int fd;                     // open file, -1 if file not found
+    int open_errno;             // errno of failed open when fd is -1
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    char etag[64];              // ETag header value
+    char last_modified[HTTP_DATE_SIZE];  // Last-Modified header value
+    char *content_type;         // MIME type, filled in by server on first use
+    time_t validated;           // time file was last checked for changes
+    int refcount;               // number of responses using fd
+    int cached;                 // item is in the cache
+    pthread_mutex_t *fc_lock;   // lock of the cache the item came from
+    unsigned int hash;
+    struct lkfilecacheitem_s *hnext;    // next item in hash bucket
+    struct lkfilecacheitem_s *prev;     // LRU list, most recent first
+    struct lkfilecacheitem_s *next;
+
+    // Hot content: complete responses of small files held in memory.
+    LKBuffer *hot[LKFILECACHE_HOT_VARIANTS];        // head followed by body
+    size_t hot_head_len[LKFILECACHE_HOT_VARIANTS];
+    size_t hot_bytes;                   // total bytes of hot[] responses
+    void *hot_owner;                    // hostconfig the responses were made for
+    struct lkfilecacheitem_s *hot_prev; // LRU list of items with hot content
+    struct lkfilecacheitem_s *hot_next;
+} LKFileCacheItem;
+
+typedef struct {
+    pthread_mutex_t lock;       // shared by the event loop threads
+    LKFileCacheItem **buckets;
+    size_t buckets_size;
+    LKFileCacheItem *lru_head;
+    LKFileCacheItem *lru_tail;
+    size_t items_len;
+    size_t max_items;
+    int ttl;                    // seconds before cached file is checked again
+
+    LKFileCacheItem *hot_head;
+    LKFileCacheItem *hot_tail;
+    size_t hot_bytes;           // bytes held in hot responses
+    size_t hot_max_bytes;       // hot content budget, 0 to disable
+
+    // Statistics
+    size_t hits;
+    size_t misses;
+    size_t hot_hits;
+    size_t hot_misses;
+} LKFileCache;
+
+LKFileCache *lk_filecache_new(size_t max_items, int ttl, size_t hot_max_bytes);
+void lk_filecache_free(LKFileCache *fc);
+LKFileCacheItem *lk_filecache_open(LKFileCache *fc, char *home_dir, char *path, time_t now);
+void lk_filecache_release(LKFileCacheItem *item);
+ssize_t lk_filecache_read(LKFileCacheItem *item, LKBuffer *buf);
+int lk_filecache_can_hot(LKFileCache *fc, LKFileCacheItem *item, void *owner);
+LKBuffer *lk_filecache_get_hot(LKFileCache *fc, LKFileCacheItem *item, int variant, size_t *head_len);
+void lk_filecache_set_hot(LKFileCache *fc, LKFileCacheItem *item, int variant, LKBuffer *resp, size_t head_len, void *owner);
+void lk_filecache_lock(LKFileCache *fc);
+void lk_filecache_unlock(LKFileCache *fc);
+void lk_filecache_print_stats(LKFileCache *fc);
+
+
 /*** LKHttpResponse - HTTP Response struct ***/
+// File range sent after body bytes up to body_pos, used to interleave
+// multipart/byteranges part headers in body with file contents.
+typedef struct {
+    size_t body_pos;
+    off_t offset;            // next file byte to send
+    off_t end;               // end of file bytes to send
+} LKBodyRange;
+
 typedef struct {
     int status;             // 404
     LKString *statustext;    // File not found
@@ -38,11 +123,31 @@ typedef struct {
     LKStringTable *headers;
     LKBuffer *head;
     LKBuffer *body;
+    int compress;            // gzip body or bodyfile contents before sending
+    int chunked;             // body sent in chunks as it's produced
+    int close_delimited;     // body sent as it's produced until connection closes
+    int bodyfd;              // file body sent with sendfile(), -1 if none
+    LKFileCacheItem *bodyfile;  // cache item owning bodyfd, if any
+    LKBuffer *rawresp;          // preformatted response sent instead of head and body
+    size_t rawresp_len;         // rawresp bytes to send
+    size_t rawresp_cur;         // rawresp bytes sent so far
+    off_t bodyfd_offset;     // next bodyfd byte to send
+    off_t bodyfd_end;        // end of bodyfd bytes to send
+    LKBodyRange *ranges;     // bodyfd ranges sent before bodyfd_offset..bodyfd_end
+    int ranges_len;
+    int ranges_size;
+    int ranges_cur;
 } LKHttpResponse;
 
 LKHttpResponse *lk_httpresponse_new();
 void lk_httpresponse_free(LKHttpResponse *resp);
+void lk_httpresponse_reset(LKHttpResponse *resp);
 void lk_httpresponse_add_header(LKHttpResponse *resp, char *k, char *v);
+void lk_httpresponse_set_bodyfd(LKHttpResponse *resp, int fd, off_t offset, off_t end);
+void lk_httpresponse_set_bodyfile(LKHttpResponse *resp, LKFileCacheItem *item, off_t offset, off_t end);
+void lk_httpresponse_add_bodyfd_range(LKHttpResponse *resp, off_t offset, off_t end);
+void lk_httpresponse_close_bodyfd(LKHttpResponse *resp);
+int lk_httpresponse_write_bodyfd(int fd, LKHttpResponse *resp);
 void lk_httpresponse_finalize(LKHttpResponse *resp);
 void lk_httpresponse_debugprint(LKHttpResponse *resp);
 
@@ -56,28 +161,69 @@ typedef struct {
 
 LKSocketReader *lk_socketreader_new(int sock, size_t initial_size);
 void lk_socketreader_free(LKSocketReader *sr);
+void lk_socketreader_reset(LKSocketReader *sr, int sock);
 int lk_socketreader_readline(LKSocketReader *sr, LKString *line);
 int lk_socketreader_recv(LKSocketReader *sr, LKBuffer *buf);
+int lk_socketreader_readbytes(LKSocketReader *sr, LKBuffer *buf_dest, size_t count);
+int lk_socketreader_fill(LKSocketReader *sr);
+int lk_socketreader_readmore(LKSocketReader *sr);
+size_t lk_socketreader_buffered(LKSocketReader *sr);
 void lk_socketreader_debugprint(LKSocketReader *sr);
 
 
+/*** LKHttpRequestHead - Request head parsed in place ***/
+// Bytes offset..offset+len of the parsed buffer.
+typedef struct {
+    size_t offset;
+    size_t len;
+} LKSlice;
+
+typedef struct {
+    LKSlice name;
+    LKSlice value;
+} LKHeaderSlice;
+
+typedef struct {
+    LKSlice method;             // GET
+    LKSlice uri;                // /path/to/index.html?a=1
+    LKSlice version;            // HTTP/1.1
+    LKHeaderSlice *headers;     // header slices, reused for the next head
+    size_t headers_len;
+    size_t headers_size;
+} LKHttpRequestHead;
+
+LKHttpRequestHead *lk_httprequesthead_new();
+void lk_httprequesthead_free(LKHttpRequestHead *head);
+void lk_httprequesthead_parse(LKHttpRequestHead *head, char *bytes, size_t len);
+
+
 /*** LKHttpRequestParser ***/
 typedef struct {
     LKString *partial_line;
+    LKHttpRequestHead *head;        // slices of head being parsed from buffer
+    size_t head_scanned;            // head bytes already scanned for its end
     unsigned int nlinesread;
     int head_complete;              // flag indicating header lines complete
     int body_complete;              // flag indicating request body complete
     unsigned int content_length;    // value of Content-Length header
+    int chunked;                    // body in chunked transfer-encoding
+    int chunk_state;                // position within chunked body
+    size_t chunk_left;              // bytes left of current chunk data
+    size_t max_body_size;           // max body bytes accepted, 0 for no limit
+    int error_status;               // http status to reject request with, 0 if none
 } LKHttpRequestParser;
 
 LKHttpRequestParser *lk_httprequestparser_new();
 void lk_httprequestparser_free(LKHttpRequestParser *parser);
 void lk_httprequestparser_reset(LKHttpRequestParser *parser);
 void lk_httprequestparser_parse_line(LKHttpRequestParser *parser, LKString *line, LKHttpRequest *req);
+void lk_httprequestparser_parse_head(LKHttpRequestParser *parser, LKBuffer *buf, LKHttpRequest *req);
+void lk_httprequestparser_end_head(LKHttpRequestParser *parser, LKBuffer *buf, LKHttpRequest *req);
 void lk_httprequestparser_parse_bytes(LKHttpRequestParser *parser, LKBuffer *buf, LKHttpRequest *req);
 
 /*** CGI Parser ***/
 void parse_cgi_output(LKBuffer *buf, LKHttpResponse *resp);
+int parse_cgi_head(LKBuffer *buf, size_t max_len, LKHttpResponse *resp);
 
 
 /*** LKContext ***/
@@ -94,46 +240,69 @@ typedef struct lkcontext_s {
     int selectfd;
     int clientfd;
     LKContextType type;
-    struct lkcontext_s *next;         // link to next ctx
 
     // Used by CTX_READ_REQ:
     struct sockaddr_in client_sa;     // client address
     LKString *client_ipaddr;          // client ip address string
     unsigned short client_port;       // client port number
-    LKString *req_line;               // current request line
-    LKBuffer *req_buf;                // current request bytes buffer
     LKSocketReader *sr;               // input buffer for reading lines
     LKHttpRequestParser *reqparser;   // parser for httprequest
     LKHttpRequest *req;               // http request in process
+    LKArena *arena;                   // request and response headers, reset per request
+    unsigned int nrequests;           // requests completed on this connection
+    time_t last_active;               // time of last client activity
 
     // Used by CTX_WRITE_REQ:
     LKHttpResponse *resp;             // http response to be sent
     LKRefList *buflist;               // Buffer list of things to send/recv
+    int keepalive;                    // keep connection open after response
+    struct lkhostconfig_s *hc;        // hostconfig serving the request
 
     // Used by CTX_READ_CGI:
     int cgifd;
     LKBuffer *cgi_outputbuf;          // receive cgi stdout bytes here
     LKBuffer *cgi_inputbuf;           // input bytes to pass to cgi stdin
+    LKGzipStream *cgi_gzip;           // compressor of streamed cgi output
+    LKBuffer *cgi_gzipbuf;            // compressed cgi output to send
 
     // Used by CTX_PROXY_WRITE_REQ:
     int proxyfd;
     LKBuffer *proxy_respbuf;
+
+    struct lkcontext_s *pool_next;    // next ctx in the context table's pool
 } LKContext;
 
 LKContext *lk_context_new();
 LKContext *create_initial_context(int fd, struct sockaddr_in *sa);
+void reset_client_context(LKContext *ctx);
 void lk_context_free(LKContext *ctx);
 
-void add_new_client_context(LKContext **pphead, LKContext *ctx);
-void add_context(LKContext **pphead, LKContext *ctx);
-int remove_client_context(LKContext **pphead, int clientfd);
-void remove_client_contexts(LKContext **pphead, int clientfd);
-LKContext *match_select_ctx(LKContext *phead, int selectfd);
-int remove_selectfd_context(LKContext **pphead, int selectfd);
+
+/*** LKContextTable - Contexts indexed by fd ***/
+typedef struct {
+    LKContext **items;      // items[fd] is the ctx waiting on fd
+    size_t items_size;
+
+    // Removed client contexts kept for reuse by new connections.
+    LKContext *pool;
+    size_t pool_len;
+    size_t pool_max;        // max contexts kept in pool, 0 to disable
+} LKContextTable;
+
+LKContextTable *lk_contexttable_new();
+void lk_contexttable_free(LKContextTable *tbl);
+LKContext *get_initial_context(LKContextTable *tbl, int fd, struct sockaddr_in *sa);
+
+void add_new_client_context(LKContextTable *tbl, LKContext *ctx);
+void add_context(LKContextTable *tbl, LKContext *ctx);
+void set_select_ctx(LKContextTable *tbl, LKContext *ctx, int selectfd);
+int remove_client_context(LKContextTable *tbl, int clientfd);
+LKContext *match_select_ctx(LKContextTable *tbl, int selectfd);
+int remove_selectfd_context(LKContextTable *tbl, int selectfd);
 
 
 /*** LKConfig ***/
-typedef struct {
+typedef struct lkhostconfig_s {
     LKString *hostname;
     LKString *homedir;
     LKString *homedir_abspath;
@@ -141,11 +310,24 @@ typedef struct {
     LKString *cgidir_abspath;
     LKStringTable *aliases;
     LKString *proxyhost;
+    LKString *cachecontrol;     // Cache-Control header sent with static files
+    int expires;                // seconds until static files expire, -1 for none
 } LKHostConfig;
 
 typedef struct {
     LKString *serverhost;
     LKString *port;
+    int workers;                // number of worker processes
+    int threads;                // number of event loop threads per process
+    int keepalive_timeout;      // seconds to keep idle connection open, 0 to disable
+    int keepalive_max;          // max requests per connection, 0 for no limit
+    int filecache_size;         // max open files cached per event loop, 0 to disable
+    int filecache_ttl;          // seconds before cached file is checked for changes
+    int hotcache_size;          // KB of small file responses kept in memory per event loop
+    int compress;               // deflate level of gzip responses, 0 to disable
+    int compress_minsize;       // min bytes of response body to compress
+    int max_body_size;          // max KB of request body accepted, 0 for no limit
+    int ctxpool_size;           // max idle connection contexts kept per event loop
     LKHostConfig **hostconfigs;
     size_t hostconfigs_len;
     size_t hostconfigs_size;
@@ -164,12 +346,41 @@ LKHostConfig *lk_hostconfig_new(char *hostname);
 void lk_hostconfig_free(LKHostConfig *hc);
 
 
+/*** LKEventLoop - epoll based I/O readiness ***/
+#define LKEV_READ 0x1
+#define LKEV_WRITE 0x2
+
 typedef struct {
+    int epfd;
+    unsigned char *fdmasks;         // LKEV_READ/LKEV_WRITE interest indexed by fd
+    size_t fdmasks_size;
+    struct epoll_event *events;     // ready events from last wait
+    int events_len;
+    int events_size;
+} LKEventLoop;
+
+LKEventLoop *lk_eventloop_new();
+void lk_eventloop_free(LKEventLoop *evl);
+int lk_eventloop_set(LKEventLoop *evl, int fd, int mask);
+int lk_eventloop_clear(LKEventLoop *evl, int fd, int mask);
+int lk_eventloop_isset(LKEventLoop *evl, int fd, int mask);
+int lk_eventloop_wait(LKEventLoop *evl, int timeout_ms);
+int lk_eventloop_get_ready(LKEventLoop *evl, int i, int *fd);
+
+
+typedef struct lkhttpserver_s {
     LKConfig *cfg;
-    LKContext *ctxhead;
-    fd_set readfds;
-    fd_set writefds;
-    int maxfd;
+    LKContextTable *ctxtable;
+    LKEventLoop *evloop;
+    LKStringTable *cgienv;              // environment passed to cgi programs
+    LKFileCache *filecache;             // open static files
+
+    // Used in threaded mode:
+    struct lkhttpserver_s **loops;      // event loop threads fed by acceptor
+    int loops_len;
+    pthread_t thread;                   // thread running this event loop
+    int handoff_fds[2];                 // pipe of accepted clients to this loop
+    int nclients;                       // number of clients served by this loop
 } LKHttpServer;
 
 typedef enum {
@@ -188,14 +399,33 @@ int lk_httpserver_serve(LKHttpServer *server);
 
 
 /*** Helper functions ***/
-int lk_open_listen_socket(char *host, char *port, int backlog, struct sockaddr *psa);
+int lk_open_listen_socket(char *host, char *port, int backlog, int reuseport, struct sockaddr *psa);
 int lk_open_connect_socket(char *host, char *port, struct sockaddr *psa);
 void lk_set_sock_timeout(int sock, int nsecs, int ms);
 void lk_set_sock_nonblocking(int sock);
+void lk_set_sock_nodelay(int sock);
 LKString *lk_get_ipaddr_string(struct sockaddr *sa);
+void lk_assign_ipaddr_string(LKString *lks, struct sockaddr *sa);
 unsigned short lk_get_sockaddr_port(struct sockaddr *sa);
 int nonblocking_error(int z);
 
+// Return time in HTTP date format: Sun, 06 Nov 1994 08:49:37 GMT
+// Usage:
+// char datestr[HTTP_DATE_SIZE];
+// lk_http_date_string(t, datestr, sizeof(datestr))
+void lk_http_date_string(time_t t, char *date_str, size_t date_str_len);
+// Parse HTTP date string, returns -1 if not a valid date.
+time_t lk_parse_http_date(char *s);
+// Parse Range header value "bytes=0-499,1000-" for a file of size bytes
+// into at most max_ranges starts[] and ends[] (one past last byte).
+// Returns number of satisfiable ranges, 0 if none are satisfiable,
+// or -1 if the header is invalid or has too many ranges and should
+// be ignored.
+int lk_parse_byte_ranges(char *s, off_t size, off_t *starts, off_t *ends, int max_ranges);
+// Return whether content coding such as "gzip" is acceptable in
+// Accept-Encoding header value. Codings with q=0 are not acceptable.
+int lk_accepts_encoding(char *accept_encoding, char *coding);
+
 // Function return values:
 // Z_OPEN (fd still open)
 // Z_EOF (end of file)
@@ -253,10 +483,21 @@ int lk_write_file(int fd, LKBuffer *buf, size_t count, size_t *nbytes);
 int lk_write_all(int fd, FDType fd_type, LKBuffer *buf);
 int lk_write_all_sock(int fd, LKBuffer *buf);
 int lk_write_all_file(int fd, LKBuffer *buf);
+// Same as lk_write_all(), for bytes not held in an LKBuffer.
+// *bytes_cur keeps track of last position written.
+int lk_write_all_bytes(int fd, FDType fd_type, char *bytes, size_t bytes_len, size_t *bytes_cur);
 
 // Similar to lk_write_all(), but sending buflist buf's sequentially.
 int lk_buflist_write_all(int fd, FDType fd_type, LKRefList *buflist);
 
+// Send infd file bytes from *offset up to end to nonblocking socket fd
+// using sendfile(). *offset is advanced past the bytes sent.
+// Returns one of the following:
+//    0 (Z_EOF) for all file bytes sent
+//   -1 (Z_ERR) for error
+//   -2 (Z_BLOCK) for blocked socket
+int lk_sendfile_all(int fd, int infd, off_t *offset, off_t end);
+
 // Pipe all available nonblocking readfd bytes into writefd.
 // Uses buf as buffer for queued up bytes waiting to be written.
 // Returns one of the following:
@@ -11,7 +11,7 @@
 #define N_GROW_REFLIST 10
 
 LKRefList *lk_reflist_new() {
-    LKRefList *l = lk_malloc(sizeof(LKRefList), "lk_reflist_new");
+    LKRefList *l = lk_obj_alloc(sizeof(LKRefList), "lk_reflist_new");
     l->items_size = N_GROW_REFLIST;
     l->items_len = 0;
     l->items_cur = 0;
@@ -27,7 +27,7 @@ void lk_reflist_free(LKRefList *l) {
     memset(l->items, 0, l->items_size * sizeof(void*));
     lk_free(l->items);
     l->items = NULL;
-    lk_free(l);
+    lk_obj_free(l, sizeof(LKRefList));
 }
 
 void lk_reflist_append(LKRefList *l, void *p) {
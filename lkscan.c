@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "lklib.h"
+
+// Delimiter scanning for the http parsers.
+//
+// Finds the first of up to LK_SCAN_MAXDELIMS delimiter bytes, comparing
+// 32 (AVX2) or 16 (SSE2) bytes at a time on x86, or one byte at a time
+// elsewhere. The implementation is picked at runtime from what the cpu
+// supports, on the first scan.
+
+// Built optimized even in debug builds, unoptimized intrinsics are
+// slower than scanning one byte at a time.
+#pragma GCC optimize("O2")
+
+#if defined(__x86_64__) || defined(__i386__)
+#define LK_SCAN_X86
+#include <immintrin.h>
+#endif
+
+// delims is always LK_SCAN_MAXDELIMS chars, padded with repeats of the
+// first delimiter.
+typedef char *(*ScanFunc)(char *bytes, size_t len, char *delims);
+
+static char *scan_scalar(char *bytes, size_t len, char *delims);
+#ifdef LK_SCAN_X86
+static char *scan_sse2(char *bytes, size_t len, char *delims);
+static char *scan_avx2(char *bytes, size_t len, char *delims);
+#endif
+
+static ScanFunc scan_func = NULL;
+static int scan_impl = LK_SCAN_AUTO;
+
+// Return pointer to the first byte in bytes that is one of the chars
+// in delims, or NULL if none.
+// Ex. lk_scan("Host: localhost\r\n", 17, ":\n") ==> ": localhost\r\n"
+char *lk_scan(char *bytes, size_t len, char *delims) {
+    if (scan_func == NULL) {
+        lk_scan_select(LK_SCAN_AUTO);
+    }
+    assert(delims[0] != '\0');
+    char d[LK_SCAN_MAXDELIMS];
+    int ndelims = 0;
+    for (int i=0; i < LK_SCAN_MAXDELIMS; i++) {
+        if (delims[ndelims] != '\0') {
+            ndelims++;
+        }
+        d[i] = delims[ndelims-1];
+    }
+    assert(delims[ndelims] == '\0');
+    return scan_func(bytes, len, d);
+}
+
+// Select the scan implementation to use: LK_SCAN_SCALAR, LK_SCAN_SSE2,
+// LK_SCAN_AVX2, or LK_SCAN_AUTO for the fastest one the cpu supports.
+// Returns the selected implementation, or -1 if impl is not supported.
+int lk_scan_select(int impl) {
+    int avx2 = 0;
+    int sse2 = 0;
+#ifdef LK_SCAN_X86
+    __builtin_cpu_init();
+    avx2 = __builtin_cpu_supports("avx2");
+    sse2 = __builtin_cpu_supports("sse2");
+#endif
+    if (impl == LK_SCAN_AUTO) {
+        impl = avx2 ? LK_SCAN_AVX2 : sse2 ? LK_SCAN_SSE2 : LK_SCAN_SCALAR;
+    }
+    if ((impl == LK_SCAN_AVX2 && !avx2) || (impl == LK_SCAN_SSE2 && !sse2)) {
+        return -1;
+    }
+
+    switch (impl) {
+#ifdef LK_SCAN_X86
+    case LK_SCAN_AVX2:
+        scan_func = scan_avx2;
+        break;
+    case LK_SCAN_SSE2:
+        scan_func = scan_sse2;
+        break;
+#endif
+    case LK_SCAN_SCALAR:
+        scan_func = scan_scalar;
+        break;
+    default:
+        return -1;
+    }
+    scan_impl = impl;
+    return impl;
+}
+
+// Return name of the selected scan implementation.
+char *lk_scan_impl_name() {
+    if (scan_func == NULL) {
+        lk_scan_select(LK_SCAN_AUTO);
+    }
+    switch (scan_impl) {
+    case LK_SCAN_AVX2:
+        return "avx2";
+    case LK_SCAN_SSE2:
+        return "sse2";
+    default:
+        return "scalar";
+    }
+}
+
+static char *scan_scalar(char *bytes, size_t len, char *delims) {
+    for (size_t i=0; i < len; i++) {
+        char ch = bytes[i];
+        if (ch == delims[0] || ch == delims[1] || ch == delims[2] || ch == delims[3]) {
+            return bytes + i;
+        }
+    }
+    return NULL;
+}
+
+#ifdef LK_SCAN_X86
+// Return bitmask of the bytes in v matching any of the delimiters.
+#define MATCH_MASK(v, cmpeq, or, movemask, vd) \
+    movemask(or(or(cmpeq(v, vd[0]), cmpeq(v, vd[1])), or(cmpeq(v, vd[2]), cmpeq(v, vd[3]))))
+
+__attribute__((target("sse2")))
+static char *scan_sse2(char *bytes, size_t len, char *delims) {
+    if (len < 16) {
+        return scan_scalar(bytes, len, delims);
+    }
+    __m128i vd[LK_SCAN_MAXDELIMS];
+    for (int j=0; j < LK_SCAN_MAXDELIMS; j++) {
+        vd[j] = _mm_set1_epi8(delims[j]);
+    }
+
+    size_t i = 0;
+    for (; i+16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((__m128i *) (bytes + i));
+        unsigned int mask = MATCH_MASK(v, _mm_cmpeq_epi8, _mm_or_si128, _mm_movemask_epi8, vd);
+        if (mask != 0) {
+            return bytes + i + __builtin_ctz(mask);
+        }
+    }
+    // The last 16 bytes again, skipping the ones already scanned.
+    if (i < len) {
+        __m128i v = _mm_loadu_si128((__m128i *) (bytes + len - 16));
+        unsigned int mask = MATCH_MASK(v, _mm_cmpeq_epi8, _mm_or_si128, _mm_movemask_epi8, vd);
+        mask >>= 16 - (len - i);
+        if (mask != 0) {
+            return bytes + i + __builtin_ctz(mask);
+        }
+    }
+    return NULL;
+}
+
+__attribute__((target("avx2")))
+static char *scan_avx2(char *bytes, size_t len, char *delims) {
+    if (len < 32) {
+        return scan_sse2(bytes, len, delims);
+    }
+    __m256i vd[LK_SCAN_MAXDELIMS];
+    for (int j=0; j < LK_SCAN_MAXDELIMS; j++) {
+        vd[j] = _mm256_set1_epi8(delims[j]);
+    }
+
+    size_t i = 0;
+    for (; i+32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((__m256i *) (bytes + i));
+        unsigned int mask = MATCH_MASK(v, _mm256_cmpeq_epi8, _mm256_or_si256, _mm256_movemask_epi8, vd);
+        if (mask != 0) {
+            return bytes + i + __builtin_ctz(mask);
+        }
+    }
+    // The last 32 bytes again, skipping the ones already scanned.
+    if (i < len) {
+        __m256i v = _mm256_loadu_si256((__m256i *) (bytes + len - 32));
+        unsigned int mask = MATCH_MASK(v, _mm256_cmpeq_epi8, _mm256_or_si256, _mm256_movemask_epi8, vd);
+        mask >>= 32 - (len - i);
+        if (mask != 0) {
+            return bytes + i + __builtin_ctz(mask);
+        }
+    }
+    return NULL;
+}
+#endif
@@ -9,13 +9,49 @@
 #include <ctype.h>
 #include "lklib.h"
 
-// Zero out entire size
-void zero_s(LKString *lks) {
-    memset(lks->s, 0, lks->s_size+1);
+// vasprintf() output is allocated by libc, so free it with libc free().
+#undef free
+
+// Smallest capacity of a grown string.
+#define MIN_GROW_SIZE 31
+
+// Set lks capacity to new_size chars, moving the chars out of inline_s
+// into an allocated buffer.
+static void resize_s(LKString *lks, size_t new_size, char *label) {
+    if (lks->s == lks->inline_s) {
+        lks->s = lk_malloc(new_size+1, label);
+        memcpy(lks->s, lks->inline_s, lks->s_len+1);
+    } else {
+        lks->s = lk_realloc(lks->s, new_size+1, label);
+    }
+    lks->s_size = new_size;
 }
-// Zero out the free unused space
-void zero_unused_s(LKString *lks) {
-    memset(lks->s + lks->s_len, '\0', lks->s_size+1 - lks->s_len);
+
+// Grow lks capacity to at least s_len chars, at least doubling it so
+// repeated appends are copied a bounded number of times.
+static void grow_s(LKString *lks, size_t s_len) {
+    size_t new_size = lks->s_size * 2;
+    if (new_size < MIN_GROW_SIZE) {
+        new_size = MIN_GROW_SIZE;
+    }
+    if (new_size < s_len) {
+        new_size = s_len;
+    }
+    resize_s(lks, new_size, "lk_string_grow");
+}
+
+// Return new string with room for size chars, inline if it fits.
+static LKString *string_new(size_t size, char *label, char *s_label) {
+    LKString *lks = lk_obj_alloc(sizeof(LKString), label);
+    lks->s_len = 0;
+    if (size <= LK_STRING_INLINE_SIZE) {
+        lks->s = lks->inline_s;
+        lks->s_size = LK_STRING_INLINE_SIZE;
+    } else {
+        lks->s = lk_malloc(size+1, s_label);
+        lks->s_size = size;
+    }
+    return lks;
 }
 
 LKString *lk_string_new(char *s) {
@@ -24,45 +60,45 @@ LKString *lk_string_new(char *s) {
     }
     size_t s_len = strlen(s);
 
-    LKString *lks = lk_malloc(sizeof(LKString), "lk_string_new");
+    LKString *lks = string_new(s_len, "lk_string_new", "lk_string_new_s");
     lks->s_len = s_len;
-    lks->s_size = s_len;
-    lks->s = lk_malloc(lks->s_size+1, "lk_string_new_s");
-    zero_s(lks);
-    strncpy(lks->s, s, s_len);
+    memcpy(lks->s, s, s_len+1);
 
     return lks;
 }
 LKString *lk_string_size_new(size_t size) {
-    LKString *lks = lk_malloc(sizeof(LKString), "lk_string_size_new");
-
-    lks->s_len = 0;
-    lks->s_size = size;
-    lks->s = lk_malloc(lks->s_size+1, "lk_string_size_new_s");
-    zero_s(lks);
+    LKString *lks = string_new(size, "lk_string_size_new", "lk_string_size_new_s");
+    lks->s[0] = '\0';
 
     return lks;
 }
 void lk_string_free(LKString *lks) {
     assert(lks->s != NULL);
 
-    zero_s(lks);
-    lk_free(lks->s);
+    if (lks->s != lks->inline_s) {
+        lk_free(lks->s);
+    }
     lks->s = NULL;
-    lk_free(lks);
+    lk_obj_free(lks, sizeof(LKString));
 }
 void lk_string_voidp_free(void *plkstr) {
     lk_string_free((LKString *) plkstr);
 }
 
+// Make room for len more chars after the current ones without
+// reallocating.
+void lk_string_reserve(LKString *lks, size_t len) {
+    if (lks->s_len + len > lks->s_size) {
+        resize_s(lks, lks->s_len + len, "lk_string_reserve");
+    }
+}
+
 void lk_string_assign(LKString *lks, char *s) {
     size_t s_len = strlen(s);
     if (s_len > lks->s_size) {
-        lks->s_size = s_len;
-        lks->s = lk_realloc(lks->s, lks->s_size+1, "lk_string_assign");
+        grow_s(lks, s_len);
     }
-    zero_s(lks);
-    strncpy(lks->s, s, s_len);
+    memmove(lks->s, s, s_len+1);
     lks->s_len = s_len;
 }
 
@@ -115,7 +151,7 @@ void lk_string_append_sprintf(LKString *lks, char *fmt, ...) {
         va_end(args);
         if (z == -1) return;
 
-        lk_string_assign(lks, ps);
+        lk_string_append(lks, ps);
         free(ps);
         return;
     }
@@ -124,40 +160,36 @@ void lk_string_append_sprintf(LKString *lks, char *fmt, ...) {
 }
 
 void lk_string_append(LKString *lks, char *s) {
-    size_t s_len = strlen(s);
-    if (lks->s_len + s_len > lks->s_size) {
-        lks->s_size = lks->s_len + s_len;
-        lks->s = lk_realloc(lks->s, lks->s_size+1, "lk_string_append");
-        zero_unused_s(lks);
-    }
-
-    strncpy(lks->s + lks->s_len, s, s_len);
-    lks->s_len = lks->s_len + s_len;
+    lk_string_append_bytes(lks, s, strlen(s));
 }
 
 void lk_string_append_char(LKString *lks, char c) {
     if (lks->s_len + 1 > lks->s_size) {
-        // Grow string by ^2
-        lks->s_size = lks->s_len + ((lks->s_len+1) * 2);
-        lks->s = lk_realloc(lks->s, lks->s_size+1, "lk_string_append_char");
-        zero_unused_s(lks);
+        grow_s(lks, lks->s_len + 1);
     }
-
     lks->s[lks->s_len] = c;
     lks->s[lks->s_len+1] = '\0';
     lks->s_len++;
 }
 
+// Append len bytes, which don't need to be null terminated.
+void lk_string_append_bytes(LKString *lks, char *bytes, size_t len) {
+    if (lks->s_len + len > lks->s_size) {
+        grow_s(lks, lks->s_len + len);
+    }
+    memcpy(lks->s + lks->s_len, bytes, len);
+    lks->s_len += len;
+    lks->s[lks->s_len] = '\0';
+}
+
 void lk_string_prepend(LKString *lks, char *s) {
     size_t s_len = strlen(s);
     if (lks->s_len + s_len > lks->s_size) {
-        lks->s_size = lks->s_len + s_len;
-        lks->s = lk_realloc(lks->s, lks->s_size+1, "lk_string_prepend");
-        zero_unused_s(lks);
+        grow_s(lks, lks->s_len + s_len);
     }
 
-    memmove(lks->s + s_len, lks->s, lks->s_len); // shift string to right
-    strncpy(lks->s, s, s_len);                   // prepend s to string
+    memmove(lks->s + s_len, lks->s, lks->s_len+1); // shift string to right
+    memcpy(lks->s, s, s_len);                      // prepend s to string
     lks->s_len = lks->s_len + s_len;
 }
 
@@ -231,7 +263,7 @@ void lk_string_trim(LKString *lks) {
 
     size_t new_len = endi-starti+1;
     memmove(lks->s, lks->s + starti, new_len);
-    memset(lks->s + new_len, 0, lks->s_len - new_len);
+    lks->s[new_len] = '\0';
     lks->s_len = new_len;
 }
 
@@ -245,8 +277,8 @@ void lk_string_chop_start(LKString *lks, char *s) {
     }
 
     size_t new_len = lks->s_len - s_len;
-    memmove(lks->s, lks->s + s_len, lks->s_len - s_len);
-    memset(lks->s + new_len, 0, lks->s_len - new_len);
+    memmove(lks->s, lks->s + s_len, new_len);
+    lks->s[new_len] = '\0';
     lks->s_len = new_len;
 }
 
@@ -260,7 +292,7 @@ void lk_string_chop_end(LKString *lks, char *s) {
     }
 
     size_t new_len = lks->s_len - s_len;
-    memset(lks->s + new_len, 0, s_len);
+    lks->s[new_len] = '\0';
     lks->s_len = new_len;
 }
 
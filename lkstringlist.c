@@ -8,10 +8,13 @@
 #include <assert.h>
 #include "lklib.h"
 
+// vasprintf() output is allocated by libc, so free it with libc free().
+#undef free
+
 #define N_GROW_STRINGLIST 10
 
 LKStringList *lk_stringlist_new() {
-    LKStringList *sl = lk_malloc(sizeof(LKStringList), "lk_stringlist_new");
+    LKStringList *sl = lk_obj_alloc(sizeof(LKStringList), "lk_stringlist_new");
     sl->items_size = N_GROW_STRINGLIST;
     sl->items_len = 0;
 
@@ -30,7 +33,7 @@ void lk_stringlist_free(LKStringList *sl) {
 
     lk_free(sl->items);
     sl->items = NULL;
-    lk_free(sl);
+    lk_obj_free(sl, sizeof(LKStringList));
 }
 
 void lk_stringlist_append_lkstring(LKStringList *sl, LKString *lks) {
@@ -6,76 +6,201 @@
 #include <unistd.h>
 #include <errno.h>
 #include <assert.h>
+#include <ctype.h>
 #include "lklib.h"
 
+#define INITIAL_ITEMS_SIZE 8
+
+static unsigned int hash_key(LKStringTable *st, char *ks);
+static int key_equal(LKStringTable *st, LKString *k, char *ks);
+static size_t find_slot(LKStringTable *st, char *ks, unsigned int hash);
+static void rebuild_index(LKStringTable *st);
+static LKString *item_string_new(LKStringTable *st, char *s);
+static void free_items(LKStringTable *st);
+
 LKStringTable *lk_stringtable_new() {
-    LKStringTable *st = lk_malloc(sizeof(LKStringTable), "lk_stringtable_new");
-    st->items_size = 1; // start with room for n items
+    LKStringTable *st = lk_obj_alloc(sizeof(LKStringTable), "lk_stringtable_new");
+    st->items_size = INITIAL_ITEMS_SIZE; // start with room for n items
     st->items_len = 0;
+    st->nocase = 0;
+    st->arena = NULL;
 
     st->items = lk_malloc(st->items_size * sizeof(LKStringTableItem), "lk_stringtable_new_items");
     memset(st->items, 0, st->items_size * sizeof(LKStringTableItem));
+    st->index_size = st->items_size * 2;
+    st->index = lk_malloc(st->index_size * sizeof(unsigned int), "lk_stringtable_new_index");
+    memset(st->index, 0, st->index_size * sizeof(unsigned int));
     return st;
 }
 
-void lk_stringtable_free(LKStringTable *st) {
-    assert(st->items != NULL);
+// Table with case-insensitive keys, for http headers.
+// Ex. "Host", "host" and "HOST" are the same key.
+LKStringTable *lk_stringtable_nocase_new() {
+    LKStringTable *st = lk_stringtable_new();
+    st->nocase = 1;
+    return st;
+}
+
+// Allocate keys and values of items set from now on from arena. They're
+// freed by resetting the arena instead, which should be done only after
+// clearing the table. Set an empty table before using it.
+void lk_stringtable_set_arena(LKStringTable *st, LKArena *arena) {
+    assert(st->items_len == 0);
+    st->arena = arena;
+}
+
+// Return new item key or value string.
+// Arena strings are allocated in one piece and never grown. Short ones
+// are kept inline as in lk_string_new().
+static LKString *item_string_new(LKStringTable *st, char *s) {
+    if (st->arena == NULL) {
+        return lk_string_new(s);
+    }
+    size_t s_len = strlen(s);
+    LKString *lks;
+    if (s_len <= LK_STRING_INLINE_SIZE) {
+        lks = lk_arena_alloc(st->arena, sizeof(LKString));
+        lks->s = lks->inline_s;
+    } else {
+        lks = lk_arena_alloc(st->arena, sizeof(LKString) + s_len+1);
+        lks->s = (char *) (lks + 1);
+    }
+    memcpy(lks->s, s, s_len+1);
+    lks->s_len = s_len;
+    lks->s_size = s_len;
+    return lks;
+}
 
+// Free item strings not allocated from the arena.
+static void free_items(LKStringTable *st) {
+    if (st->arena != NULL) {
+        return;
+    }
     for (int i=0; i < st->items_len; i++) {
         lk_string_free(st->items[i].k);
         lk_string_free(st->items[i].v);
     }
+}
+
+void lk_stringtable_free(LKStringTable *st) {
+    assert(st->items != NULL);
+
+    free_items(st);
     memset(st->items, 0, st->items_size * sizeof(LKStringTableItem));
 
     lk_free(st->items);
     st->items = NULL;
-    lk_free(st);
+    lk_free(st->index);
+    st->index = NULL;
+    lk_obj_free(st, sizeof(LKStringTable));
+}
+
+// FNV-1a hash of key, ignoring case in nocase tables.
+static unsigned int hash_key(LKStringTable *st, char *ks) {
+    unsigned int hash = 2166136261u;
+    for (unsigned char *p = (unsigned char *) ks; *p != '\0'; p++) {
+        unsigned char ch = st->nocase ? tolower(*p) : *p;
+        hash = (hash ^ ch) * 16777619u;
+    }
+    return hash;
+}
+
+static int key_equal(LKStringTable *st, LKString *k, char *ks) {
+    if (st->nocase) {
+        return !strcasecmp(k->s, ks);
+    }
+    return lk_string_sz_equal(k, ks);
+}
+
+// Return index slot of key, or the empty slot where it would go.
+static size_t find_slot(LKStringTable *st, char *ks, unsigned int hash) {
+    size_t mask = st->index_size - 1;
+    size_t slot = hash & mask;
+    while (st->index[slot] != 0) {
+        if (key_equal(st, st->items[st->index[slot]-1].k, ks)) {
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+// Reindex all items, after items are removed or index_size changes.
+static void rebuild_index(LKStringTable *st) {
+    memset(st->index, 0, st->index_size * sizeof(unsigned int));
+    for (int i=0; i < st->items_len; i++) {
+        char *ks = st->items[i].k->s;
+        size_t slot = find_slot(st, ks, hash_key(st, ks));
+        st->index[slot] = i+1;
+    }
 }
 
 void lk_stringtable_set(LKStringTable *st, char *ks, char *v) {
     assert(st->items_size >= st->items_len);
 
     // If item already exists, overwrite it.
-    for (int i=0; i < st->items_len; i++) {
-        if (lk_string_sz_equal(st->items[i].k, ks)) {
-            lk_string_assign(st->items[i].v, v);
-            return;
+    unsigned int hash = hash_key(st, ks);
+    size_t slot = find_slot(st, ks, hash);
+    if (st->index[slot] != 0) {
+        LKStringTableItem *item = &st->items[st->index[slot]-1];
+        if (st->arena != NULL) {
+            item->v = item_string_new(st, v);
+        } else {
+            lk_string_assign(item->v, v);
         }
+        return;
     }
 
-    // If reached capacity, expand the array and add new item.
+    // If reached capacity, double the array and index and add new item.
     if (st->items_len == st->items_size) {
-        st->items_size += 10;
+        st->items_size *= 2;
         st->items = lk_realloc(st->items, st->items_size * sizeof(LKStringTableItem), "lk_stringtable_set");
         memset(st->items + st->items_len, 0,
                (st->items_size - st->items_len) * sizeof(LKStringTableItem));
+        st->index_size = st->items_size * 2;
+        st->index = lk_realloc(st->index, st->index_size * sizeof(unsigned int), "lk_stringtable_set_index");
+        rebuild_index(st);
+        slot = find_slot(st, ks, hash);
     }
 
-    st->items[st->items_len].k = lk_string_new(ks);
-    st->items[st->items_len].v = lk_string_new(v);
+    st->items[st->items_len].k = item_string_new(st, ks);
+    st->items[st->items_len].v = item_string_new(st, v);
     st->items_len++;
+    st->index[slot] = st->items_len;
 }
 
 char *lk_stringtable_get(LKStringTable *st, char *ks) {
-    for (int i=0; i < st->items_len; i++) {
-        if (lk_string_sz_equal(st->items[i].k, ks)) {
-            return st->items[i].v->s;
-        }
+    size_t slot = find_slot(st, ks, hash_key(st, ks));
+    if (st->index[slot] == 0) {
+        return NULL;
     }
-    return NULL;
+    return st->items[st->index[slot]-1].v->s;
+}
+
+// Remove all items, keeping the allocated capacity.
+void lk_stringtable_clear(LKStringTable *st) {
+    free_items(st);
+    memset(st->items, 0, st->items_len * sizeof(LKStringTableItem));
+    memset(st->index, 0, st->index_size * sizeof(unsigned int));
+    st->items_len = 0;
 }
 
 void lk_stringtable_remove(LKStringTable *st, char *ks) {
-    for (int i=0; i < st->items_len; i++) {
-        if (lk_string_sz_equal(st->items[i].k, ks)) {
-            lk_string_free(st->items[i].k);
-            lk_string_free(st->items[i].v);
-
-            int num_items_after = st->items_len-i-1;
-            memmove(st->items+i, st->items+i+1, num_items_after * sizeof(LKStringTableItem));
-            memset(st->items+st->items_len-1, 0, sizeof(LKStringTableItem));
-            st->items_len--;
-            return;
-        }
+    size_t slot = find_slot(st, ks, hash_key(st, ks));
+    if (st->index[slot] == 0) {
+        return;
     }
+    int i = st->index[slot]-1;
+    if (st->arena == NULL) {
+        lk_string_free(st->items[i].k);
+        lk_string_free(st->items[i].v);
+    }
+
+    int num_items_after = st->items_len-i-1;
+    memmove(st->items+i, st->items+i+1, num_items_after * sizeof(LKStringTableItem));
+    memset(st->items+st->items_len-1, 0, sizeof(LKStringTableItem));
+    st->items_len--;
+
+    // Items after it moved down a position.
+    rebuild_index(st);
 }
@@ -11,6 +11,7 @@ void *mimetypes_tbl[] = {
     "azw",  "application/vnd.amazon.ebook",
     "bin",  "application/octet-stream",
     "bmp",  "image/bmp",
+    "br",   "application/x-brotli",
     "bz",   "application/x-bzip",
     "bz2",  "application/x-bzip2",
     "cda",  "application/x-cdf",
@@ -80,5 +81,23 @@ void *mimetypes_tbl[] = {
 
 };
 
+// MIME media types of responses worth compressing
+char *compresstypes_tbl[] = {
+    "application/javascript",
+    "application/json",
+    "application/ld+json",
+    "application/xhtml+xml",
+    "application/xml",
+    "image/svg+xml",
+    "text/calendar",
+    "text/css",
+    "text/csv",
+    "text/html",
+    "text/javascript",
+    "text/plain",
+    "text/xml",
+    NULL
+};
+
 #endif
 
@@ -4,6 +4,14 @@
 #include <unistd.h>
 #include <errno.h>
 #include <assert.h>
+#include <limits.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include "lklib.h"
 #include "lknet.h"
 
@@ -13,6 +21,20 @@ void lkbuffer_test();
 void lkstringlist_test();
 void lkreflist_test();
 void lkconfig_test();
+void lkcontexttable_test();
+void lkpopen3_test();
+void lkhttprequestparser_test();
+void lkfilecache_test();
+void lkbyteranges_test();
+void lkacceptencoding_test();
+void lkdeflate_test();
+void lkchunked_test();
+void lkcgiparser_test();
+void lkscan_test();
+void lkarena_test();
+void lkalloc_test();
+void lkslab_test();
+void lkhttpserver_test();
 
 int main(int argc, char *argv[]) {
     lk_alloc_init();
@@ -23,6 +45,20 @@ int main(int argc, char *argv[]) {
     lkstringlist_test();
     lkreflist_test();
     lkconfig_test();
+    lkcontexttable_test();
+    lkpopen3_test();
+    lkhttprequestparser_test();
+    lkfilecache_test();
+    lkbyteranges_test();
+    lkacceptencoding_test();
+    lkdeflate_test();
+    lkchunked_test();
+    lkcgiparser_test();
+    lkscan_test();
+    lkarena_test();
+    lkalloc_test();
+    lkslab_test();
+    lkhttpserver_test();
 
     lk_print_allocitems();
 
@@ -41,7 +77,7 @@ void lkstring_test() {
 
     lks = lk_string_size_new(10);
     assert(lks->s_len == 0);
-    assert(lks->s_size == 10);
+    assert(lks->s_size >= 10);
     assert(strcmp(lks->s, "") == 0);
     lk_string_free(lks);
 
@@ -187,6 +223,36 @@ void lkstring_test() {
     assert(lks->s_len == 7);
     lk_string_free(lks);
 
+    // Appends grow capacity geometrically.
+    lks = lk_string_new("");
+    unsigned long nallocs = lk_alloc_count();
+    for (int i=0; i < 4096; i++) {
+        lk_string_append_char(lks, 'a' + i % 26);
+    }
+    assert(lks->s_len == 4096 && strlen(lks->s) == 4096);
+    assert(lks->s[4095] == 'a' + 4095 % 26);
+    assert(lk_alloc_count() - nallocs <= 10);
+
+    // Shorter assigns keep the capacity and stay null terminated.
+    size_t s_size = lks->s_size;
+    lk_string_assign(lks, "abc");
+    assert(lk_string_sz_equal(lks, "abc") && lks->s_size == s_size);
+    lk_string_append_sprintf(lks, "%s", sbuf);
+    assert(lks->s_len == 3 + sizeof(sbuf)-1);
+    assert(!strncmp(lks->s, "abcaaa", 6));
+    lk_string_free(lks);
+
+    lks = lk_string_new("abc");
+    lk_string_reserve(lks, 100);
+    assert(lks->s_size == 103);
+    nallocs = lk_alloc_count();
+    for (int i=0; i < 100; i++) {
+        lk_string_append_char(lks, 'd');
+    }
+    assert(lk_alloc_count() == nallocs);
+    assert(lks->s_len == 103 && lks->s[103] == '\0');
+    lk_string_free(lks);
+
     lks = lk_string_new("abc");
     lk_string_prepend(lks, "def ");
     assert(lk_string_sz_equal(lks, "def abc"));
@@ -206,6 +272,31 @@ void lkstring_test() {
     assert(lk_string_sz_equal(lks, "A Little Kitten Webserver written in C."));
     lk_string_free(lks);
 
+    // Short strings are kept inline, longer ones spill to the heap.
+    nallocs = lk_alloc_count();
+    lks = lk_string_new("HTTP/1.1");
+    assert(lks->s == lks->inline_s);
+    lk_string_append(lks, " 200 OK 23 char");
+    assert(lks->s_len == LK_STRING_INLINE_SIZE && lks->s == lks->inline_s);
+    assert(lk_alloc_count() - nallocs == 1);
+    lk_string_append_char(lks, '!');
+    assert(lks->s != lks->inline_s);
+    assert(lk_string_sz_equal(lks, "HTTP/1.1 200 OK 23 char!"));
+    lk_string_prepend(lks, "<");
+    assert(lk_string_sz_equal(lks, "<HTTP/1.1 200 OK 23 char!"));
+    lk_string_free(lks);
+
+    lks = lk_string_new("GET");
+    lk_string_reserve(lks, 100);
+    assert(lks->s != lks->inline_s && lks->s_size == 103);
+    assert(lk_string_sz_equal(lks, "GET"));
+    lk_string_free(lks);
+
+    lks = lk_string_size_new(LK_STRING_INLINE_SIZE+1);
+    assert(lks->s != lks->inline_s && lks->s_size == LK_STRING_INLINE_SIZE+1);
+    lk_string_assign(lks, "abc");
+    lk_string_free(lks);
+
     lks = lk_string_new("");
     LKStringList *parts = lk_string_split(lks, "a");
     assert(parts->items_len == 1);
@@ -316,6 +407,53 @@ void lkstringmap_test() {
     v = lk_stringtable_get(st, "");
     assert(!strcmp(v, "(blank)"));
 
+    lk_stringtable_clear(st);
+    assert(st->items_len == 0);
+    assert(lk_stringtable_get(st, "abc") == NULL);
+    lk_stringtable_set(st, "abc", "ABC");
+    assert(st->items_len == 1);
+    v = lk_stringtable_get(st, "abc");
+    assert(!strcmp(v, "ABC"));
+
+    // Grows past its initial size, keeping items in order.
+    char k[16], val[16];
+    for (int i=0; i < 200; i++) {
+        snprintf(k, sizeof(k), "key%d", i);
+        snprintf(val, sizeof(val), "val%d", i);
+        lk_stringtable_set(st, k, val);
+    }
+    assert(st->items_len == 201);
+    for (int i=0; i < 200; i++) {
+        snprintf(k, sizeof(k), "key%d", i);
+        snprintf(val, sizeof(val), "val%d", i);
+        assert(!strcmp(lk_stringtable_get(st, k), val));
+        assert(lk_string_sz_equal(st->items[i+1].k, k));
+    }
+    for (int i=0; i < 200; i += 2) {
+        snprintf(k, sizeof(k), "key%d", i);
+        lk_stringtable_remove(st, k);
+        assert(lk_stringtable_get(st, k) == NULL);
+    }
+    assert(st->items_len == 101);
+    assert(!strcmp(lk_stringtable_get(st, "key199"), "val199"));
+    assert(lk_string_sz_equal(st->items[1].k, "key1"));
+    lk_stringtable_free(st);
+
+    // Header names match case-insensitively.
+    st = lk_stringtable_nocase_new();
+    lk_stringtable_set(st, "Content-Type", "text/html");
+    lk_stringtable_set(st, "host", "littlekitten.xyz");
+    assert(!strcmp(lk_stringtable_get(st, "Host"), "littlekitten.xyz"));
+    assert(!strcmp(lk_stringtable_get(st, "CONTENT-TYPE"), "text/html"));
+    lk_stringtable_set(st, "content-type", "text/plain");
+    assert(st->items_len == 2);
+    assert(lk_string_sz_equal(st->items[0].k, "Content-Type"));
+    assert(!strcmp(lk_stringtable_get(st, "Content-Type"), "text/plain"));
+    lk_stringtable_remove(st, "CONTENT-type");
+    assert(st->items_len == 1);
+    assert(lk_stringtable_get(st, "Content-Type") == NULL);
+    assert(lk_stringtable_get(st, "Host-") == NULL);
+
     lk_stringtable_free(st);
     printf("Done.\n");
 }
@@ -389,6 +527,33 @@ void lkbuffer_test() {
     assert(buf->bytes[buf->bytes_len-3] == 'a');
     lk_buffer_free(buf);
 
+    // Appends grow capacity geometrically, clear keeps it.
+    buf = lk_buffer_new(0);
+    unsigned long nallocs = lk_alloc_count();
+    for (int i=0; i < 512; i++) {
+        lk_buffer_append(buf, sbuf, LK_BUFSIZE_LARGE);
+    }
+    assert(buf->bytes_len == 512 * LK_BUFSIZE_LARGE);
+    assert(lk_alloc_count() - nallocs <= 16);
+    size_t bytes_size = buf->bytes_size;
+    lk_buffer_clear(buf);
+    assert(buf->bytes_len == 0 && buf->bytes_cur == 0);
+    assert(buf->bytes_size == bytes_size);
+    lk_buffer_free(buf);
+
+    // Reserve makes room for exactly len more bytes.
+    buf = lk_buffer_new(0);
+    lk_buffer_append_sz(buf, "abc");
+    assert(lk_buffer_reserve(buf, 10000) == 0);
+    assert(buf->bytes_size == 10003);
+    nallocs = lk_alloc_count();
+    lk_buffer_append(buf, sbuf, 10000);
+    assert(lk_alloc_count() == nallocs);
+    assert(buf->bytes_len == 10003 && !strncmp(buf->bytes, "abcaaa", 6));
+    assert(lk_buffer_reserve(buf, 0) == 0);
+    assert(buf->bytes_size == 10003);
+    lk_buffer_free(buf);
+
     printf("Done.\n");
 }
 
@@ -491,3 +656,1125 @@ void lkconfig_test() {
     printf("Done.\n");
 }
 
+
+void lkcontexttable_test() {
+    printf("Running LKContextTable tests... ");
+
+    LKContextTable *tbl = lk_contexttable_new();
+
+    LKContext *ctx = lk_context_new();
+    ctx->selectfd = 5;
+    ctx->clientfd = 5;
+    add_new_client_context(tbl, ctx);
+    assert(match_select_ctx(tbl, 5) == ctx);
+    assert(match_select_ctx(tbl, 6) == NULL);
+
+    // Client ctx switches to wait on a fd beyond the initial table size.
+    set_select_ctx(tbl, ctx, 5000);
+    assert(match_select_ctx(tbl, 5000) == ctx);
+    assert(match_select_ctx(tbl, 5) == NULL);
+
+    // Second ctx sharing the same clientfd.
+    LKContext *ctx_in = lk_context_new();
+    ctx_in->selectfd = 7;
+    ctx_in->clientfd = 5;
+    add_context(tbl, ctx_in);
+    assert(match_select_ctx(tbl, 7) == ctx_in);
+
+    assert(remove_selectfd_context(tbl, 7) == 1);
+    assert(match_select_ctx(tbl, 7) == NULL);
+    assert(remove_selectfd_context(tbl, 7) == 0);
+
+    set_select_ctx(tbl, ctx, 5);
+    assert(match_select_ctx(tbl, 5000) == NULL);
+    assert(match_select_ctx(tbl, 5) == ctx);
+
+    assert(remove_client_context(tbl, 5) == 1);
+    assert(match_select_ctx(tbl, 5) == NULL);
+    assert(remove_client_context(tbl, 5) == 0);
+
+    // Contexts still in table are freed with it.
+    ctx = lk_context_new();
+    ctx->selectfd = 9;
+    ctx->clientfd = 9;
+    add_new_client_context(tbl, ctx);
+    lk_contexttable_free(tbl);
+
+    // Removed client contexts are reused from the pool, up to pool_max.
+    tbl = lk_contexttable_new();
+    tbl->pool_max = 1;
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(1234);
+    inet_pton(AF_INET, "127.0.0.1", &sa.sin_addr);
+
+    ctx = get_initial_context(tbl, 11, &sa);
+    add_new_client_context(tbl, ctx);
+    lk_stringtable_set(ctx->req->headers, "Host", "littlekitten.xyz");
+    lk_buffer_append(ctx->sr->buf, "GET / HTTP/1.1\r\n", 16);
+    ctx->nrequests = 3;
+    assert(remove_client_context(tbl, 11) == 1);
+    assert(tbl->pool_len == 1);
+
+    unsigned long nallocs = lk_alloc_count();
+    LKContext *ctx2 = get_initial_context(tbl, 12, &sa);
+    assert(lk_alloc_count() == nallocs);
+    assert(ctx2 == ctx);
+    assert(tbl->pool_len == 0);
+    assert(ctx2->clientfd == 12 && ctx2->selectfd == 12 && ctx2->sr->sock == 12);
+    assert(ctx2->type == CTX_READ_REQ);
+    assert(ctx2->nrequests == 0);
+    assert(ctx2->req->headers->items_len == 0);
+    assert(lk_socketreader_buffered(ctx2->sr) == 0);
+    assert(lk_string_sz_equal(ctx2->client_ipaddr, "127.0.0.1"));
+    assert(ctx2->client_port == 1234);
+    add_new_client_context(tbl, ctx2);
+
+    LKContext *ctx3 = get_initial_context(tbl, 13, &sa);
+    assert(ctx3 != ctx2);
+    add_new_client_context(tbl, ctx3);
+    assert(remove_client_context(tbl, 12) == 1);
+    assert(remove_client_context(tbl, 13) == 1);
+    assert(tbl->pool_len == 1 && tbl->pool == ctx2);
+    lk_contexttable_free(tbl);
+
+    printf("Done.\n");
+}
+
+void lkpopen3_test() {
+    printf("Running lk_popen3 tests... ");
+
+    // cmd sees only the environment passed in envp.
+    char *envp[] = {"LKTEST=kitten", NULL};
+    int fd_in, fd_out;
+    int z = lk_popen3("echo \"$LKTEST $HOME\"", envp, &fd_in, &fd_out, NULL);
+    assert(z == 0);
+    close(fd_in);
+
+    LKBuffer *buf = lk_buffer_new(0);
+    lk_readfd(fd_out, buf);
+    close(fd_out);
+    assert(buf->bytes_len == strlen("kitten \n"));
+    assert(!strncmp(buf->bytes, "kitten \n", buf->bytes_len));
+    lk_buffer_free(buf);
+
+    printf("Done.\n");
+}
+
+void lkhttprequestparser_test() {
+    printf("Running LKHttpRequestParser tests... ");
+
+    LKHttpRequestParser *parser = lk_httprequestparser_new();
+    LKHttpRequest *req = lk_httprequest_new();
+    LKString *line = lk_string_new("");
+
+    char *head_lines[] = {
+        "POST /guestbook HTTP/1.1\r\n",
+        "Host: littlekitten.xyz:8000\r\n",
+        "If-Modified-Since: Sun, 06 Nov 1994 08:49:37 GMT\r\n",
+        "Content-Length: 7\r\n",
+        "\r\n",
+    };
+    for (int i=0; i < sizeof(head_lines) / sizeof(char *); i++) {
+        lk_string_assign(line, head_lines[i]);
+        lk_httprequestparser_parse_line(parser, line, req);
+    }
+    assert(parser->head_complete);
+    assert(!parser->body_complete);
+    assert(parser->content_length == 7);
+    assert(lk_string_sz_equal(req->method, "POST"));
+    assert(lk_string_sz_equal(req->path, "/guestbook"));
+    assert(!strcmp(lk_stringtable_get(req->headers, "Host"), "littlekitten.xyz:8000"));
+    char *ims = lk_stringtable_get(req->headers, "If-Modified-Since");
+    assert(!strcmp(ims, "Sun, 06 Nov 1994 08:49:37 GMT"));
+    assert(lk_parse_http_date(ims) == 784111777);
+    assert(lk_parse_http_date("06 Nov 1994") == -1);
+
+    // Body followed by the start of a pipelined request.
+    LKBuffer *buf = lk_buffer_new(0);
+    lk_buffer_append_sz(buf, "a=1");
+    lk_httprequestparser_parse_bytes(parser, buf, req);
+    assert(!parser->body_complete);
+    assert(buf->bytes_cur == 3);
+
+    lk_buffer_append_sz(buf, "&b=2GET / HTTP/1.1\r\n");
+    lk_httprequestparser_parse_bytes(parser, buf, req);
+    assert(parser->body_complete);
+    assert(req->body->bytes_len == 7);
+    assert(!strncmp(req->body->bytes, "a=1&b=2", 7));
+    assert(!strncmp(buf->bytes + buf->bytes_cur, "GET /", 5));
+
+    // Parser and request are reused for the next request.
+    lk_httprequestparser_reset(parser);
+    lk_httprequest_reset(req);
+    lk_string_assign(line, "GET /latest HTTP/1.1\r\n");
+    lk_httprequestparser_parse_line(parser, line, req);
+    lk_string_assign(line, "\r\n");
+    lk_httprequestparser_parse_line(parser, line, req);
+    assert(parser->head_complete && parser->body_complete);
+    assert(lk_string_sz_equal(req->method, "GET"));
+    assert(lk_stringtable_get(req->headers, "Host") == NULL);
+    assert(req->body->bytes_len == 0);
+
+    // Chunked body, fed one byte at a time, followed by a pipelined request.
+    char *chunked_head[] = {
+        "POST /guestbook HTTP/1.1\r\n",
+        "Content-Length: 100\r\n",
+        "Transfer-Encoding: chunked\r\n",
+        "\r\n",
+    };
+    char *chunked_body = "3\r\na=1\r\n1C;name=val\r\n&b=abcdefghijklmnopqrstuvwxy\r\n"
+                         "0\r\nExpires: never\r\n\r\nGET /";
+    for (int n=1; n <= 2; n++) {
+        lk_httprequestparser_reset(parser);
+        lk_httprequest_reset(req);
+        for (int i=0; i < sizeof(chunked_head) / sizeof(char *); i++) {
+            lk_string_assign(line, chunked_head[i]);
+            lk_httprequestparser_parse_line(parser, line, req);
+        }
+        assert(parser->head_complete && parser->chunked);
+        assert(lk_stringtable_get(req->headers, "Transfer-Encoding") == NULL);
+
+        // All at once, or one byte at a time.
+        lk_buffer_clear(buf);
+        if (n == 1) {
+            lk_buffer_append_sz(buf, chunked_body);
+            lk_httprequestparser_parse_bytes(parser, buf, req);
+        } else {
+            for (char *p = chunked_body; !parser->body_complete; p++) {
+                lk_buffer_append(buf, p, 1);
+                lk_httprequestparser_parse_bytes(parser, buf, req);
+            }
+        }
+        assert(parser->body_complete && parser->error_status == 0);
+        assert(req->body->bytes_len == 3 + 28);
+        assert(!strncmp(req->body->bytes, "a=1&b=abcdefghijklmnopqrstuvwxy", 31));
+        if (n == 1) {
+            assert(!strncmp(buf->bytes + buf->bytes_cur, "GET /", 5));
+        }
+    }
+
+    // Rejected requests
+    char *bad_requests[][3] = {
+        {"Content-Length: 11\r\n", "", "413"},
+        {"Transfer-Encoding: chunked\r\n", "b\r\n", "413"},
+        {"Transfer-Encoding: chunked\r\n", "5\r\n12345\r\n6\r\n", "413"},
+        {"Transfer-Encoding: chunked\r\n", "xyz\r\n", "400"},
+        {"Transfer-Encoding: chunked\r\n", "2\r\nabc\r\n", "400"},
+        {"Transfer-Encoding: gzip, chunked\r\n", "", "501"},
+    };
+    for (int i=0; i < sizeof(bad_requests) / sizeof(bad_requests[0]); i++) {
+        lk_httprequestparser_reset(parser);
+        lk_httprequest_reset(req);
+        parser->max_body_size = 10;
+        lk_string_assign(line, "POST / HTTP/1.1\r\n");
+        lk_httprequestparser_parse_line(parser, line, req);
+        lk_string_assign(line, bad_requests[i][0]);
+        lk_httprequestparser_parse_line(parser, line, req);
+        lk_string_assign(line, "\r\n");
+        lk_httprequestparser_parse_line(parser, line, req);
+        lk_buffer_clear(buf);
+        lk_buffer_append_sz(buf, bad_requests[i][1]);
+        lk_httprequestparser_parse_bytes(parser, buf, req);
+        assert(parser->body_complete);
+        assert(parser->error_status == atoi(bad_requests[i][2]));
+    }
+
+    // Head parsed in place into slices.
+    char head_bytes[] = "GET\t/a/b.html?x=1  HTTP/1.1\r\n"
+                        "Host: localhost:8000\r\n"
+                        ": skipped\r\n"
+                        "Accept:  text/html \r\n"
+                        "X-Empty:\r\n"
+                        "\r\n";
+    LKHttpRequestHead *head = lk_httprequesthead_new();
+    lk_httprequesthead_parse(head, head_bytes, strlen(head_bytes));
+    assert(!strncmp(head_bytes + head->method.offset, "GET", head->method.len) && head->method.len == 3);
+    assert(!strncmp(head_bytes + head->uri.offset, "/a/b.html?x=1", head->uri.len) && head->uri.len == 13);
+    assert(!strncmp(head_bytes + head->version.offset, "HTTP/1.1", head->version.len) && head->version.len == 8);
+    assert(head->headers_len == 3);
+    assert(!strncmp(head_bytes + head->headers[0].name.offset, "Host", 4) && head->headers[0].name.len == 4);
+    assert(!strncmp(head_bytes + head->headers[0].value.offset, "localhost:8000", 14) && head->headers[0].value.len == 14);
+    assert(!strncmp(head_bytes + head->headers[1].value.offset, "text/html", 9) && head->headers[1].value.len == 9);
+    assert(head->headers[2].name.len == 7 && head->headers[2].value.len == 0);
+    lk_httprequesthead_free(head);
+
+    // Head and body fed one byte at a time, after empty lines and
+    // followed by a pipelined request.
+    char *pipelined = "\r\nPOST /guestbook?id=5 HTTP/1.1\r\n"
+                      "Host: littlekitten.xyz\n"
+                      "Content-Length: 3\r\n"
+                      "\r\n"
+                      "a=1GET / HTTP/1.1\r\n\r\n";
+    for (int n=1; n <= 2; n++) {
+        lk_httprequestparser_reset(parser);
+        lk_httprequest_reset(req);
+        lk_buffer_clear(buf);
+        if (n == 1) {
+            lk_buffer_append_sz(buf, pipelined);
+            lk_httprequestparser_parse_head(parser, buf, req);
+            lk_httprequestparser_parse_bytes(parser, buf, req);
+        } else {
+            for (char *p = pipelined; !parser->body_complete; p++) {
+                lk_buffer_append(buf, p, 1);
+                lk_httprequestparser_parse_head(parser, buf, req);
+                lk_httprequestparser_parse_bytes(parser, buf, req);
+            }
+        }
+        assert(parser->head_complete && parser->body_complete);
+        assert(lk_string_sz_equal(req->method, "POST"));
+        assert(lk_string_sz_equal(req->path, "/guestbook"));
+        assert(lk_string_sz_equal(req->querystring, "id=5"));
+        assert(lk_string_sz_equal(req->filename, "guestbook"));
+        assert(lk_string_sz_equal(req->uri, "/guestbook?id=5"));
+        assert(lk_string_sz_equal(req->version, "HTTP/1.1"));
+        assert(!strcmp(lk_stringtable_get(req->headers, "Host"), "littlekitten.xyz"));
+        assert(req->body->bytes_len == 3 && !strncmp(req->body->bytes, "a=1", 3));
+        if (n == 1) {
+            assert(!strncmp(buf->bytes + buf->bytes_cur, "GET / ", 6));
+        }
+    }
+
+    // Head cut short when the client closes the connection.
+    lk_httprequestparser_reset(parser);
+    lk_httprequest_reset(req);
+    lk_buffer_clear(buf);
+    lk_buffer_append_sz(buf, "GET /latest HTTP/1.0\r\nUser-Agent: lktest");
+    lk_httprequestparser_parse_head(parser, buf, req);
+    assert(!parser->head_complete);
+    lk_httprequestparser_end_head(parser, buf, req);
+    assert(parser->head_complete && parser->body_complete);
+    assert(lk_string_sz_equal(req->uri, "/latest"));
+    assert(!strcmp(lk_stringtable_get(req->headers, "User-Agent"), "lktest"));
+
+    // Head that never ends.
+    lk_httprequestparser_reset(parser);
+    lk_httprequest_reset(req);
+    lk_buffer_clear(buf);
+    lk_buffer_append_sz(buf, "GET / HTTP/1.1\r\n");
+    while (!parser->head_complete) {
+        lk_buffer_append_sz(buf, "X-Filler: 0123456789012345678901234567890123456789\r\n");
+        lk_httprequestparser_parse_head(parser, buf, req);
+    }
+    assert(parser->body_complete && parser->error_status == 431);
+
+    lk_buffer_free(buf);
+    lk_string_free(line);
+    lk_httprequest_free(req);
+    lk_httprequestparser_free(parser);
+
+    printf("Done.\n");
+}
+
+static void write_test_file(char *dir, char *name, char *contents) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s%s", dir, name);
+    FILE *f = fopen(path, "w");
+    assert(f != NULL);
+    fputs(contents, f);
+    fclose(f);
+}
+
+void lkfilecache_test() {
+    printf("Running LKFileCache tests... ");
+
+    char dir[] = "/tmp/lktestXXXXXX";
+    assert(mkdtemp(dir) != NULL);
+    write_test_file(dir, "/a.html", "abc");
+    write_test_file(dir, "/b.css", "12345");
+
+    LKFileCache *fc = lk_filecache_new(2, 60, 0);
+    LKFileCacheItem *a = lk_filecache_open(fc, dir, "/a.html", 100);
+    assert(a != NULL);
+    assert(a->fd != -1);
+    assert(a->size == 3);
+    assert(a->refcount == 1);
+    char date[HTTP_DATE_SIZE];
+    lk_http_date_string(a->mtime, date, sizeof(date));
+    assert(!strcmp(a->last_modified, date));
+    assert(lk_parse_http_date(date) == a->mtime);
+    assert(a->etag[0] == '"');
+
+    // Cache hit returns the same open file.
+    LKFileCacheItem *a2 = lk_filecache_open(fc, dir, "/a.html", 101);
+    assert(a2 == a);
+    assert(a->refcount == 2);
+    lk_filecache_release(a2);
+    lk_filecache_release(a);
+    assert(fc->items_len == 1);
+
+    // Missing files and paths outside dir are cached as misses.
+    assert(lk_filecache_open(fc, dir, "/missing.html", 100) == NULL);
+    assert(lk_filecache_open(fc, dir, "/../../etc/passwd", 100) == NULL);
+    assert(lk_filecache_open(fc, dir, "", 100) == NULL);
+    assert(fc->items_len == 2);
+
+    // Least recently used file is evicted, in use file stays open.
+    LKFileCacheItem *b = lk_filecache_open(fc, dir, "/b.css", 100);
+    assert(b != NULL);
+    assert(b->size == 5);
+    assert(fc->items_len == 2);
+    a = lk_filecache_open(fc, dir, "/a.html", 100);
+    assert(a != NULL && a->size == 3);
+    assert(fc->lru_head == a && fc->lru_tail == b);
+
+    // Changed file is reopened once ttl expires.
+    write_test_file(dir, "/b.css", "1234567");
+    LKFileCacheItem *b2 = lk_filecache_open(fc, dir, "/b.css", 120);
+    assert(b2 == b);
+    assert(b2->size == 5);
+    lk_filecache_release(b2);
+    b2 = lk_filecache_open(fc, dir, "/b.css", 200);
+    assert(b2 != b);
+    assert(b2->size == 7);
+    assert(b->refcount == 1 && !b->cached);
+    lk_filecache_release(b);
+    lk_filecache_release(b2);
+    lk_filecache_release(a);
+    lk_filecache_free(fc);
+
+    // Cache size 0 opens file on every lookup.
+    fc = lk_filecache_new(0, 60, 0);
+    a = lk_filecache_open(fc, dir, "/a.html", 100);
+    a2 = lk_filecache_open(fc, dir, "/a.html", 100);
+    assert(a != NULL && a2 != NULL && a != a2);
+    assert(fc->items_len == 0);
+    lk_filecache_release(a);
+    lk_filecache_release(a2);
+    lk_filecache_free(fc);
+
+    // Hot content is bounded by its byte budget.
+    fc = lk_filecache_new(4, 60, 20);
+    a = lk_filecache_open(fc, dir, "/a.html", 100);
+    assert(lk_filecache_can_hot(fc, a, fc));
+    size_t head_len;
+    assert(lk_filecache_get_hot(fc, a, 1, &head_len) == NULL);
+    LKBuffer *hot = lk_buffer_new(0);
+    lk_buffer_append_sz(hot, "HEAD\n");
+    assert(lk_filecache_read(a, hot) == 3);
+    assert(!strncmp(hot->bytes, "HEAD\nabc", 8));
+    lk_filecache_set_hot(fc, a, 1, hot, 5, fc);
+    assert(lk_filecache_get_hot(fc, a, 1, &head_len) == hot);
+    assert(head_len == 5);
+    assert(fc->hot_bytes == 8);
+    assert(fc->hot_hits == 1 && fc->hot_misses == 1);
+    lk_filecache_release(a);
+
+    b = lk_filecache_open(fc, dir, "/b.css", 100);
+    hot = lk_buffer_new(0);
+    lk_buffer_append_sz(hot, "HEAD-HEAD\n");
+    lk_filecache_read(b, hot);
+    assert(!lk_filecache_can_hot(fc, a, dir));
+    lk_filecache_set_hot(fc, b, 0, hot, 10, fc);
+    // Over budget, a's hot content is dropped, the open file stays.
+    assert(fc->hot_bytes == 17);
+    assert(a->hot[1] == NULL && a->cached);
+    assert(fc->hot_head == b && fc->hot_tail == b);
+    lk_filecache_release(b);
+    lk_filecache_free(fc);
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/a.html", dir);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/b.css", dir);
+    unlink(path);
+    rmdir(dir);
+
+    printf("Done.\n");
+}
+
+void lkbyteranges_test() {
+    printf("Running lk_parse_byte_ranges tests... ");
+    off_t starts[4], ends[4];
+
+    assert(lk_parse_byte_ranges("bytes=0-499", 10000, starts, ends, 4) == 1);
+    assert(starts[0] == 0 && ends[0] == 500);
+    assert(lk_parse_byte_ranges("bytes=9500-", 10000, starts, ends, 4) == 1);
+    assert(starts[0] == 9500 && ends[0] == 10000);
+    assert(lk_parse_byte_ranges("bytes=-500", 10000, starts, ends, 4) == 1);
+    assert(starts[0] == 9500 && ends[0] == 10000);
+    assert(lk_parse_byte_ranges("bytes=-20000", 10000, starts, ends, 4) == 1);
+    assert(starts[0] == 0 && ends[0] == 10000);
+    assert(lk_parse_byte_ranges("bytes=9000-20000", 10000, starts, ends, 4) == 1);
+    assert(starts[0] == 9000 && ends[0] == 10000);
+
+    // Multiple ranges, unsatisfiable ones are skipped.
+    assert(lk_parse_byte_ranges("bytes=0-0, 20000-, 5-9,-1", 10000, starts, ends, 4) == 3);
+    assert(starts[0] == 0 && ends[0] == 1);
+    assert(starts[1] == 5 && ends[1] == 10);
+    assert(starts[2] == 9999 && ends[2] == 10000);
+    assert(lk_parse_byte_ranges("bytes=10000-", 10000, starts, ends, 4) == 0);
+    assert(lk_parse_byte_ranges("bytes=-0", 10000, starts, ends, 4) == 0);
+
+    // Invalid or too many ranges are ignored.
+    assert(lk_parse_byte_ranges("items=0-1", 10000, starts, ends, 4) == -1);
+    assert(lk_parse_byte_ranges("bytes=5-1", 10000, starts, ends, 4) == -1);
+    assert(lk_parse_byte_ranges("bytes=-", 10000, starts, ends, 4) == -1);
+    assert(lk_parse_byte_ranges("bytes=1-2x", 10000, starts, ends, 4) == -1);
+    assert(lk_parse_byte_ranges("bytes=1-2,3-4,5-6,7-8,9-10", 10000, starts, ends, 4) == -1);
+
+    printf("Done.\n");
+}
+
+void lkacceptencoding_test() {
+    printf("Running lk_accepts_encoding tests... ");
+
+    assert(lk_accepts_encoding("gzip, deflate, br", "gzip"));
+    assert(lk_accepts_encoding("gzip, deflate, br", "br"));
+    assert(!lk_accepts_encoding("gzip, deflate", "br"));
+    assert(!lk_accepts_encoding("", "gzip"));
+    assert(lk_accepts_encoding("GZIP", "gzip"));
+    assert(!lk_accepts_encoding("gzipx", "gzip"));
+
+    // Weights
+    assert(lk_accepts_encoding("br;q=0.5, gzip;q=1.0", "br"));
+    assert(!lk_accepts_encoding("br;q=0, gzip", "br"));
+    assert(!lk_accepts_encoding("br ; q=0.000", "br"));
+    assert(lk_accepts_encoding("gzip, br;q=0", "gzip"));
+
+    // Wildcard applies to codings not listed.
+    assert(lk_accepts_encoding("*", "br"));
+    assert(!lk_accepts_encoding("*;q=0", "br"));
+    assert(!lk_accepts_encoding("*, br;q=0", "br"));
+    assert(lk_accepts_encoding("*, br;q=0", "gzip"));
+
+    printf("Done.\n");
+}
+
+// Decompress gz with the gzip command into out.
+static void gunzip(LKBuffer *gz, LKBuffer *out) {
+    int fd_in, fd_out;
+    int z = lk_popen3("gzip -dc", NULL, &fd_in, &fd_out, NULL);
+    assert(z == 0);
+    // Test inputs are small enough to fit in the pipe buffer.
+    assert(write(fd_in, gz->bytes, gz->bytes_len) == gz->bytes_len);
+    close(fd_in);
+    lk_readfd(fd_out, out);
+    close(fd_out);
+}
+
+void lkdeflate_test() {
+    printf("Running lk_gzip tests... ");
+
+    assert(lk_crc32(0, "", 0) == 0);
+    assert(lk_crc32(0, "123456789", 9) == 0xcbf43926);
+    assert(lk_crc32(lk_crc32(0, "1234", 4), "56789", 5) == 0xcbf43926);
+
+    // Repetitive text, pseudo random bytes and short inputs.
+    LKBuffer *text = lk_buffer_new(0);
+    for (int i=0; i < 2000; i++) {
+        lk_buffer_append_sprintf(text, "<li>item %d of the little kitten list</li>\n", i % 300);
+    }
+    LKBuffer *noise = lk_buffer_new(20000);
+    unsigned int r = 1;
+    for (int i=0; i < 20000; i++) {
+        r = r * 1103515245 + 12345;
+        char c = r >> 16;
+        lk_buffer_append(noise, &c, 1);
+    }
+    LKBuffer *inputs[] = {text, noise, lk_buffer_new(0), lk_buffer_new(0)};
+    lk_buffer_append_sz(inputs[3], "a");
+
+    LKBuffer *gz = lk_buffer_new(0);
+    LKBuffer *out = lk_buffer_new(0);
+    int levels[] = {0, LK_DEFLATE_FAST, 6, LK_DEFLATE_BEST};
+    for (int i=0; i < 4; i++) {
+        for (int j=0; j < 4; j++) {
+            LKBuffer *in = inputs[i];
+            lk_buffer_clear(gz);
+            lk_buffer_clear(out);
+            lk_gzip(in->bytes, in->bytes_len, levels[j], gz);
+            assert((unsigned char) gz->bytes[0] == 0x1f && (unsigned char) gz->bytes[1] == 0x8b);
+            gunzip(gz, out);
+            assert(out->bytes_len == in->bytes_len);
+            assert(!memcmp(out->bytes, in->bytes, in->bytes_len));
+        }
+    }
+
+    // Text compresses well, random bytes fall back to stored blocks.
+    lk_buffer_clear(gz);
+    lk_gzip(text->bytes, text->bytes_len, LK_DEFLATE_FAST, gz);
+    assert(gz->bytes_len < text->bytes_len / 4);
+    lk_buffer_clear(gz);
+    lk_gzip(noise->bytes, noise->bytes_len, LK_DEFLATE_FAST, gz);
+    assert(gz->bytes_len < noise->bytes_len + 64);
+
+    // Streamed pieces decompress to their concatenation, and each
+    // piece can be decompressed as soon as it's written.
+    LKGzipStream *gs = lk_gzipstream_new(LK_DEFLATE_FAST);
+    lk_buffer_clear(gz);
+    lk_gzipstream_write(gs, text->bytes, 1000, gz);
+    size_t sync_len = gz->bytes_len;
+    assert(!memcmp(gz->bytes + sync_len-4, "\x00\x00\xff\xff", 4));
+    lk_gzipstream_write(gs, "", 0, gz);
+    assert(gz->bytes_len == sync_len);
+    lk_gzipstream_write(gs, text->bytes+1000, text->bytes_len-1000, gz);
+    lk_gzipstream_write(gs, noise->bytes, noise->bytes_len, gz);
+    lk_gzipstream_finish(gs, gz);
+    lk_gzipstream_free(gs);
+    lk_buffer_clear(out);
+    gunzip(gz, out);
+    assert(out->bytes_len == text->bytes_len + noise->bytes_len);
+    assert(!memcmp(out->bytes, text->bytes, text->bytes_len));
+    assert(!memcmp(out->bytes + text->bytes_len, noise->bytes, noise->bytes_len));
+
+    // Empty stream
+    gs = lk_gzipstream_new(LK_DEFLATE_FAST);
+    lk_buffer_clear(gz);
+    lk_gzipstream_finish(gs, gz);
+    lk_gzipstream_free(gs);
+    lk_buffer_clear(out);
+    gunzip(gz, out);
+    assert(out->bytes_len == 0);
+
+    // Short non-ASCII inputs are sent in fixed Huffman blocks, which use
+    // 9 bit codes for bytes 0x90-0xff.
+    LKBuffer *fixed_inputs[] = {lk_buffer_new(0), lk_buffer_new(0), lk_buffer_new(0)};
+    lk_buffer_append_sz(fixed_inputs[0], "<p>Caf\xc3\xa9 na\xc3\xafve r\xc3\xa9sum\xc3\xa9 \xe2\x80\x93 \xe3\x81\x93\xe3\x82\x93</p>\n");
+    lk_buffer_append_sz(fixed_inputs[1], "\xff\xfe\x90\x8f\xa0\xff\xff\xff\xff\x90\x90\x90\x90");
+    for (int c=0; c < 256; c++) {
+        char ch = c;
+        lk_buffer_append(fixed_inputs[2], &ch, 1);
+    }
+    for (int i=0; i < 3; i++) {
+        LKBuffer *in = fixed_inputs[i];
+        for (int j=1; j < 4; j++) {
+            lk_buffer_clear(gz);
+            lk_buffer_clear(out);
+            lk_gzip(in->bytes, in->bytes_len, levels[j], gz);
+            gunzip(gz, out);
+            assert(out->bytes_len == in->bytes_len);
+            assert(!memcmp(out->bytes, in->bytes, in->bytes_len));
+        }
+    }
+    // First block type after the 10 byte gzip header is fixed Huffman.
+    lk_buffer_clear(gz);
+    lk_gzip(fixed_inputs[0]->bytes, fixed_inputs[0]->bytes_len, LK_DEFLATE_FAST, gz);
+    assert(((gz->bytes[10] >> 1) & 3) == 1);
+
+    for (int i=0; i < 3; i++) {
+        lk_buffer_free(fixed_inputs[i]);
+    }
+    for (int i=0; i < 4; i++) {
+        lk_buffer_free(inputs[i]);
+    }
+    lk_buffer_free(gz);
+    lk_buffer_free(out);
+
+    printf("Done.\n");
+}
+
+void lkchunked_test() {
+    printf("Running chunked response tests... ");
+
+    LKHttpResponse *resp = lk_httpresponse_new();
+    lk_string_assign(resp->version, "HTTP/1.1");
+    lk_httpresponse_add_header(resp, "Content-Type", "text/plain");
+    resp->chunked = 1;
+    lk_httpresponse_finalize(resp);
+    char head[256];
+    snprintf(head, sizeof(head), "%.*s", (int) resp->head->bytes_len, resp->head->bytes);
+    assert(strstr(head, "Transfer-Encoding: chunked\n") != NULL);
+    assert(strstr(head, "Content-Length") == NULL);
+
+    // Reused response goes back to Content-Length.
+    lk_httpresponse_reset(resp);
+    lk_httpresponse_finalize(resp);
+    snprintf(head, sizeof(head), "%.*s", (int) resp->head->bytes_len, resp->head->bytes);
+    assert(strstr(head, "Content-Length: 0\n") != NULL);
+    assert(strstr(head, "Transfer-Encoding") == NULL);
+    lk_httpresponse_free(resp);
+
+    printf("Done.\n");
+}
+
+void lkcgiparser_test() {
+    printf("Running parse_cgi_head tests... ");
+
+    // Headers arriving in pieces.
+    LKHttpResponse *resp = lk_httpresponse_new();
+    LKBuffer *buf = lk_buffer_new(0);
+    lk_buffer_append_sz(buf, "Content-Type: text/html\r\nSta");
+    assert(parse_cgi_head(buf, 100, resp) == 0);
+    assert(buf->bytes_cur == 25);
+    lk_buffer_append_sz(buf, "tus: 404 Not Found\r\n");
+    assert(parse_cgi_head(buf, 100, resp) == 0);
+    lk_buffer_append_sz(buf, "\r\n<html>");
+    assert(parse_cgi_head(buf, 100, resp) == 1);
+    assert(resp->status == 404);
+    assert(!strcmp(lk_stringtable_get(resp->headers, "Content-Type"), "text/html"));
+    assert(!strncmp(buf->bytes + buf->bytes_cur, "<html>", buf->bytes_len - buf->bytes_cur));
+
+    // Output without headers
+    lk_httpresponse_reset(resp);
+    lk_buffer_clear(buf);
+    lk_buffer_append_sz(buf, "1\n2\n3\n4\n5\n6\n");
+    assert(parse_cgi_head(buf, 8, resp) == -1);
+    lk_buffer_clear(buf);
+    lk_buffer_append_sz(buf, "no newline in sight");
+    assert(parse_cgi_head(buf, 8, resp) == -1);
+
+    lk_buffer_free(buf);
+    lk_httpresponse_free(resp);
+
+    printf("Done.\n");
+}
+
+void lkscan_test() {
+    printf("Running lk_scan tests... ");
+
+    char head[] = "GET /index.html HTTP/1.1\r\nHost: localhost:8000\r\n\r\n";
+    size_t head_len = strlen(head);
+    assert(lk_scan(head, head_len, "\n") == strchr(head, '\n'));
+    assert(lk_scan(head, head_len, " \t\r") == head + 3);
+    assert(lk_scan(head+26, head_len-26, ":\n") == head + 30);
+    assert(lk_scan(head, head_len, "@") == NULL);
+    assert(lk_scan(head, 0, "G") == NULL);
+    assert(lk_scan(head, 3, " ") == NULL);
+
+    // Every implementation supported by the cpu finds the same delimiter
+    // as the scalar one at any offset, length and delimiter position.
+    char bytes[200];
+    for (int impl=LK_SCAN_SCALAR; impl <= LK_SCAN_AVX2; impl++) {
+        if (lk_scan_select(impl) == -1) {
+            continue;
+        }
+        for (size_t len=0; len < 100; len++) {
+            for (size_t pos=0; pos <= len; pos++) {
+                memset(bytes, 'a', sizeof(bytes));
+                if (pos < len) {
+                    bytes[3 + pos] = (pos % 2) ? ':' : '\n';
+                }
+                bytes[3 + len] = '\n';     // just past the end, never found
+                char *p = lk_scan(bytes+3, len, ":\n");
+                if (pos < len) {
+                    assert(p == bytes + 3 + pos);
+                } else {
+                    assert(p == NULL);
+                }
+            }
+        }
+    }
+    // Bytes with the high bit set are not mistaken for delimiters.
+    memset(bytes, 0xff, sizeof(bytes));
+    bytes[150] = '\r';
+    for (int impl=LK_SCAN_SCALAR; impl <= LK_SCAN_AVX2; impl++) {
+        if (lk_scan_select(impl) == -1) {
+            continue;
+        }
+        assert(lk_scan(bytes, sizeof(bytes), "\r\n") == bytes + 150);
+    }
+    lk_scan_select(LK_SCAN_AUTO);
+
+    // lk_buffer_readline() over lines longer than dst.
+    LKBuffer *buf = lk_buffer_new(0);
+    lk_buffer_append_sz(buf, "Status: 200 OK\r\nContent-Type: text/html\nabc");
+    char line[16];
+    assert(lk_buffer_readline(buf, line, sizeof(line)) == 15);
+    assert(!strcmp(line, "Status: 200 OK\r"));
+    assert(lk_buffer_readline(buf, line, sizeof(line)) == 1);
+    assert(!strcmp(line, "\n"));
+    assert(lk_buffer_readline(buf, line, sizeof(line)) == 15);
+    assert(!strcmp(line, "Content-Type: t"));
+    assert(lk_buffer_readline(buf, line, sizeof(line)) == 9);
+    assert(!strcmp(line, "ext/html\n"));
+    assert(lk_buffer_readline(buf, line, sizeof(line)) == 3);
+    assert(!strcmp(line, "abc"));
+    assert(lk_buffer_readline(buf, line, sizeof(line)) == 0);
+    lk_buffer_free(buf);
+
+    printf("Done (%s).\n", lk_scan_impl_name());
+}
+
+void lkarena_test() {
+    printf("Running LKArena tests... ");
+
+    LKArena *arena = lk_arena_new(256);
+    char *p1 = lk_arena_alloc(arena, 1);
+    char *p2 = lk_arena_alloc(arena, 20);
+    assert(((size_t) p2 % 16) == 0);
+    assert(p2 >= p1 + 1);
+    memset(p2, 'x', 20);
+    char *s = lk_arena_strdup(arena, "littlekitten");
+    assert(!strcmp(s, "littlekitten"));
+    assert(arena->nallocs == 3);
+
+    // Allocations past the first block, and larger than a block.
+    for (int i=0; i < 100; i++) {
+        memset(lk_arena_alloc(arena, 50), 'y', 50);
+    }
+    char *big = lk_arena_alloc(arena, 1000);
+    memset(big, 'z', 1000);
+    assert(arena->nallocs == 104);
+    assert(!strcmp(s, "littlekitten"));
+
+    // Reset keeps only the first block, reused from the start.
+    unsigned long nallocs = lk_alloc_count();
+    lk_arena_reset(arena);
+    assert(arena->nallocs == 0 && arena->nbytes == 0);
+    assert(lk_arena_alloc(arena, 1) == p1);
+    assert(lk_alloc_count() == nallocs);
+
+    // String table items allocated from the arena.
+    lk_arena_reset(arena);
+    LKStringTable *st = lk_stringtable_nocase_new();
+    lk_stringtable_set_arena(st, arena);
+    nallocs = lk_alloc_count();
+    lk_stringtable_set(st, "Host", "localhost:8000");
+    lk_stringtable_set(st, "User-Agent", "lktest");
+    lk_stringtable_set(st, "host", "littlekitten.xyz");
+    assert(lk_alloc_count() == nallocs);
+    assert(st->items_len == 2);
+    assert(!strcmp(lk_stringtable_get(st, "HOST"), "littlekitten.xyz"));
+    lk_stringtable_remove(st, "Host");
+    assert(lk_stringtable_get(st, "Host") == NULL);
+    assert(!strcmp(lk_stringtable_get(st, "User-Agent"), "lktest"));
+
+    for (int n=0; n < 3; n++) {
+        lk_stringtable_clear(st);
+        lk_arena_reset(arena);
+        lk_stringtable_set(st, "Content-Type", "text/html");
+        assert(!strcmp(lk_stringtable_get(st, "content-type"), "text/html"));
+        assert(st->items_len == 1);
+    }
+
+    lk_stringtable_free(st);
+    lk_arena_free(arena);
+
+    printf("Done.\n");
+}
+
+void lkalloc_test() {
+    printf("Running lk_malloc tests... ");
+
+    unsigned long nallocs = lk_alloc_count();
+    void *p = lk_malloc(10, "lkalloc_test");
+    assert(lk_alloc_count() == nallocs+1);
+    p = lk_realloc(p, 20, "lkalloc_test");
+    assert(lk_alloc_count() == nallocs+2);
+    lk_free(p);
+
+#ifdef DEBUGALLOC
+    // More live allocations than the registry's initial size.
+    LKAllocStats stats;
+    assert(lk_alloc_stats("lkalloc_test_items", &stats) == -1);
+    void *items[20000];
+    for (int i=0; i < 20000; i++) {
+        items[i] = lk_malloc(i % 100 + 1, "lkalloc_test_items");
+    }
+    assert(lk_alloc_stats("lkalloc_test_items", &stats) == 0);
+    assert(stats.nallocs == 20000 && stats.nlive == 20000);
+    assert(stats.live_bytes == 200 * (100 * 101 / 2));
+
+    // Reallocated items move to the new label.
+    for (int i=0; i < 100; i++) {
+        items[i] = lk_realloc(items[i], 1000, "lkalloc_test_realloc");
+    }
+    assert(lk_alloc_stats("lkalloc_test_items", &stats) == 0);
+    assert(stats.nlive == 19900);
+    assert(stats.live_bytes == 199 * (100 * 101 / 2));
+    assert(lk_alloc_stats("lkalloc_test_realloc", &stats) == 0);
+    assert(stats.nlive == 100 && stats.live_bytes == 100 * 1000);
+
+    for (int i=0; i < 20000; i++) {
+        lk_free(items[i]);
+    }
+    assert(lk_alloc_stats("lkalloc_test_items", &stats) == 0);
+    assert(stats.nallocs == 20000 && stats.nlive == 0 && stats.live_bytes == 0);
+    assert(lk_alloc_stats("lkalloc_test_realloc", &stats) == 0);
+    assert(stats.nlive == 0 && stats.live_bytes == 0);
+    assert(lk_alloc_stats("lkalloc_test", &stats) == 0);
+    assert(stats.nallocs == 2 && stats.nlive == 0);
+#endif
+
+    printf("Done.\n");
+}
+
+void lkslab_test() {
+    printf("Running lk_slab tests... ");
+
+    LKSlabStats stats0, stats;
+    lk_slab_stats(&stats0);
+
+    // Freed objects are reused by allocations of the same size class.
+    void *p1 = lk_slab_alloc(24);
+    void *p2 = lk_slab_alloc(24);
+    assert(p1 != NULL && p2 != NULL && p1 != p2);
+    assert(((uintptr_t) p1 % 16) == 0 && ((uintptr_t) p2 % 16) == 0);
+    lk_slab_free(p1, 24);
+    void *p3 = lk_slab_alloc(32);
+    assert(p3 == p1);
+    void *p4 = lk_slab_alloc(33);
+    assert(p4 != p1 && p4 != p2);
+    assert(((uintptr_t) p4 % 16) == 0);
+
+    lk_slab_stats(&stats);
+    assert(stats.nallocs - stats0.nallocs == 4);
+    assert(stats.live_bytes - stats0.live_bytes == 32 + 32 + 48);
+    lk_slab_free(p2, 24);
+    lk_slab_free(p3, 32);
+    lk_slab_free(p4, 33);
+    lk_slab_stats(&stats);
+    assert(stats.live_bytes == stats0.live_bytes);
+
+    // Objects fill more than one chunk.
+    void *objs[10000];
+    for (int i=0; i < 10000; i++) {
+        objs[i] = lk_slab_alloc(i % LK_SLAB_MAXSIZE + 1);
+        assert(((uintptr_t) objs[i] % 16) == 0);
+        memset(objs[i], 0xff, i % LK_SLAB_MAXSIZE + 1);
+    }
+    lk_slab_stats(&stats);
+    assert(stats.slab_bytes > stats0.slab_bytes);
+    for (int i=0; i < 10000; i++) {
+        lk_slab_free(objs[i], i % LK_SLAB_MAXSIZE + 1);
+    }
+    lk_slab_stats(&stats);
+    assert(stats.live_bytes == stats0.live_bytes);
+
+    // Objects over LK_SLAB_MAXSIZE are allocated with malloc.
+    size_t slab_bytes = stats.slab_bytes;
+    char *big = lk_slab_alloc(LK_SLAB_MAXSIZE + 1);
+    memset(big, 0xff, LK_SLAB_MAXSIZE + 1);
+    lk_slab_free(big, LK_SLAB_MAXSIZE + 1);
+    lk_slab_stats(&stats);
+    assert(stats.slab_bytes == slab_bytes);
+    assert(stats.live_bytes == stats0.live_bytes);
+
+    // lklib objects are freed with their size.
+    LKString *lks = lk_string_new("abc");
+    LKBuffer *buf = lk_buffer_new(0);
+    lk_buffer_append(buf, "abc", 3);
+    assert(!strcmp(lks->s, "abc"));
+    lk_string_free(lks);
+    lk_buffer_free(buf);
+
+    printf("Done.\n");
+}
+
+// Start http server on a free local port serving homedir with threads
+// event loops, closing idle connections after 1 sec. Returns the server
+// pid and sets *port.
+static pid_t start_test_server(char *homedir, int threads, int *port) {
+    struct sockaddr_in sa;
+    socklen_t sa_len = sizeof(sa);
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    assert(bind(s, (struct sockaddr *) &sa, sizeof(sa)) == 0);
+    assert(getsockname(s, (struct sockaddr *) &sa, &sa_len) == 0);
+    *port = ntohs(sa.sin_port);
+    close(s);
+
+    fflush(stdout);
+    pid_t pid = fork();
+    assert(pid != -1);
+    if (pid == 0) {
+        // Server exits along with the test, even on a failed assert.
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        signal(SIGPIPE, SIG_IGN);
+        assert(freopen("/dev/null", "w", stdout) != NULL);
+
+        LKConfig *cfg = lk_config_new();
+        lk_string_assign(cfg->serverhost, "127.0.0.1");
+        lk_string_assign_sprintf(cfg->port, "%d", *port);
+        cfg->threads = threads;
+        cfg->keepalive_timeout = 1;
+        LKHostConfig *hc = lk_config_create_get_hostconfig(cfg, "*");
+        lk_string_assign(hc->homedir, homedir);
+        lk_httpserver_serve(lk_httpserver_new(cfg));
+        _exit(1);
+    }
+    return pid;
+}
+
+// Return socket connected to test server, waiting for it to start.
+// Sets the receive buffer size to rcvbuf if not 0.
+static int connect_test_server(int port, int rcvbuf) {
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sa.sin_port = htons(port);
+    for (int i=0; i < 200; i++) {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        assert(sock != -1);
+        if (rcvbuf != 0) {
+            setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        }
+        if (connect(sock, (struct sockaddr *) &sa, sizeof(sa)) == 0) {
+            return sock;
+        }
+        close(sock);
+        usleep(10000);
+    }
+    assert(0 && "test server not started");
+    return -1;
+}
+
+// Send request and return response status, or -1 if the response
+// doesn't start within 5 secs.
+static int test_request(int sock, char *req) {
+    assert(send(sock, req, strlen(req), 0) == strlen(req));
+    struct pollfd pfd = {sock, POLLIN, 0};
+    if (poll(&pfd, 1, 5000) != 1) {
+        return -1;
+    }
+    char buf[LK_BUFSIZE_SMALL];
+    int z = recv(sock, buf, sizeof(buf)-1, 0);
+    if (z <= 0) {
+        return -1;
+    }
+    buf[z] = '\0';
+    int status = -1;
+    sscanf(buf, "HTTP/%*s %d", &status);
+    return status;
+}
+
+// Send req and read responses into buf until the server closes the
+// connection. Returns number of bytes read.
+static size_t test_request_all(int sock, char *req, char *buf, size_t buf_size) {
+    assert(send(sock, req, strlen(req), 0) == strlen(req));
+    size_t len = 0;
+    struct pollfd pfd = {sock, POLLIN, 0};
+    while (len < buf_size-1 && poll(&pfd, 1, 5000) == 1) {
+        int z = recv(sock, buf+len, buf_size-1-len, 0);
+        if (z <= 0) {
+            break;
+        }
+        len += z;
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+// Request slow_req of a large file from one client per event loop, which
+// then doesn't read the response. Other clients are still served.
+static void slow_client_test(char *dir, int threads, char *slow_req) {
+    int port;
+    pid_t pid = start_test_server(dir, threads, &port);
+
+    int slow_socks[threads];
+    for (int i=0; i < threads; i++) {
+        slow_socks[i] = connect_test_server(port, 4096);
+        assert(send(slow_socks[i], slow_req, strlen(slow_req), 0) == strlen(slow_req));
+    }
+    usleep(100000);
+
+    for (int i=0; i < threads; i++) {
+        int sock = connect_test_server(port, 0);
+        assert(test_request(sock, "GET /index.html HTTP/1.0\r\n\r\n") == 200);
+        close(sock);
+    }
+
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    for (int i=0; i < threads; i++) {
+        close(slow_socks[i]);
+    }
+}
+
+void lkhttpserver_test() {
+    printf("Running LKHttpServer tests... ");
+
+    char dir[] = "/tmp/lktestXXXXXX";
+    assert(mkdtemp(dir) != NULL);
+    write_test_file(dir, "/index.html", "<html>abc</html>");
+    char big_path[PATH_MAX];
+    snprintf(big_path, sizeof(big_path), "%s/big.bin", dir);
+    FILE *f = fopen(big_path, "w");
+    assert(f != NULL);
+    assert(ftruncate(fileno(f), 64*1024*1024) == 0);
+    fclose(f);
+
+    // A client not reading a large file doesn't hold up the event loop.
+    char *slow_req = "GET /big.bin HTTP/1.0\r\n\r\n";
+    slow_client_test(dir, 1, slow_req);
+    slow_client_test(dir, 2, slow_req);
+
+    // Same for single and multipart byte ranges.
+    slow_req = "GET /big.bin HTTP/1.1\r\nRange: bytes=100-50000000\r\nConnection: close\r\n\r\n";
+    slow_client_test(dir, 1, slow_req);
+    slow_req = "GET /big.bin HTTP/1.1\r\nRange: bytes=0-10,1000-30000000,40000000-\r\nConnection: close\r\n\r\n";
+    slow_client_test(dir, 1, slow_req);
+
+    // Pipelined conditional GETs of a gzipped file get 304s without a
+    // body or Content-Encoding.
+    LKBuffer *css = lk_buffer_new(0);
+    for (int i=0; i < 100; i++) {
+        lk_buffer_append_sprintf(css, ".item%d { color: red; }\n", i);
+    }
+    write_test_file(dir, "/style.css", css->bytes);
+    lk_buffer_free(css);
+
+    int port;
+    pid_t pid = start_test_server(dir, 1, &port);
+    char resp[LK_BUFSIZE_LARGE];
+    int sock = connect_test_server(port, 0);
+    test_request_all(sock, "GET /style.css HTTP/1.1\r\nAccept-Encoding: gzip\r\nConnection: close\r\n\r\n", resp, sizeof(resp));
+    close(sock);
+    assert(strstr(resp, "Content-Encoding: gzip") != NULL);
+    char etag[64];
+    assert(sscanf(strstr(resp, "ETag: "), "ETag: %63s", etag) == 1);
+
+    char req[LK_BUFSIZE_MEDIUM];
+    snprintf(req, sizeof(req),
+        "GET /style.css HTTP/1.1\r\nAccept-Encoding: gzip\r\nIf-None-Match: %s\r\n\r\n"
+        "GET /style.css HTTP/1.1\r\nAccept-Encoding: gzip\r\nIf-None-Match: %s\r\nConnection: close\r\n\r\n",
+        etag, etag);
+    sock = connect_test_server(port, 0);
+    test_request_all(sock, req, resp, sizeof(resp));
+    close(sock);
+    assert(!strncmp(resp, "HTTP/1.1 304 ", 13));
+    char *head_end = strstr(resp, "\n\r\n");
+    assert(head_end != NULL);
+    assert(!strncmp(head_end + 3, "HTTP/1.1 304 ", 13));
+    assert(strstr(resp, "Content-Encoding") == NULL);
+    assert(!strcmp(resp + strlen(resp) - 3, "\n\r\n"));
+
+    // Connection that never sends a request is closed when idle.
+    sock = connect_test_server(port, 0);
+    struct pollfd pfd = {sock, POLLIN, 0};
+    assert(poll(&pfd, 1, 5000) == 1);
+    assert(recv(sock, resp, sizeof(resp), 0) == 0);
+    close(sock);
+
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+
+    // Loop threads sharing the file cache serve the same hot responses
+    // to clients requesting them at once.
+    pid = start_test_server(dir, 4, &port);
+    char *hot_req = "GET /index.html HTTP/1.1\r\n\r\n"
+                    "GET /style.css HTTP/1.1\r\nAccept-Encoding: gzip\r\n\r\n"
+                    "GET /index.html HTTP/1.1\r\nConnection: close\r\n\r\n";
+    int socks[16];
+    for (int i=0; i < 16; i++) {
+        socks[i] = connect_test_server(port, 0);
+        assert(send(socks[i], hot_req, strlen(hot_req), 0) == strlen(hot_req));
+    }
+    for (int i=0; i < 16; i++) {
+        size_t len = test_request_all(socks[i], "", resp, sizeof(resp));
+        close(socks[i]);
+        char *p = strstr(resp, "<html>abc</html>HTTP/1.1 200 ");
+        assert(p != NULL);
+        assert(strstr(p, "Content-Encoding: gzip") != NULL);
+        // gzipped body in between may contain nul bytes.
+        assert(len > 16 && !memcmp(resp + len - 16, "<html>abc</html>", 16));
+    }
+
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+
+    unlink(big_path);
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/index.html", dir);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/style.css", dir);
+    unlink(path);
+    rmdir(dir);
+
+    printf("Done.\n");
+}
@@ -26,7 +26,7 @@ void print_sample_config();
 
 LKHttpServer *httpserver;
 
-// lkws [homedir] [port] [host] [-f configfile] [--cgidir=cgifolder]
+// lkws [homedir] [port] [host] [-f configfile] [--cgidir=cgifolder] [--workers=n] [--threads=n]
 //
 // configfile = configuration file containing site settings
 //              see sample configuration file below
@@ -36,6 +36,10 @@ LKHttpServer *httpserver;
 //              defaults to 8000
 // host       = IP address to bind to server
 //              defaults to localhost
+// workers    = number of server processes sharing the port
+//              defaults to 1
+// threads    = number of event loop threads in each server process
+//              defaults to 1
 // Examples:
 // lkws ./testsite/ 8080
 // lkws /var/www/testsite/ 8080 127.0.0.1
@@ -89,7 +93,7 @@ void handle_sigchld(int sig) {
 void print_help() {
     printf(
 "Usage:\n"
-"lkws [homedir] [port] [host] [-f configfile] [--cgidir=cgifolder]\n"
+"lkws [homedir] [port] [host] [-f configfile] [--cgidir=cgifolder] [--workers=n] [--threads=n]\n"
 "\n"
 "configfile = configuration file containing site settings\n"
 "             see sample configuration file below\n"
@@ -99,10 +103,17 @@ void print_help() {
 "             defaults to 8000\n"
 "host       = IP address to bind to server\n"
 "             defaults to localhost\n"
+"cgifolder  = parent directory of cgi scripts\n"
+"             defaults to cgi-bin if not specified\n"
+"n          = number of server processes sharing the port (--workers)\n"
+"             or event loop threads per process (--threads)\n"
+"             defaults to 1\n"
 "Examples:\n"
 "lkws ./testsite/ 8080\n"
 "lkws /var/www/testsite/ 8080 127.0.0.1\n"
 "lkws /var/www/testsite/ --cgidir=cgi-bin\n"
+"lkws /var/www/testsite/ 8080 --workers=4\n"
+"lkws /var/www/testsite/ 8080 --threads=4\n"
 "lkws -f sites.conf\n"
 "\n"
 "Source code and docs at https://github.com/robdelacruz/lkwebserver\n"
@@ -116,6 +127,17 @@ void print_sample_config() {
 "\n"
 "serverhost=127.0.0.1\n"
 "port=5000\n"
+"workers=4\n"
+"threads=4\n"
+"keepalivetimeout=5\n"
+"keepalivemax=100\n"
+"filecachesize=256\n"
+"filecachettl=5\n"
+"hotcachesize=4096\n"
+"compress=1\n"
+"compressminsize=1024\n"
+"maxbodysize=1024\n"
+"ctxpoolsize=256\n"
 "\n"
 "# Matches all other hostnames\n"
 "hostname *\n"
@@ -130,6 +152,7 @@ void print_sample_config() {
 "hostname littlekitten.xyz\n"
 "homedir=/var/www/testsite\n"
 "cgidir=cgi-bin\n"
+"cachecontrol=public, max-age=3600\n"
 "alias latest=latest.html\n"
 "alias about=about.html\n"
 "alias guestbook=cgi-bin/guestbook.pl\n"
@@ -151,7 +174,7 @@ void print_sample_config() {
 
 typedef enum {PA_NONE, PA_FILE} ParseArgsState;
 
-// lkws [homedir] [port] [host] [--cgidir=<cgidir>] [-f <configfile>]
+// lkws [homedir] [port] [host] [--cgidir=<cgidir>] [--workers=<n>] [--threads=<n>] [-f <configfile>]
 // homedir    = absolute or relative path to a home directory
 //              defaults to current working directory if not specified
 // port       = port number to bind to server
@@ -160,12 +183,17 @@ typedef enum {PA_NONE, PA_FILE} ParseArgsState;
 //              defaults to localhost
 // cgidir     = root directory for cgi files, relative path to homedir
 //              defaults to cgi-bin
+// n          = number of server processes sharing the port (--workers)
+//              or event loop threads per process (--threads)
+//              defaults to 1
 // configfile = plaintext file containing configuration options
 //
 // Examples:
 // lkws ./testsite/ 8080
 // lkws /var/www/testsite/ 8080 127.0.0.1
 // lkws /var/www/testsite/ --cgidir=guestbook
+// lkws /var/www/testsite/ 8080 --workers=4
+// lkws /var/www/testsite/ 8080 --threads=4
 // lkws -f littlekitten.conf
 int parse_args(int argc, char *argv[], LKConfig *cfg) {
     ParseArgsState state = PA_NONE;
@@ -192,6 +220,16 @@ int parse_args(int argc, char *argv[], LKConfig *cfg) {
             lk_string_free(v);
             continue;
         }
+        // --workers=n
+        if (state == PA_NONE && !strncmp(arg, "--workers=", 10)) {
+            cfg->workers = atoi(arg + 10);
+            continue;
+        }
+        // --threads=n
+        if (state == PA_NONE && !strncmp(arg, "--threads=", 10)) {
+            cfg->threads = atoi(arg + 10);
+            continue;
+        }
         if (state == PA_FILE) {
             lk_config_read_configfile(cfg, arg);
             state = PA_NONE;